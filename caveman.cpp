@@ -1,10 +1,22 @@
 #include <cassert>
+#include <cfloat>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 
-//TODO override STB's memory allocation functions
+#include "platform.h"
+
+// STB allocates from the MemStack passed through the `userdata` field
+// of stbtt_fontinfo. Freeing is a no-op. Instead, callers release the
+// stack to a marker taken before calling into STB.
+#define STBTT_malloc(size, userdata) ((void*) allocateAligned(*(MemStack*) (userdata), (size), 16))
+#define STBTT_free(p, userdata) ((void) (p), (void) (userdata))
 #define STB_TRUETYPE_IMPLEMENTATION
 #include "stb_truetype.h"
 
-#include "platform.h"
 #include "cavemanMath.cpp"
 
 #define ArrayLength(a) (sizeof(a) / sizeof(a[0]))
@@ -25,11 +37,114 @@ struct ColorU8
 	u8 r, g, b, a;
 };
 
+enum struct PixelFormat
+{
+	// 8 bits per channel, premultiplied sRGB. This is what gets
+	// presented.
+	Bgra8,
+
+	// 16 bits per channel, premultiplied linear light. Drawing into
+	// this format blends correctly, but it has to be resolved to
+	// Bgra8 before it can be presented.
+	LinearBgra16,
+};
+
+// A rectangle of whole pixels. The max edges are exclusive.
+struct PixelRect
+{
+	i32 xMin, yMin, xMax, yMax;
+};
+
+inline bool isEmpty(PixelRect rect)
+{
+	return rect.xMin >= rect.xMax || rect.yMin >= rect.yMax;
+}
+
+inline i64 area(PixelRect rect)
+{
+	return isEmpty(rect) ? 0 : (i64) (rect.xMax - rect.xMin) * (rect.yMax - rect.yMin);
+}
+
+inline PixelRect intersect(PixelRect a, PixelRect b)
+{
+	PixelRect result;
+	result.xMin = a.xMin > b.xMin ? a.xMin : b.xMin;
+	result.yMin = a.yMin > b.yMin ? a.yMin : b.yMin;
+	result.xMax = a.xMax < b.xMax ? a.xMax : b.xMax;
+	result.yMax = a.yMax < b.yMax ? a.yMax : b.yMax;
+	return result;
+}
+
+// the smallest rectangle containing both a and b
+inline PixelRect enclose(PixelRect a, PixelRect b)
+{
+	PixelRect result;
+	result.xMin = a.xMin < b.xMin ? a.xMin : b.xMin;
+	result.yMin = a.yMin < b.yMin ? a.yMin : b.yMin;
+	result.xMax = a.xMax > b.xMax ? a.xMax : b.xMax;
+	result.yMax = a.yMax > b.yMax ? a.yMax : b.yMax;
+	return result;
+}
+
 struct Bitmap
 {
 	u32 width, height;
 	i32 pitch;
 	u8 *pixels;
+	PixelFormat format;
+
+	// When set, drawing only touches pixels inside `clip`.
+	bool clipped;
+	PixelRect clip;
+
+	// When shapeIds is set, fillRect, drawLine, drawLineRunSlice,
+	// drawLines and clearBitmap also write `shapeId` into this plane of
+	// 32-bit shape IDs, at the pixels whose color they write. The plane
+	// is as large as the bitmap, and shapeIdPitch is in bytes.
+	u8 *shapeIds;
+	i32 shapeIdPitch;
+	u32 shapeId;
+	// When antialiased is set, fillRect, drawLineRunSlice and
+	// drawLines draw shapes with anti-aliased edges at their subpixel
+	// positions.
+	bool antialiased;
+};
+
+inline u32 bytesPerPixel(PixelFormat format)
+{
+	return format == PixelFormat::LinearBgra16 ? 8 : 4;
+}
+
+// Returns the pixels of a bitmap that drawing may touch.
+inline PixelRect drawableRect(Bitmap canvas)
+{
+	PixelRect rect = {0, 0, (i32) canvas.width, (i32) canvas.height};
+	return canvas.clipped ? intersect(rect, canvas.clip) : rect;
+}
+
+inline Bitmap clipBitmap(Bitmap canvas, PixelRect clip)
+{
+	canvas.clip = drawableRect(canvas);
+	canvas.clip = intersect(canvas.clip, clip);
+	canvas.clipped = true;
+	return canvas;
+}
+
+// MSVC lets any function use any instruction set. GCC and Clang need
+// each function that uses AVX2 to be marked as such.
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+struct CpuFeatures
+{
+	bool sse2, avx2;
+
+	// Fills larger than this skip the cache with streaming stores,
+	// since the pixels would be evicted before they are read back.
+	size_t streamingStoreThreshold;
 };
 
 struct GlyphMetrics
@@ -63,18 +178,273 @@ struct Shape
 	} data;
 };
 
-const u32 maxShapeCount = 1024;
+// Identifies a shape for as long as it exists. The lower 32 bits hold
+// the index of the shape's slot, and the upper 32 bits hold the slot's
+// generation. A slot's generation changes whenever its shape is
+// removed, so stale handles to removed shapes can be detected. Free
+// slots are reused most recently freed first, so a single slot can
+// cycle quickly. A stale handle is detected until its slot has been
+// reused 2^32 - 1 times. Then the generation wraps around, and the
+// handle may resolve to a newer shape. Zero is never a valid handle.
+typedef u64 ShapeHandle;
+
+const u32 shapeHandleGenerationShift = 32;
+const ShapeHandle nullShapeHandle = 0;
+
+// Shape arrays grow in place within ranges of address space reserved
+// for this many shapes. Only pages holding shapes are committed, so
+// the limit can be set far beyond typical drawings.
+const u32 maxShapeCount = 1 << 24;
+
+// marks the ends of the z-order list and of the free slot list
+const u32 noSlot = 0xFFFFFFFF;
+
+// Equal-length arrays ("columns") whose elements all have the same
+// size, stored as a structure of arrays. Each column has its own slice
+// of a single reserved range of address space, and pages are committed
+// as the columns grow, so the columns never move.
+struct SoaArrays
+{
+	u8 *base;
+	size_t columnReserveSize;
+	u32 columnCount;
+	u32 elementSize;
+	u32 maxCount;
+	u32 count;
+	u32 committedCount;
+	// the counter in PermanentMem of the subsystem owning the arrays,
+	// which grows as pages are committed
+	size_t *bytesUsed;
+};
+
+// A rectangle's coordinates double as its world-space bounds.
+struct RectShapes
+{
+	SoaArrays soa;
+	f32 *minX, *minY, *width, *height;
+	ColorU8 *colors;
+	// z-order key of each rectangle, see Scene
+	u32 *z;
+	// slot of each rectangle
+	u32 *slots;
+};
+
+struct LineShapes
+{
+	SoaArrays soa;
+	f32 *x1, *y1, *x2, *y2;
+	// world-space bounds of each line
+	f32 *minX, *minY, *maxX, *maxY;
+	ColorU8 *colors;
+	// z-order key of each line, see Scene
+	u32 *z;
+	// slot of each line
+	u32 *slots;
+};
+
+// Refers to a shape by its type and its index in that type's
+// arrays. The type is stored in the upper bits. A shape's index
+// changes when another shape of the same type is removed, so
+// ShapeRefs should not be held on to. Use a ShapeHandle instead.
+typedef u32 ShapeRef;
+
+const u32 shapeRefTypeShift = 28;
+const u32 shapeRefIndexMask = (1 << shapeRefTypeShift) - 1;
+static_assert(maxShapeCount - 1 <= shapeRefIndexMask, "shape indices must fit in a ShapeRef");
+
+// Stores shapes with a separate set of dense arrays for each type,
+// so loops over one type of shape do not need to branch on the type.
+// A shape is removed by moving the last shape of its type into its
+// place, so the arrays stay dense.
+//
+// Every shape also owns a slot, which stays put for the shape's
+// lifetime. A slot records where its shape currently lives, and links
+// the shape into the z-order: a doubly linked list of slots in
+// painter's order, so shapes can be unlinked in constant time. Slots
+// of removed shapes are reused through a free list.
+//
+// Shapes also have a z-order key, which increases from the back of
+// the z-order to the front. Keys let loops over a type of shape find
+// the topmost shape without walking the z-order list.
+struct Scene
+{
+	RectShapes rects;
+	LineShapes lines;
+
+	SoaArrays slotSoa;
+	u32 *generations;
+	// For a slot in use, the ShapeRef of its shape. For a free slot,
+	// the next slot in the free list.
+	u32 *refs;
+	u32 *zPrev, *zNext;
+
+	u32 shapeCount;
+	u32 firstFreeSlot;
+	// the first shape drawn, and the last shape drawn
+	u32 zBack, zFront;
+	// the key given to the next shape added to the front
+	u32 nextZ;
+};
+
+// Parts of the editor that keep memory in the permanent stack.
+// Allocations are tagged with one of these, so the memory pinned
+// by each part can be tracked.
+enum struct MemSubsystem
+{
+	Font,
+	Shapes,
+	Caches,
+
+	Count,
+};
+
+// Memory for data that lives as long as the application, such as
+// fonts and shapes. Unlike the scratch stack, this is never released.
+// Subsystems that grow an array in place reserve their own stack for
+// it, but still record the memory they use here.
+struct PermanentMem
+{
+	MemStack stack;
+	// bytes allocated by each subsystem, including alignment padding
+	size_t bytesUsed[(size_t) MemSubsystem::Count];
+};
+
+// The grid's cells are squares of this many world units. The default
+// viewport is 2 units tall, so at typical window sizes a cell spans
+// a few dozen pixels, and the 5 pixel picking slop stays within one
+// or two cells.
+const f32 gridCellSize = 1.0f / 16.0f;
+
+// Shapes whose bounds cover more cells than this are kept in a
+// separate list that every query tests, so a few huge shapes do not
+// fill the grid with entries.
+const i64 maxGridCellsPerShape = 256;
+
+// Queries covering more cells than this give up, and the caller
+// falls back to testing every shape. This happens when zoomed far out.
+const i64 maxGridQueryCells = 64;
+
+// Queries also give up after finding this many candidates, which
+// happens where shapes are packed densely.
+const u32 maxGridQueryCandidates = 1024;
+
+const u32 gridBucketBits = 16;
+const u32 gridBucketCount = 1 << gridBucketBits;
+const u32 maxGridEntryCount = maxShapeCount * 8;
+
+// A hashed uniform grid over the shapes' world-space bounds, used to
+// find the shapes near a point. Each cell a shape's bounds overlap
+// holds an entry with the shape's slot. Cells are hashed into a fixed
+// number of buckets, and the entries of a bucket form a linked list.
+// Cells can share a bucket, so the shapes a query finds are only
+// candidates, and need to be hit tested.
+//
+// Links hold an entry index plus one, or zero at the end of a list,
+// so freshly committed memory is a valid empty grid.
+struct ShapeGrid
+{
+	u32 *bucketHeads;
+
+	SoaArrays entrySoa;
+	u32 *entrySlots;
+	u32 *entryNext;
+	// removed entries, linked through entryNext
+	u32 firstFreeEntry;
+
+	// slots of the shapes that cover too many cells
+	SoaArrays largeSoa;
+	u32 *largeSlots;
+};
+
+// Nodes of the BVH have up to this many children.
+const u32 bvhFanout = 16;
+
+// A tree over maxShapeCount = 16^6 shapes has 7 levels, counting the
+// leaves.
+const u32 maxBvhLevelCount = 8;
+const u32 maxBvhNodeCount = maxShapeCount + maxShapeCount / (bvhFanout - 1) + maxBvhLevelCount;
+static_assert(maxShapeCount <= 1u << 4 * (maxBvhLevelCount - 1), "the BVH needs more levels");
+
+// The tree is rebuilt once the shapes added or removed since it was
+// built outnumber this, or a quarter of the tree's leaves.
+const u32 minBvhRebuildCount = 1024;
+
+// slotLeaves entries with this bit set hold an index into the pending
+// list
+const u32 bvhPendingBit = 0x80000000;
+
+// A bounding volume hierarchy over the shapes' world-space bounds: a
+// packed R-tree, built in bulk by sorting the shapes along a Hilbert
+// curve through the centers of their bounds. Shapes close together on
+// the curve are close together in space, so each node covers a
+// compact region however unevenly the shapes are spread out. Dense
+// clusters fill many small nodes, while empty space costs nothing.
+//
+// Nodes are stored level by level, starting with the leaves, which
+// hold one shape each. The children of the k-th node of a level are
+// nodes bvhFanout * k up to bvhFanout * (k + 1) of the level below.
+//
+// Shapes added after a build wait in a pending list, which every query
+// tests. Removed shapes leave dead leaves behind. When either grows
+// too large, the tree is rebuilt. Moving a shape refits the bounds of
+// its leaf and of the nodes above it in place.
+struct ShapeBvh
+{
+	SoaArrays nodeSoa;
+	f32 *minX, *minY, *maxX, *maxY;
+	// the slot of each leaf's shape, or noSlot if it was removed
+	u32 *leafSlots;
+
+	u32 leafCount;
+	u32 deadLeafCount;
+	u32 levelCount;
+	// level l holds nodes levelStarts[l] up to levelStarts[l + 1]
+	u32 levelStarts[maxBvhLevelCount + 1];
+
+	// the leaf holding each slot's shape, or the shape's index in the
+	// pending list with bvhPendingBit set
+	SoaArrays slotSoa;
+	u32 *slotLeaves;
+
+	SoaArrays pendingSoa;
+	u32 *pendingSlots;
+
+	// the slots of the shapes found by the last query
+	SoaArrays resultSoa;
+	u32 *resultSlots;
+};
+
+const u32 maxDamageRectCount = 16;
+
+// Regions of the canvas that changed since it was last presented,
+// when less than the whole canvas needs redrawing.
+struct Damage
+{
+	u32 rectCount;
+	PixelRect rects[maxDamageRectCount];
+};
+
+// The selected shapes, as a list of their slots in increasing order.
+// Removing a shape removes it from the selection, so the slots always
+// hold shapes.
+struct Selection
+{
+	SoaArrays soa;
+	u32 *slots;
+};
 
 enum struct ApplicationState
 {
 	DEFAULT,
 	PANNING,
 	ZOOMING,
+	SELECTING,
 };
 
 struct Application
 {
 	MemStack scratchMem;
+	PermanentMem permanentMem;
 
 	AsciiFont font;
 
@@ -88,19 +458,58 @@ struct Application
 //TODO prevent the viewport size from becoming negative or close zero.
 	f32 viewportSize;
 
+	CpuFeatures cpu;
 	Bitmap canvas;
+	// drawCanvas redraws everything. Otherwise, only the damaged
+	// regions are redrawn. Both are reset once the canvas is
+	// presented.
 	bool drawCanvas;
-
-//TODO allow the capacity of the shapes array to grow
-	u32 shapeCount;
-	Shape shapes[maxShapeCount];
+	Damage damage;
+	// the memory totals and the state the overlay showed when last
+	// drawn
+	size_t overlayBytesUsed[(size_t) MemSubsystem::Count];
+	ApplicationState overlayState;
+
+	// When linearBlending is set, everything is drawn into the
+	// higher precision linearCanvas, then resolved into canvas.
+	bool linearBlending;
+	bool toggleLinearBlending;
+	Bitmap linearCanvas;
+
+	// When antialiasing is set, the scene's shapes are drawn with
+	// anti-aliased edges.
+	bool antialiasing;
+	bool toggleAntialiasing;
+
+	// When shapeIdsEnabled is set, drawing the scene also writes the ID
+	// of the shape drawn last at each pixel into shapeIds, which is as
+	// large as the canvas, so picking can look shapes up by pixel.
+	// Otherwise, picking tests the shapes' geometry. shapeIdsCurrent is
+	// cleared when the IDs may no longer match the canvas, until the
+	// next frame is drawn.
+	bool shapeIdsEnabled;
+	bool toggleShapeIds;
+	bool shapeIdsCurrent;
+	u32 *shapeIds;
+	u32 shapeIdsWidth, shapeIdsHeight;
+
+	Scene scene;
+	ShapeGrid grid;
+	ShapeBvh bvh;
 
 	i32 panStartX, panStartY;
 	i32 zoomStartY;
+	// The corner of the selection rectangle where dragging started,
+	// and the one under the cursor when the rectangle was last drawn.
+	i32 selectStartX, selectStartY;
+	i32 selectEndX, selectEndY;
 
 	bool selectShape;
-	bool shapeSelected;
-	u32 selectedShapeIndex;
+	bool selectShapesInRect;
+	bool removeSelectedShape;
+	// how many steps to move the selected shapes along each axis
+	i32 nudgeSelectionX, nudgeSelectionY;
+	Selection selection;
 };
 
 inline f32 min(f32 a, f32 b)
@@ -119,41 +528,348 @@ inline f32 clamp(f32 a, f32 minVal, f32 maxVal)
 	return min(max(a, minVal), maxVal);
 }
 
-inline MemStack newMemStack(size_t capacity)
+// Memory is committed in chunks of this size as the top of a stack
+// advances, to avoid calling into the OS for every allocation.
+const size_t memCommitGranularity = 64 * 1024;
+
+// When released memory leaves more than this many committed bytes
+// above the top of a stack, the pages beyond this amount are
+// decommitted. Keeping some pages committed prevents a stack that
+// repeatedly grows and shrinks by a small amount from continuously
+// committing and decommitting the same pages.
+const size_t memDecommitThreshold = 1024 * 1024;
+
+inline static u8* alignUp(u8 *p, size_t alignment)
+{
+	assert((alignment & (alignment - 1)) == 0);
+	return (u8*) (((uintptr_t) p + (alignment - 1)) & ~(uintptr_t) (alignment - 1));
+}
+
+// Reserves address space for a memory block. In large page
+// mode, the whole block is committed as soon as it is reserved.
+// If large pages are not available, regular pages are used.
+static u8* reserveMemBlock(size_t& size, bool& largePages, u8*& committed)
+{
+	u8 *block = nullptr;
+	if (largePages)
+	{
+		size_t largeSize = size;
+		block = (u8*) PLATFORM_reserve(largeSize, true);
+		if (block != nullptr)
+		{
+			size = largeSize;
+			committed = block + size;
+			return block;
+		}
+		largePages = false;
+	}
+
+	block = (u8*) PLATFORM_reserve(size, false);
+	committed = block;
+	return block;
+}
+
+// Commits pages so that all memory below `end` is usable.
+static bool commitMemStack(MemStack& m, u8 *end)
+{
+	assert(end <= m.ceiling);
+	if (end <= m.committed)
+	{
+		return true;
+	}
+
+	u8 *newCommitted = alignUp(end, memCommitGranularity);
+	if (newCommitted > m.ceiling)
+	{
+		newCommitted = m.ceiling;
+	}
+	if (!PLATFORM_commit(m.committed, newCommitted - m.committed))
+	{
+		return false;
+	}
+	m.committed = newCommitted;
+	return true;
+}
+
+// Decommits pages that lie far enough above the top of the stack.
+static void trimMemStack(MemStack& m)
+{
+	if (m.largePages)
+	{
+		return;
+	}
+
+	// Pages are kept up to the first granule boundary past the
+	// threshold. Within a granule of the threshold, that boundary is
+	// at or above the committed end, and nothing is decommitted.
+	u8 *newCommitted = alignUp(m.top + memDecommitThreshold, memCommitGranularity);
+	if (newCommitted >= m.committed)
+	{
+		return;
+	}
+	bool decommitted = PLATFORM_decommit(newCommitted, m.committed - newCommitted);
+	assert(decommitted);
+	m.committed = newCommitted;
+}
+
+// Creates a stack that reserves `capacity` bytes of address space
+// and commits it as the stack grows. Pointers into the stack stay
+// valid as it grows, so the capacity can be set generously.
+inline MemStack newMemStack(size_t capacity, bool largePages)
 {
 	MemStack m = {};
-	m.floor = (u8*) PLATFORM_alloc(capacity);
+	m.largePages = largePages;
+	m.floor = reserveMemBlock(capacity, m.largePages, m.committed);
 	assert(m.floor != nullptr);
 	m.top = m.floor;
 	m.ceiling = m.floor + capacity;
 	return m;
 }
 
+// Each chained block begins with a header holding the state of the
+// block that was active before it. The header is padded so the
+// block's usable memory begins on a 16 byte boundary.
+const size_t memBlockHeaderSize = (sizeof(MemStack) + 15) & ~(size_t) 15;
+
+// Makes a new block the active block of the stack. The block is
+// either taken from the retired list, or freshly reserved when no
+// retired block is large enough.
+static bool pushMemBlock(MemStack& m, size_t size)
+{
+	// `allocate` keeps the top of a block below its ceiling,
+	// so the block must have room for one extra byte.
+	size_t minBlockSize = memBlockHeaderSize + size + 1;
+
+	u8 *block = nullptr;
+	size_t blockSize = 0;
+	u8 *committed = nullptr;
+	bool largePages = m.largePages;
+	MemStack **pRetired = &m.retired;
+	while (*pRetired != nullptr)
+	{
+		MemStack *retired = *pRetired;
+		size_t retiredSize = retired->ceiling - (u8*) retired;
+		if (retiredSize >= minBlockSize)
+		{
+			*pRetired = retired->retired;
+			block = (u8*) retired;
+			blockSize = retiredSize;
+			committed = retired->committed;
+			largePages = retired->largePages;
+			break;
+		}
+		pRetired = &retired->retired;
+	}
+
+	if (block == nullptr)
+	{
+		// New blocks are the same size as the active block, unless the
+		// allocation is too large to fit in a block that size.
+		blockSize = m.ceiling - m.floor;
+		if (m.next != nullptr)
+		{
+			blockSize += memBlockHeaderSize;
+		}
+		if (blockSize < minBlockSize)
+		{
+			blockSize = minBlockSize;
+		}
+		block = reserveMemBlock(blockSize, largePages, committed);
+		if (block == nullptr)
+		{
+			return false;
+		}
+	}
+
+	MemStack newBlock = {};
+	newBlock.floor = block + memBlockHeaderSize;
+	newBlock.top = newBlock.floor;
+	newBlock.ceiling = block + blockSize;
+	newBlock.committed = committed;
+	newBlock.largePages = largePages;
+	if (!commitMemStack(newBlock, newBlock.floor))
+	{
+		return false;
+	}
+
+	auto header = (MemStack*) block;
+	*header = m;
+	header->retired = nullptr;
+
+	newBlock.next = header;
+	newBlock.retired = m.retired;
+	newBlock.paddingBytes = m.paddingBytes;
+	m = newBlock;
+	return true;
+}
+
+// Retires the active block, and makes the previous block in
+// the chain active again.
+static void popMemBlock(MemStack& m)
+{
+	assert(m.next != nullptr);
+
+	m.top = m.floor;
+	trimMemStack(m);
+
+	auto header = m.next;
+	MemStack *retired = m.retired;
+	size_t paddingBytes = m.paddingBytes;
+	MemStack previous = *header;
+
+	// the header memory is reused to link the block into the retired list
+	header->ceiling = m.ceiling;
+	header->committed = m.committed;
+	header->largePages = m.largePages;
+	header->retired = retired;
+
+	m = previous;
+	m.retired = header;
+	m.paddingBytes = paddingBytes;
+}
+
 inline u8* allocate(MemStack& m, size_t size)
 {
 	size_t capacity = m.ceiling - m.top;
-	if (size > capacity)
-	{
-//TODO Handle overflow. Probably want to allocate additional
-// memory. Reallocating the stack will invalidate pointers,
-// requires keeping in memory both the old and new memory chunks,
-// and could require a large data copy from the old to new memory.
-// Could create a linked list of stacks. This is a little more
-// complex to manage, but should work well. Will worry about this
-// more later, when we have a better idea of the application's
-// allocation patterns.
-//
-// Additional allocation could fail - in this case, we can either
+	if (size >= capacity)
+	{
+		if (!pushMemBlock(m, size))
+		{
+			goto allocationFailed;
+		}
+	}
+	if (!commitMemStack(m, m.top + size))
+	{
+		goto allocationFailed;
+	}
+
+	{
+		auto p = m.top;
+		m.top += size;
+		return p;
+	}
+
+allocationFailed:
+//TODO Additional allocation failed - in this case, we can either
 // tell the user to download more RAM, or close the application.
-		assert(false);
-		volatile u8 **bad = nullptr;
-		return (u8*) (*bad);
+	assert(false);
+	return nullptr;
+}
+
+inline u8* allocateAligned(MemStack& m, size_t size, size_t alignment)
+{
+	size_t padding = alignUp(m.top, alignment) - m.top;
+	size_t capacity = m.ceiling - m.top;
+	if (padding + size >= capacity)
+	{
+		// The floor of a new block is only 16 byte aligned, so
+		// leave room to pad up to larger alignments.
+		if (!pushMemBlock(m, size + alignment - 1))
+		{
+			assert(false);
+			return nullptr;
+		}
+		padding = alignUp(m.top, alignment) - m.top;
+	}
+
+	u8 *p = allocate(m, padding + size);
+	if (p == nullptr)
+	{
+		return nullptr;
+	}
+	m.paddingBytes += padding;
+	return p + padding;
+}
+
+inline u8* allocatePermanent(
+	PermanentMem& mem, MemSubsystem subsystem, size_t size, size_t alignment)
+{
+	assert(subsystem < MemSubsystem::Count);
+	size_t paddingBytes = mem.stack.paddingBytes;
+	u8 *p = allocateAligned(mem.stack, size, alignment);
+	if (p != nullptr)
+	{
+		paddingBytes = mem.stack.paddingBytes - paddingBytes;
+		mem.bytesUsed[(size_t) subsystem] += size + paddingBytes;
 	}
-	auto p = m.top;
-	m.top += size;
 	return p;
 }
 
+// Each column of a SoaArrays reserves enough space for `maxCount`
+// elements, rounded up so every column begins on a commit boundary.
+// Pages are committed in every column at once, and counted against
+// `subsystem`.
+static bool newSoaArrays(
+	SoaArrays& soa, u32 columnCount, u32 elementSize, u32 maxCount,
+	PermanentMem& mem, MemSubsystem subsystem)
+{
+	assert(subsystem < MemSubsystem::Count);
+	assert(elementSize > 0 && memCommitGranularity % elementSize == 0);
+	soa = {};
+	size_t columnSize = (size_t) maxCount * elementSize;
+	soa.columnReserveSize = (columnSize + memCommitGranularity - 1) & ~(memCommitGranularity - 1);
+	size_t size = columnCount * soa.columnReserveSize;
+	soa.base = (u8*) PLATFORM_reserve(size, false);
+	soa.columnCount = columnCount;
+	soa.elementSize = elementSize;
+	soa.maxCount = maxCount;
+	soa.bytesUsed = &mem.bytesUsed[(size_t) subsystem];
+	return soa.base != nullptr;
+}
+
+inline void* soaColumn(SoaArrays& soa, u32 column)
+{
+	assert(column < soa.columnCount);
+	return soa.base + column * soa.columnReserveSize;
+}
+
+// Commits memory in every column for at least `count` elements.
+static bool reserveSoaArrays(SoaArrays& soa, u32 count)
+{
+	if (count <= soa.committedCount)
+	{
+		return true;
+	}
+	if (count > soa.maxCount)
+	{
+		return false;
+	}
+
+	u32 commitCount = (u32) (memCommitGranularity / soa.elementSize);
+	u32 newCommittedCount = (count + commitCount - 1) / commitCount * commitCount;
+	if (newCommittedCount > soa.maxCount)
+	{
+		newCommittedCount = soa.maxCount;
+	}
+
+	size_t offset = (size_t) soa.committedCount * soa.elementSize;
+	size_t size = (size_t) (newCommittedCount - soa.committedCount) * soa.elementSize;
+	for (u32 column = 0; column < soa.columnCount; ++column)
+	{
+		u8 *columnBase = (u8*) soaColumn(soa, column);
+		if (!PLATFORM_commit(columnBase + offset, size))
+		{
+			return false;
+		}
+		*soa.bytesUsed += size;
+	}
+	soa.committedCount = newCommittedCount;
+	return true;
+}
+
+// Adds an element to the end of every column, returning its index
+// through `index`. Elements are left zeroed.
+static bool pushSoaElement(SoaArrays& soa, u32& index)
+{
+	if (!reserveSoaArrays(soa, soa.count + 1))
+	{
+		return false;
+	}
+	index = soa.count;
+	++soa.count;
+	return true;
+}
+
 inline MemMarker mark(MemStack m)
 {
 	return MemMarker{m.top};
@@ -161,8 +877,16 @@ inline MemMarker mark(MemStack m)
 
 inline void release(MemStack& m, MemMarker marker)
 {
+	// Pop blocks until reaching the block the marker was taken in.
+	// The top of a block never reaches its ceiling, so a marker
+	// cannot be mistaken for an address in an adjacent block.
+	while (marker._0 < m.floor || marker._0 >= m.ceiling)
+	{
+		popMemBlock(m);
+	}
 	assert(m.top - marker._0 >= 0);
 	m.top = marker._0;
+	trimMemStack(m);
 }
 
 inline u32 roundUpPowerOf2(u32 a)
@@ -185,6 +909,13 @@ inline static void swap(i32& a, i32& b)
 	b = tmp;
 }
 
+inline static void swap(f32& a, f32& b)
+{
+	auto tmp = a;
+	a = b;
+	b = tmp;
+}
+
 inline static size_t cStringLength(const char *str)
 {
 	const char *strBegin = str;
@@ -195,663 +926,5450 @@ inline static size_t cStringLength(const char *str)
 	return str - strBegin;
 }
 
-void clearBitmap(Bitmap canvas, ColorU8 color)
+// Copies a string, but not its terminator, returning where it ends.
+inline static char* appendCString(char *dest, const char *str)
 {
-	auto *pPixels = canvas.pixels;
-	for (u32 y = 0; y < canvas.height; ++y)
+	while (*str != '\0')
 	{
-		auto pRow = pPixels;
-		for (u32 x = 0; x < canvas.width; ++x)
-		{
-			pRow[0] = color.b;
-			pRow[1] = color.g;
-			pRow[2] = color.r;
-			pRow[3] = color.a;
-			pRow += 4;
-		}
-		pPixels += canvas.pitch;
+		*dest = *str;
+		++dest;
+		++str;
 	}
+	return dest;
 }
 
-void fillRect(Bitmap canvas, RectF32 rect, ColorU8 color)
+// Writes a number in decimal, returning the end of the digits.
+static char* appendDecimal(char *dest, u64 value)
 {
-	assert(rect.width >= 0.0);
-	assert(rect.height >= 0.0);
-
-	u32 clipXMin = (u32) clamp(rect.min.x, 0.0f, (f32) canvas.width);
-	u32 clipXMax = (u32) clamp(rect.min.x + rect.width, 0.0f, (f32) canvas.width);
-	u32 clipYMin = (u32) clamp(rect.min.y, 0.0f, (f32) canvas.height);
-	u32 clipYMax = (u32) clamp(rect.min.y + rect.height, 0.0f, (f32) canvas.height);
-
-	auto *pPixels = canvas.pixels + clipYMin * canvas.pitch;
-	for (u32 y = clipYMin; y < clipYMax; ++y)
+	char digits[20];
+	u32 digitCount = 0;
+	do
 	{
-		auto pRow = pPixels + clipXMin * 4;
-		for (u32 x = clipXMin; x < clipXMax; ++x)
-		{
-			pRow[0] = color.b;
-			pRow[1] = color.g;
-			pRow[2] = color.r;
-			pRow[3] = color.a;
-			pRow += 4;
-		}
-		pPixels += canvas.pitch;
+		digits[digitCount] = (char) ('0' + value % 10);
+		++digitCount;
+		value /= 10;
+	} while (value != 0);
+	while (digitCount > 0)
+	{
+		--digitCount;
+		*dest = digits[digitCount];
+		++dest;
 	}
+	return dest;
 }
 
-const u8 COHEN_SUTHERLAND_LEFT_REGION = 0x1;
-const u8 COHEN_SUTHERLAND_RIGHT_REGION = 0x2;
-const u8 COHEN_SUTHERLAND_BOTTOM_REGION = 0x4;
-const u8 COHEN_SUTHERLAND_TOP_REGION = 0x8;
-
-static u8 cohenSutherlandComputeRegion(Vec2 min, Vec2 max, Vec2 p)
+static CpuFeatures detectCpuFeatures()
 {
-	assert(min.x <= max.x);
-	assert(min.y <= max.y);
+	CpuFeatures cpu = {};
 
-	u8 region = 0;
-	if (p.x < min.x)
-	{
-		region |= COHEN_SUTHERLAND_LEFT_REGION;
-	} else if (p.x > max.x)
+	i32 regs[4] = {};
+#ifdef _MSC_VER
+	__cpuid(regs, 0);
+#else
+	__cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	i32 maxLeaf = regs[0];
+
+	if (maxLeaf >= 1)
 	{
-		region |= COHEN_SUTHERLAND_RIGHT_REGION;
+#ifdef _MSC_VER
+		__cpuid(regs, 1);
+#else
+		__cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		cpu.sse2 = (regs[3] & (1 << 26)) != 0;
+
+		// AVX state must also be enabled by the OS, which is
+		// reported through XCR0 when OSXSAVE is set.
+		bool osSavesAvx = false;
+		if ((regs[2] & (1 << 27)) != 0 && (regs[2] & (1 << 28)) != 0)
+		{
+#ifdef _MSC_VER
+			u64 xcr0 = _xgetbv(0);
+#else
+			u32 xcr0Low, xcr0High;
+			__asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+			u64 xcr0 = ((u64) xcr0High << 32) | xcr0Low;
+#endif
+			osSavesAvx = (xcr0 & 0x6) == 0x6;
+		}
+
+		if (osSavesAvx && maxLeaf >= 7)
+		{
+#ifdef _MSC_VER
+			__cpuidex(regs, 7, 0);
+#else
+			__cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+			cpu.avx2 = (regs[1] & (1 << 5)) != 0;
+		}
 	}
 
-	if (p.y < min.y)
-	{
-		region |= COHEN_SUTHERLAND_BOTTOM_REGION;
-	} else if (p.y > max.y)
+	cpu.streamingStoreThreshold = PLATFORM_lastLevelCacheSize();
+	if (cpu.streamingStoreThreshold == 0)
 	{
-		region |= COHEN_SUTHERLAND_TOP_REGION;
+		cpu.streamingStoreThreshold = 8 * 1024 * 1024;
 	}
 
-	return region;
+	return cpu;
 }
 
-inline static void cohenSutherlandClipPoint(
-	Vec2 min, Vec2 max, LineF32 line, u8& region, Vec2& p)
+inline u32 packPixel(ColorU8 color)
 {
-	f32 dx = line.p2.x - line.p1.x;
-	f32 dy = line.p2.y - line.p1.y;
-	if (region & COHEN_SUTHERLAND_TOP_REGION)
-	{
-		p.x = line.p1.x + dx * (max.y - line.p1.y) / dy;
-		p.y = max.y;
-	} else if (region & COHEN_SUTHERLAND_BOTTOM_REGION)
-	{
-		p.x = line.p1.x + dx * (min.y - line.p1.y) / dy;
-		p.y = min.y;
-	} else if (region & COHEN_SUTHERLAND_RIGHT_REGION)
+	return (u32) color.b
+		| ((u32) color.g << 8)
+		| ((u32) color.r << 16)
+		| ((u32) color.a << 24);
+}
+
+static void fillPixelsScalar(u32 *pPixels, size_t count, u32 pixel)
+{
+	for (size_t i = 0; i < count; ++i)
 	{
-		p.x = max.x;
-		p.y = line.p1.y + dy * (max.x - line.p1.x) / dx;
-	} else if (region & COHEN_SUTHERLAND_LEFT_REGION)
+		pPixels[i] = pixel;
+	}
+}
+
+// Writes single pixels until `pPixels` is aligned to `alignment`
+// bytes, and returns how many were written.
+inline size_t fillPixelsUntilAligned(u32 *pPixels, size_t count, u32 pixel, size_t alignment)
+{
+	size_t headCount = ((alignment - ((uintptr_t) pPixels & (alignment - 1))) & (alignment - 1)) / 4;
+	if (headCount > count)
 	{
-		p.x = min.x;
-		p.y = line.p1.y + dy * (min.x - line.p1.x) / dx;
+		headCount = count;
 	}
 
-	region = cohenSutherlandComputeRegion(min, max, p);
+	fillPixelsScalar(pPixels, headCount, pixel);
+	return headCount;
 }
 
-inline static bool clipLineCohenSutherland(Vec2 min, Vec2 max, LineF32& line)
+static void fillPixelsSse2(u32 *pPixels, size_t count, u32 pixel, bool streaming)
 {
-	assert(min.x <= max.x);
-	assert(min.y <= max.y);
-
-	u8 region1 = cohenSutherlandComputeRegion(min, max, line.p1);
-	u8 region2 = cohenSutherlandComputeRegion(min, max, line.p2);
+	size_t i = fillPixelsUntilAligned(pPixels, count, pixel, 16);
 
-//TODO see if this loop can be unrolled - this may yield faster code
-	for (;;)
+	__m128i wide = _mm_set1_epi32((i32) pixel);
+	if (streaming)
 	{
-		if ((region1 | region2) == 0)
-		{
-			return true;
-		}
-		if ((region1 & region2) != 0)
+		for (; i + 4 <= count; i += 4)
 		{
-			return false;
+			_mm_stream_si128((__m128i*) (pPixels + i), wide);
 		}
-		
-		if (region1 == 0)
-		{
-			cohenSutherlandClipPoint(min, max, line, region2, line.p2);
-		} else
+	} else
+	{
+		for (; i + 4 <= count; i += 4)
 		{
-			cohenSutherlandClipPoint(min, max, line, region1, line.p1);
+			_mm_store_si128((__m128i*) (pPixels + i), wide);
 		}
 	}
+
+	fillPixelsScalar(pPixels + i, count - i, pixel);
 }
 
-void drawLine(Bitmap canvas, LineF32 line, ColorU8 color)
+TARGET_AVX2
+static void fillPixelsAvx2(u32 *pPixels, size_t count, u32 pixel, bool streaming)
 {
-	// The main Bresenham's loop always runs at least one iteration,
-	// and writes a pixel to the bitmap every iteration. When the
-	// canvas has zero area, it has no memory allocated to it. Thus,
-	// when the canvas has zero area, this function will access invalid
-	// memory.
-	assert(canvas.width > 0 && canvas.height > 0);
+	size_t i = fillPixelsUntilAligned(pPixels, count, pixel, 32);
 
-//TODO inlining the min (0, 0) may yield a slightly more efficient clipping algorithm
-	Vec2 min = {0.0f, 0.0f};
-	Vec2 max = {(f32) (canvas.width - 1), (f32) (canvas.height - 1)};
-//TODO investigate the Liang-Barsky clipping algorithm
-	if (!clipLineCohenSutherland(min, max, line))
+	__m256i wide = _mm256_set1_epi32((i32) pixel);
+	if (streaming)
 	{
-		return;
-	}
-
-	i32 x1 = (i32) line.p1.x;
-	i32 y1 = (i32) line.p1.y;
-	i32 x2 = (i32) line.p2.x;
-	i32 y2 = (i32) line.p2.y;
-
-	assert(x1 >= 0);
-	assert((u32) x1 < canvas.width);
-	assert(x2 >= 0);
-	assert((u32) x2 < canvas.width);
-
-	assert(y1 >= 0);
-	assert((u32) y1 < canvas.height);
-	assert(y2 >= 0);
-	assert((u32) y2 < canvas.height);
-
-	if (x1 > x2)
+		for (; i + 8 <= count; i += 8)
+		{
+			_mm256_stream_si256((__m256i*) (pPixels + i), wide);
+		}
+	} else
 	{
-		swap(x1, x2);
-		swap(y1, y2);
+		for (; i + 8 <= count; i += 8)
+		{
+			_mm256_store_si256((__m256i*) (pPixels + i), wide);
+		}
 	}
 
-	i32 dx = x2 - x1;
-	i32 dy = y2 - y1;
+	fillPixelsScalar(pPixels + i, count - i, pixel);
+}
 
-	// Lines with a negative slope need to decrement rows rather
-	// than increment them, and the start and end indices need
-	// to be swapped.
-	i32 incrY;
-	u32 startY, endY;
-	if (dy < 0)
+// Fills a run of `count` pixels with the widest kernel the CPU has.
+// Short runs are mostly head and tail, so they stay scalar.
+inline void fillPixels(const CpuFeatures& cpu, u32 *pPixels, size_t count, u32 pixel, bool streaming)
+{
+	if (count < 16)
 	{
-		incrY = -canvas.pitch;
-		dy = -dy;
-		startY = y2;
-		endY = y1;
-	} else
+		fillPixelsScalar(pPixels, count, pixel);
+	} else if (cpu.avx2)
 	{
-		incrY = canvas.pitch;
-		startY = y1;
-		endY = y2;
-	}
-
-	// If the magnitude of the slope is greater than one, increment
-	// the y value by one each iteration instead of the x value, and
-	// increment the x value dependent on the error instead of the y
-	// value. Otherwise, the line will not draw correctly since the
-	// algorithm assumes that vertical changes will be either 0 or 1
-	// pixels, which is not the case when the slope is greater than one.
-	i32 i, endI, d1, d2;
-	size_t incr1, incr2;
-	if (dx >= dy)
+		fillPixelsAvx2(pPixels, count, pixel, streaming);
+	} else if (cpu.sse2)
 	{
-		i = x1;
-		endI = x2;
-		d1 = dy;
-		d2 = dx;
-		incr1 = 4;
-		incr2 = incrY;
+		fillPixelsSse2(pPixels, count, pixel, streaming);
 	} else
 	{
-		i = startY;
-		endI = endY;
-		d1 = dx;
-		d2 = dy;
-		incr1 = incrY;
-		incr2 = 4;
+		fillPixelsScalar(pPixels, count, pixel);
 	}
+}
 
-	// Bresenham's algorithm
-	i32 error = 0;
-	auto pPixels = canvas.pixels + y1 * canvas.pitch + 4 * x1;
-	while (i <= endI)
+// Lookup tables for converting between sRGB and linear light. Linear
+// values are 16-bit, and are looked up by their top 12 bits when
+// converting back. Entries in linearToSrgb are widened to 32 bits so
+// that the resolve can gather from the table.
+struct GammaTables
+{
+	u16 srgbToLinear[256];
+	u32 linearToSrgb[4096];
+};
+
+// Filled once by buildGammaTables at init. The tables never change
+// after that.
+static GammaTables gammaTables;
+
+static void buildGammaTables(GammaTables& tables)
+{
+	for (u32 i = 0; i < ArrayLength(tables.srgbToLinear); ++i)
 	{
-		pPixels[0] = color.b;
-		pPixels[1] = color.g;
-		pPixels[2] = color.r;
-		pPixels[3] = color.a;
-		pPixels += incr1;
-		++i;
+		f32 c = (f32) i / 255.0f;
+		f32 linear = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+		tables.srgbToLinear[i] = (u16) (linear * 65535.0f + 0.5f);
+	}
 
-		error += d1;
-		if ((error << 1) >= d2)
-		{
-			pPixels += incr2;
-			error -= d2;
-		}
+	for (u32 i = 0; i < ArrayLength(tables.linearToSrgb); ++i)
+	{
+		// sample the middle of the range of linear values that
+		// share these top 12 bits
+		f32 linear = ((f32) i + 0.5f) / 4096.0f;
+		f32 c = linear <= 0.0031308f
+			? linear * 12.92f
+			: 1.055f * std::pow(linear, 1.0f / 2.4f) - 0.055f;
+		tables.linearToSrgb[i] = (u32) (clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f);
 	}
 }
 
-void drawText(
-	const AsciiFont& font,
-	Bitmap canvas,
-	const char *strBegin,
-	const char *strEnd,
-	i32 leftEdge,
-	i32 baseline,
-	ColorU8 textColor)
+// Linear pixels pack four 16-bit channels in BGRA order. Scaling
+// uses (channel * scale) >> 16, which is what _mm_mulhi_epu16 does,
+// so the scalar and vector kernels give identical results.
+inline u64 scaleLinearPixel(u64 pixel, u32 scale)
 {
-	u32 bmpSize = font.bitmapWidth * font.bitmapHeight;
-	while (strBegin != strEnd)
+	u64 result = 0;
+	for (u32 shift = 0; shift < 64; shift += 16)
 	{
-		char c = *strBegin;
-		++strBegin;
-
-		GlyphMetrics glyph = font.glyphMetrics[c];
-
-		i32 glyphX = leftEdge + glyph.offsetLeft;
-
-		// clip the left edge
-		i32 bmpStartCol;
-		if (glyphX < 0)
-		{
-			bmpStartCol = -glyphX;
-			glyphX = 0;
-		} else
-		{
-			bmpStartCol = 0;
-		}
-
-		// clip the right edge
-		i32 bmpEndCol;
-		if (glyphX + (i32) font.bitmapWidth >= (i32) canvas.width)
-		{
-			bmpEndCol = (i32) canvas.width - glyphX;
-		} else
-		{
-			bmpEndCol = font.bitmapWidth;
-		}
-
-		i32 glyphY = baseline - glyph.offsetTop;
-
-		// clip the bottom edge
-		i32 bmpEndRow;
-		if (glyphY < (i32) font.bitmapHeight - 1)
-		{
-			bmpEndRow = glyphY + 1;
-		} else
-		{
-			bmpEndRow = font.bitmapHeight;
-		}
-
-		// clip the top edge
-		i32 bmpStartRow;
-		if (glyphY >= (i32) canvas.height)
-		{
-			bmpStartRow = glyphY - (i32) canvas.height + 1;
-			glyphY = canvas.height - 1;
-		} else
-		{
-			bmpStartRow = 0;
-		}
-
-		auto pCanvas = canvas.pixels + canvas.pitch * glyphY;
-		auto pBmp = font.bitmaps + bmpSize * c + bmpStartRow * font.bitmapWidth;
-		for (i32 row = bmpStartRow; row < bmpEndRow; ++row)
-		{
-			auto pCanvasRow = pCanvas + 4 * glyphX;
-			auto pBmpRow = pBmp + bmpStartCol;
-			for (i32 col = bmpStartCol; col < bmpEndCol; ++col)
-			{
-				u8 alpha = *pBmpRow;
-//TODO increase the canvas bit depth for better alpha compositing
-				pCanvasRow[0] = (u8) (((u16) alpha * (u16) textColor.b + (u16) pCanvasRow[0] * (u16) (255 - alpha)) >> 8);
-				pCanvasRow[1] = (u8) (((u16) alpha * (u16) textColor.g + (u16) pCanvasRow[1] * (u16) (255 - alpha)) >> 8);
-				pCanvasRow[2] = (u8) (((u16) alpha * (u16) textColor.r + (u16) pCanvasRow[2] * (u16) (255 - alpha)) >> 8);
-//TODO compute the correct destination alpha value - it should be a combination of the canvas and text alphas
-				pCanvasRow[3] = 255;
-				pCanvasRow += 4;
-				++pBmpRow;
-			}
-			pCanvas -= canvas.pitch;
-			pBmp += font.bitmapWidth;
-		}
-
-		leftEdge += glyph.advanceX;
+		u64 channel = (pixel >> shift) & 0xFFFF;
+		result |= ((channel * scale) >> 16) << shift;
 	}
+	return result;
 }
 
-inline Vec2 globalToPixelSpace(Vec2 viewportMin, f32 pixelsPerUnit, Vec2 v)
+// Converts a color to a premultiplied linear pixel.
+inline u64 linearPixel(ColorU8 color)
 {
-	return (v - viewportMin) * pixelsPerUnit;
+	u64 alpha = (u64) color.a * 257;
+	u64 pixel = (u64) gammaTables.srgbToLinear[color.b]
+		| ((u64) gammaTables.srgbToLinear[color.g] << 16)
+		| ((u64) gammaTables.srgbToLinear[color.r] << 32)
+		| ((u64) 0xFFFF << 48);
+	return color.a == 255 ? pixel : scaleLinearPixel(pixel, (u32) alpha);
 }
 
-inline RectF32 globalToPixelSpace(Vec2 viewportMin, f32 pixelsPerUnit, RectF32 rect)
+inline u64 blendLinearPixel(u64 dst, u64 srcPremultiplied)
 {
-	rect.min = globalToPixelSpace(viewportMin, pixelsPerUnit, rect.min);
-	rect.width *= pixelsPerUnit;
-	rect.height *= pixelsPerUnit;
-	return rect;
+	return srcPremultiplied + scaleLinearPixel(dst, 0xFFFF - (u32) (srcPremultiplied >> 48));
 }
 
-inline LineF32 globalToPixelSpace(Vec2 viewportMin, f32 pixelsPerUnit, LineF32 line)
+static void fillLinearPixelsScalar(u64 *pPixels, size_t count, u64 pixel)
 {
-	line.p1 = globalToPixelSpace(viewportMin, pixelsPerUnit, line.p1);
-	line.p2 = globalToPixelSpace(viewportMin, pixelsPerUnit, line.p2);
-	return line;
+	for (size_t i = 0; i < count; ++i)
+	{
+		pPixels[i] = pixel;
+	}
 }
 
-Vec2 pixelToGlobalSpace(Vec2 viewportMin, f32 unitsPerPixel, Vec2 v)
+static void fillLinearPixelsSse2(u64 *pPixels, size_t count, u64 pixel)
 {
-	return v * unitsPerPixel + viewportMin;
+	__m128i wide = _mm_set1_epi64x((i64) pixel);
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		_mm_storeu_si128((__m128i*) (pPixels + i), wide);
+	}
+
+	fillLinearPixelsScalar(pPixels + i, count - i, pixel);
 }
 
-void addShape(Application& app, Shape shape)
+TARGET_AVX2
+static void fillLinearPixelsAvx2(u64 *pPixels, size_t count, u64 pixel)
 {
-	if (app.shapeCount == maxShapeCount)
+	__m256i wide = _mm256_set1_epi64x((i64) pixel);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
 	{
-		assert(false);
-		return;
+		_mm256_storeu_si256((__m256i*) (pPixels + i), wide);
 	}
 
-	app.shapes[app.shapeCount] = shape;
-	++app.shapeCount;
+	fillLinearPixelsScalar(pPixels + i, count - i, pixel);
 }
 
-void addRect(Application& app, RectF32 rect, ColorU8 color)
+inline void fillLinearPixels(const CpuFeatures& cpu, u64 *pPixels, size_t count, u64 pixel)
 {
-	Shape shape = {};
-	shape.color = color;
-	shape.type = ShapeType::Rectangle;
-	shape.data.rect = rect;
-	addShape(app, shape);
+	if (cpu.avx2)
+	{
+		fillLinearPixelsAvx2(pPixels, count, pixel);
+	} else if (cpu.sse2)
+	{
+		fillLinearPixelsSse2(pPixels, count, pixel);
+	} else
+	{
+		fillLinearPixelsScalar(pPixels, count, pixel);
+	}
 }
 
-void addLine(Application& app, LineF32 line, ColorU8 color)
+static void blendLinearPixelsScalar(u64 *pPixels, size_t count, u64 srcPremultiplied)
 {
-	Shape shape = {};
-	shape.color = color;
-	shape.type = ShapeType::Line;
-	shape.data.line = line;
-	addShape(app, shape);
+	for (size_t i = 0; i < count; ++i)
+	{
+		pPixels[i] = blendLinearPixel(pPixels[i], srcPremultiplied);
+	}
 }
 
-//TODO this function is for testing convenience - remove it eventually
-static void addShapes(Application& app)
+// Channels are already 16 bits, so a single high multiply scales the
+// destination, 2 pixels at a time.
+static void blendLinearPixelsSse2(u64 *pPixels, size_t count, u64 srcPremultiplied)
 {
-	ColorU8 red = {};
-	red.r = 255;
+	__m128i src = _mm_set1_epi64x((i64) srcPremultiplied);
+	__m128i invAlpha = _mm_set1_epi16((i16) (0xFFFF - (srcPremultiplied >> 48)));
 
-	ColorU8 green = {};
-	green.g = 255;
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i dst = _mm_loadu_si128((__m128i*) (pPixels + i));
+		dst = _mm_add_epi16(src, _mm_mulhi_epu16(dst, invAlpha));
+		_mm_storeu_si128((__m128i*) (pPixels + i), dst);
+	}
 
-	ColorU8 blue = {};
-	blue.b = 255;
+	blendLinearPixelsScalar(pPixels + i, count - i, srcPremultiplied);
+}
 
-	ColorU8 white = {};
-	white.r = 255;
-	white.g = 255;
-	white.b = 255;
+TARGET_AVX2
+static void blendLinearPixelsAvx2(u64 *pPixels, size_t count, u64 srcPremultiplied)
+{
+	__m256i src = _mm256_set1_epi64x((i64) srcPremultiplied);
+	__m256i invAlpha = _mm256_set1_epi16((i16) (0xFFFF - (srcPremultiplied >> 48)));
 
-	RectF32 rect = {};
-	rect.width = 0.4f;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m256i dst = _mm256_loadu_si256((__m256i*) (pPixels + i));
+		dst = _mm256_add_epi16(src, _mm256_mulhi_epu16(dst, invAlpha));
+		_mm256_storeu_si256((__m256i*) (pPixels + i), dst);
+	}
+
+	blendLinearPixelsScalar(pPixels + i, count - i, srcPremultiplied);
+}
+
+inline void blendLinearPixels(const CpuFeatures& cpu, u64 *pPixels, size_t count, u64 srcPremultiplied)
+{
+	if (cpu.avx2)
+	{
+		blendLinearPixelsAvx2(pPixels, count, srcPremultiplied);
+	} else if (cpu.sse2)
+	{
+		blendLinearPixelsSse2(pPixels, count, srcPremultiplied);
+	} else
+	{
+		blendLinearPixelsScalar(pPixels, count, srcPremultiplied);
+	}
+}
+
+// Color channels go through the linearToSrgb table. Alpha is already
+// linear, so it keeps its top 8 bits.
+static void resolveLinearPixelsScalar(u32 *pDst, const u64 *pSrc, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		u64 pixel = pSrc[i];
+		pDst[i] = gammaTables.linearToSrgb[(pixel & 0xFFFF) >> 4]
+			| (gammaTables.linearToSrgb[(pixel >> 20) & 0xFFF] << 8)
+			| (gammaTables.linearToSrgb[(pixel >> 36) & 0xFFF] << 16)
+			| ((u32) (pixel >> 56) << 24);
+	}
+}
+
+// Resolves 4 pixels per iteration, gathering all 16 channels from
+// the table and then swapping in the alpha channels.
+TARGET_AVX2
+static void resolveLinearPixelsAvx2(u32 *pDst, const u64 *pSrc, size_t count)
+{
+	const i32 *table = (const i32*) gammaTables.linearToSrgb;
+	__m256i pixelOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m256i indices = _mm256_srli_epi16(_mm256_loadu_si256((__m256i*) (pSrc + i)), 4);
+
+		// pixels 0 and 1, then pixels 2 and 3, as 32-bit indices
+		__m256i indicesLo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(indices));
+		__m256i indicesHi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(indices, 1));
+		__m256i lo = _mm256_i32gather_epi32(table, indicesLo, 4);
+		__m256i hi = _mm256_i32gather_epi32(table, indicesHi, 4);
+		lo = _mm256_blend_epi32(lo, _mm256_srli_epi32(indicesLo, 4), 0x88);
+		hi = _mm256_blend_epi32(hi, _mm256_srli_epi32(indicesHi, 4), 0x88);
+
+		// Packing works within 128-bit lanes, which leaves the pixels
+		// in the order 0, 2 | 1, 3. The permute puts them back.
+		__m256i packed = _mm256_packus_epi32(lo, hi);
+		packed = _mm256_packus_epi16(packed, packed);
+		packed = _mm256_permutevar8x32_epi32(packed, pixelOrder);
+		_mm_storeu_si128((__m128i*) (pDst + i), _mm256_castsi256_si128(packed));
+	}
+
+	resolveLinearPixelsScalar(pDst + i, pSrc + i, count - i);
+}
+
+// Converts a region of a linear canvas to the 8-bit canvas that gets
+// presented. Both must be the same size.
+void resolveLinearCanvas(const CpuFeatures& cpu, Bitmap linear, Bitmap canvas, PixelRect rect)
+{
+	assert(linear.format == PixelFormat::LinearBgra16);
+	assert(canvas.format == PixelFormat::Bgra8);
+	assert(linear.width == canvas.width && linear.height == canvas.height);
+
+	rect = intersect(rect, drawableRect(canvas));
+	if (isEmpty(rect))
+	{
+		return;
+	}
+
+	u32 width = (u32) (rect.xMax - rect.xMin);
+	auto *pSrc = linear.pixels + rect.yMin * linear.pitch + rect.xMin * bytesPerPixel(linear.format);
+	auto *pDst = canvas.pixels + rect.yMin * canvas.pitch + rect.xMin * bytesPerPixel(canvas.format);
+	for (i32 y = rect.yMin; y < rect.yMax; ++y)
+	{
+		if (cpu.avx2)
+		{
+			resolveLinearPixelsAvx2((u32*) pDst, (u64*) pSrc, width);
+		} else
+		{
+			resolveLinearPixelsScalar((u32*) pDst, (u64*) pSrc, width);
+		}
+		pSrc += linear.pitch;
+		pDst += canvas.pitch;
+	}
+}
+
+// Fills every pixel of the canvas, ignoring its clip rectangle.
+void clearBitmap(const CpuFeatures& cpu, Bitmap canvas, ColorU8 color)
+{
+	if (canvas.width == 0 || canvas.height == 0)
+	{
+		return;
+	}
+
+	if (canvas.shapeIds != nullptr)
+	{
+		auto *pIds = canvas.shapeIds;
+		for (u32 y = 0; y < canvas.height; ++y)
+		{
+			fillPixels(cpu, (u32*) pIds, canvas.width, canvas.shapeId, false);
+			pIds += canvas.shapeIdPitch;
+		}
+	}
+
+	// When rows are tightly packed, the whole canvas is filled as
+	// one run so that the vector loops aren't broken up per row.
+	auto *pPixels = canvas.pixels;
+	size_t runLength = canvas.width;
+	u32 runCount = canvas.height;
+	if (canvas.pitch == (i32) (bytesPerPixel(canvas.format) * canvas.width))
+	{
+		runLength *= canvas.height;
+		runCount = 1;
+	}
+
+	if (canvas.format == PixelFormat::LinearBgra16)
+	{
+		u64 linear = linearPixel(color);
+		for (u32 run = 0; run < runCount; ++run)
+		{
+			fillLinearPixels(cpu, (u64*) pPixels, runLength, linear);
+			pPixels += canvas.pitch;
+		}
+		return;
+	}
+
+	u32 pixel = packPixel(color);
+
+	bool streaming = (size_t) canvas.width * canvas.height * 4 > cpu.streamingStoreThreshold;
+	for (u32 run = 0; run < runCount; ++run)
+	{
+		// Pixels are 4-byte aligned, so the canvas can be written
+		// as 32-bit words.
+		assert(((uintptr_t) pPixels & 3) == 0);
+		fillPixels(cpu, (u32*) pPixels, runLength, pixel, streaming);
+		pPixels += canvas.pitch;
+	}
+
+	if (streaming)
+	{
+		// Streaming stores are weakly ordered. Fence them before
+		// the canvas is handed off to be displayed.
+		_mm_sfence();
+	}
+}
+
+// The canvas holds premultiplied BGRA pixels, so a source-over blend
+// of a premultiplied source is, per channel,
+//   dst = src + dst * (255 - srcAlpha) / 255
+
+// Divides by 255, rounded to nearest, for x in [0, 255 * 255].
+inline u32 div255(u32 x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// Multiplies all four channels of a pixel by scale / 255. Channels
+// are processed two at a time in 16-bit lanes.
+inline u32 scalePixel(u32 pixel, u32 scale)
+{
+	u32 rb = (pixel & 0x00FF00FF) * scale + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+	u32 ga = ((pixel >> 8) & 0x00FF00FF) * scale + 0x00800080;
+	ga = (ga + ((ga >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+	return rb | ga;
+}
+
+inline u32 premultiplyPixel(ColorU8 color)
+{
+	return scalePixel(packPixel(color) | 0xFF000000, color.a);
+}
+
+// Channels can't carry into each other: the source contributes at
+// most srcAlpha and the destination at most 255 - srcAlpha.
+inline u32 blendPixel(u32 dst, u32 srcPremultiplied)
+{
+	return srcPremultiplied + scalePixel(dst, 255 - (srcPremultiplied >> 24));
+}
+
+static void blendPixelsScalar(u32 *pPixels, size_t count, u32 srcPremultiplied)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		pPixels[i] = blendPixel(pPixels[i], srcPremultiplied);
+	}
+}
+
+// Blends 4 pixels per iteration. Pixels are widened to 16 bits per
+// channel for the multiply, then narrowed again.
+static void blendPixelsSse2(u32 *pPixels, size_t count, u32 srcPremultiplied)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i src = _mm_set1_epi32((i32) srcPremultiplied);
+	__m128i invAlpha = _mm_set1_epi16((i16) (255 - (srcPremultiplied >> 24)));
+	__m128i bias = _mm_set1_epi16(128);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i dst = _mm_loadu_si128((__m128i*) (pPixels + i));
+		__m128i lo = _mm_unpacklo_epi8(dst, zero);
+		__m128i hi = _mm_unpackhi_epi8(dst, zero);
+		lo = _mm_add_epi16(_mm_mullo_epi16(lo, invAlpha), bias);
+		hi = _mm_add_epi16(_mm_mullo_epi16(hi, invAlpha), bias);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		dst = _mm_add_epi8(_mm_packus_epi16(lo, hi), src);
+		_mm_storeu_si128((__m128i*) (pPixels + i), dst);
+	}
+
+	blendPixelsScalar(pPixels + i, count - i, srcPremultiplied);
+}
+
+// The AVX2 version of blendPixelsSse2, 8 pixels per iteration.
+TARGET_AVX2
+static void blendPixelsAvx2(u32 *pPixels, size_t count, u32 srcPremultiplied)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i src = _mm256_set1_epi32((i32) srcPremultiplied);
+	__m256i invAlpha = _mm256_set1_epi16((i16) (255 - (srcPremultiplied >> 24)));
+	__m256i bias = _mm256_set1_epi16(128);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i dst = _mm256_loadu_si256((__m256i*) (pPixels + i));
+		__m256i lo = _mm256_unpacklo_epi8(dst, zero);
+		__m256i hi = _mm256_unpackhi_epi8(dst, zero);
+		lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, invAlpha), bias);
+		hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, invAlpha), bias);
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+		dst = _mm256_add_epi8(_mm256_packus_epi16(lo, hi), src);
+		_mm256_storeu_si256((__m256i*) (pPixels + i), dst);
+	}
+
+	blendPixelsScalar(pPixels + i, count - i, srcPremultiplied);
+}
+
+inline void blendPixels(const CpuFeatures& cpu, u32 *pPixels, size_t count, u32 srcPremultiplied)
+{
+	if (cpu.avx2)
+	{
+		blendPixelsAvx2(pPixels, count, srcPremultiplied);
+	} else if (cpu.sse2)
+	{
+		blendPixelsSse2(pPixels, count, srcPremultiplied);
+	} else
+	{
+		blendPixelsScalar(pPixels, count, srcPremultiplied);
+	}
+}
+
+// Fills the pixels of `rect`, which must be drawable.
+static void fillPixelRect(const CpuFeatures& cpu, Bitmap canvas, PixelRect rect, ColorU8 color)
+{
+	u32 spanWidth = (u32) (rect.xMax - rect.xMin);
+	if (canvas.shapeIds != nullptr)
+	{
+		auto *pIds = canvas.shapeIds + rect.yMin * canvas.shapeIdPitch + rect.xMin * 4;
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			fillPixels(cpu, (u32*) pIds, spanWidth, canvas.shapeId, false);
+			pIds += canvas.shapeIdPitch;
+		}
+	}
+
+	auto *pPixels = canvas.pixels + rect.yMin * canvas.pitch + rect.xMin * (i32) bytesPerPixel(canvas.format);
+	if (canvas.format == PixelFormat::LinearBgra16)
+	{
+		u64 pixel = linearPixel(color);
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			if (color.a == 255)
+			{
+				fillLinearPixels(cpu, (u64*) pPixels, spanWidth, pixel);
+			} else
+			{
+				blendLinearPixels(cpu, (u64*) pPixels, spanWidth, pixel);
+			}
+			pPixels += canvas.pitch;
+		}
+	} else if (color.a == 255)
+	{
+		// opaque fills don't need to read the canvas
+		u32 pixel = packPixel(color);
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			fillPixels(cpu, (u32*) pPixels, spanWidth, pixel, false);
+			pPixels += canvas.pitch;
+		}
+	} else
+	{
+		u32 pixel = premultiplyPixel(color);
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			blendPixels(cpu, (u32*) pPixels, spanWidth, pixel);
+			pPixels += canvas.pitch;
+		}
+	}
+}
+
+// Anti-aliased shapes measure coverage in 16.16 fixed point, where a
+// fully covered pixel has this coverage.
+const u32 coverageOne = 1 << 16;
+
+// Blends a color, scaled by `coverage` out of coverageOne, over the
+// pixels of `rect`, which must be drawable. The color is given as a
+// premultiplied pixel, and as a linear pixel for linear canvases. The
+// shape ID is written if the pixels are at least half covered.
+static void blendPixelRect(
+	const CpuFeatures& cpu, Bitmap canvas, PixelRect rect, u32 pixel, u64 pixelLinear, u32 coverage)
+{
+	u32 spanWidth = (u32) (rect.xMax - rect.xMin);
+	if (canvas.shapeIds != nullptr && coverage >= coverageOne / 2)
+	{
+		auto *pIds = canvas.shapeIds + rect.yMin * canvas.shapeIdPitch + rect.xMin * 4;
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			fillPixels(cpu, (u32*) pIds, spanWidth, canvas.shapeId, false);
+			pIds += canvas.shapeIdPitch;
+		}
+	}
+
+	// The left and right edges are a pixel wide. Their pixels cost
+	// less blended one at a time than dispatched to the span kernels.
+	auto *pPixels = canvas.pixels + rect.yMin * canvas.pitch + rect.xMin * (i32) bytesPerPixel(canvas.format);
+	if (canvas.format == PixelFormat::LinearBgra16)
+	{
+		u64 scaled = scaleLinearPixel(pixelLinear, coverage);
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			if (spanWidth == 1)
+			{
+				*(u64*) pPixels = blendLinearPixel(*(u64*) pPixels, scaled);
+			} else
+			{
+				blendLinearPixels(cpu, (u64*) pPixels, spanWidth, scaled);
+			}
+			pPixels += canvas.pitch;
+		}
+	} else
+	{
+		// 8-bit coverage, rounded
+		u32 scale = (coverage * 255 + coverageOne / 2) >> 16;
+		u32 scaled = scalePixel(pixel, scale);
+		for (i32 y = rect.yMin; y < rect.yMax; ++y)
+		{
+			if (spanWidth == 1)
+			{
+				*(u32*) pPixels = blendPixel(*(u32*) pPixels, scaled);
+			} else
+			{
+				blendPixels(cpu, (u32*) pPixels, spanWidth, scaled);
+			}
+			pPixels += canvas.pitch;
+		}
+	}
+}
+
+// Splits the pixels [0, size) that the extent [min, max] covers into
+// three bands: [bounds[0], bounds[1]) and [bounds[2], bounds[3]) hold
+// at most a partly covered pixel each, and the pixels between are
+// fully covered. coverages holds each band's coverage.
+inline static void rectAxisCoverage(f32 min, f32 max, u32 size, i32 bounds[4], u32 coverages[3])
+{
+	const i64 one = coverageOne;
+	// Clamping changes no coverage within [0, size), and keeps the
+	// fixed point values in range.
+	i64 a = (i64) (clamp(min, 0.0f, (f32) size) * (f32) one + 0.5f);
+	i64 b = (i64) (clamp(max, 0.0f, (f32) size) * (f32) one + 0.5f);
+	i32 first = (i32) (a >> 16);
+	i32 end = (i32) ((b + one - 1) >> 16);
+	i32 fullFirst = (i32) ((a + one - 1) >> 16);
+	i32 fullEnd = (i32) (b >> 16);
+	if (fullEnd < fullFirst)
+	{
+		// both edges are within one pixel
+		fullFirst = end;
+		fullEnd = end;
+	}
+
+	bounds[0] = first;
+	bounds[1] = fullFirst;
+	bounds[2] = fullEnd;
+	bounds[3] = end;
+	coverages[0] = (u32) ((b < (first + 1) * one ? b : (first + 1) * one) - a);
+	coverages[1] = (u32) one;
+	coverages[2] = (u32) (b - (end - 1) * one);
+}
+
+// Fills a rectangle with anti-aliased edges. Each pixel's coverage is
+// the product of how much of its column and its row the rectangle
+// spans, so the rectangle splits into nine bands of constant
+// coverage. The fully covered interior is filled like an aliased
+// rectangle, and only the one pixel wide border is blended.
+static void fillAntialiasedRect(const CpuFeatures& cpu, Bitmap canvas, RectF32 rect, ColorU8 color)
+{
+	i32 xBounds[4], yBounds[4];
+	u32 xCoverages[3], yCoverages[3];
+	rectAxisCoverage(rect.min.x, rect.min.x + rect.width, canvas.width, xBounds, xCoverages);
+	rectAxisCoverage(rect.min.y, rect.min.y + rect.height, canvas.height, yBounds, yCoverages);
+
+	bool linear = canvas.format == PixelFormat::LinearBgra16;
+	u32 pixel = premultiplyPixel(color);
+	u64 pixelLinear = linear ? linearPixel(color) : 0;
+
+	PixelRect drawable = drawableRect(canvas);
+	for (u32 by = 0; by < 3; ++by)
+	{
+		for (u32 bx = 0; bx < 3; ++bx)
+		{
+			PixelRect band = {xBounds[bx], yBounds[by], xBounds[bx + 1], yBounds[by + 1]};
+			band = intersect(band, drawable);
+			u32 coverage = (u32) (((u64) xCoverages[bx] * yCoverages[by]) >> 16);
+			if (isEmpty(band) || coverage == 0)
+			{
+				continue;
+			}
+
+			if (coverage == coverageOne)
+			{
+				fillPixelRect(cpu, canvas, band, color);
+			} else
+			{
+				blendPixelRect(cpu, canvas, band, pixel, pixelLinear, coverage);
+			}
+		}
+	}
+}
+
+void fillRect(const CpuFeatures& cpu, Bitmap canvas, RectF32 rect, ColorU8 color)
+{
+	assert(rect.width >= 0.0);
+	assert(rect.height >= 0.0);
+
+	if (color.a == 0)
+	{
+		return;
+	}
+	if (canvas.antialiased)
+	{
+		fillAntialiasedRect(cpu, canvas, rect, color);
+		return;
+	}
+
+	PixelRect drawable = drawableRect(canvas);
+	if (isEmpty(drawable))
+	{
+		return;
+	}
+
+	PixelRect pixels;
+	pixels.xMin = (i32) clamp(rect.min.x, 0.0f, (f32) canvas.width);
+	pixels.xMax = (i32) clamp(rect.min.x + rect.width, 0.0f, (f32) canvas.width);
+	pixels.yMin = (i32) clamp(rect.min.y, 0.0f, (f32) canvas.height);
+	pixels.yMax = (i32) clamp(rect.min.y + rect.height, 0.0f, (f32) canvas.height);
+
+	// Clipping happens after rounding to whole pixels, so the pixels
+	// drawn are a subset of the unclipped ones.
+	pixels = intersect(pixels, drawable);
+	if (isEmpty(pixels))
+	{
+		return;
+	}
+	fillPixelRect(cpu, canvas, pixels, color);
+}
+
+const u8 COHEN_SUTHERLAND_LEFT_REGION = 0x1;
+const u8 COHEN_SUTHERLAND_RIGHT_REGION = 0x2;
+const u8 COHEN_SUTHERLAND_BOTTOM_REGION = 0x4;
+const u8 COHEN_SUTHERLAND_TOP_REGION = 0x8;
+
+static u8 cohenSutherlandComputeRegion(Vec2 min, Vec2 max, Vec2 p)
+{
+	assert(min.x <= max.x);
+	assert(min.y <= max.y);
+
+	u8 region = 0;
+	if (p.x < min.x)
+	{
+		region |= COHEN_SUTHERLAND_LEFT_REGION;
+	} else if (p.x > max.x)
+	{
+		region |= COHEN_SUTHERLAND_RIGHT_REGION;
+	}
+
+	if (p.y < min.y)
+	{
+		region |= COHEN_SUTHERLAND_BOTTOM_REGION;
+	} else if (p.y > max.y)
+	{
+		region |= COHEN_SUTHERLAND_TOP_REGION;
+	}
+
+	return region;
+}
+
+inline static void cohenSutherlandClipPoint(
+	Vec2 min, Vec2 max, LineF32 line, u8& region, Vec2& p)
+{
+	f32 dx = line.p2.x - line.p1.x;
+	f32 dy = line.p2.y - line.p1.y;
+	if (region & COHEN_SUTHERLAND_TOP_REGION)
+	{
+		p.x = line.p1.x + dx * (max.y - line.p1.y) / dy;
+		p.y = max.y;
+	} else if (region & COHEN_SUTHERLAND_BOTTOM_REGION)
+	{
+		p.x = line.p1.x + dx * (min.y - line.p1.y) / dy;
+		p.y = min.y;
+	} else if (region & COHEN_SUTHERLAND_RIGHT_REGION)
+	{
+		p.x = max.x;
+		p.y = line.p1.y + dy * (max.x - line.p1.x) / dx;
+	} else if (region & COHEN_SUTHERLAND_LEFT_REGION)
+	{
+		p.x = min.x;
+		p.y = line.p1.y + dy * (min.x - line.p1.x) / dx;
+	}
+
+	region = cohenSutherlandComputeRegion(min, max, p);
+}
+
+inline static bool clipLineCohenSutherland(Vec2 min, Vec2 max, LineF32& line)
+{
+	assert(min.x <= max.x);
+	assert(min.y <= max.y);
+
+	u8 region1 = cohenSutherlandComputeRegion(min, max, line.p1);
+	u8 region2 = cohenSutherlandComputeRegion(min, max, line.p2);
+
+	for (;;)
+	{
+		if ((region1 | region2) == 0)
+		{
+			return true;
+		}
+		if ((region1 & region2) != 0)
+		{
+			return false;
+		}
+		
+		if (region1 == 0)
+		{
+			cohenSutherlandClipPoint(min, max, line, region2, line.p2);
+		} else
+		{
+			cohenSutherlandClipPoint(min, max, line, region1, line.p1);
+		}
+	}
+}
+
+void drawLine(Bitmap canvas, LineF32 line, ColorU8 color)
+{
+	// The main Bresenham's loop always runs at least one iteration,
+	// and writes a pixel to the bitmap every iteration. When the
+	// canvas has zero area, it has no memory allocated to it. Thus,
+	// when the canvas has zero area, this function will access invalid
+	// memory.
+	assert(canvas.width > 0 && canvas.height > 0);
+
+//TODO inlining the min (0, 0) may yield a slightly more efficient clipping algorithm
+	Vec2 min = {0.0f, 0.0f};
+	Vec2 max = {(f32) (canvas.width - 1), (f32) (canvas.height - 1)};
+	// drawLineRunSlice and drawLines clip with Liang-Barsky instead,
+	// which drawLines runs on eight lines at a time.
+	if (!clipLineCohenSutherland(min, max, line))
+	{
+		return;
+	}
+
+	i32 x1 = (i32) line.p1.x;
+	i32 y1 = (i32) line.p1.y;
+	i32 x2 = (i32) line.p2.x;
+	i32 y2 = (i32) line.p2.y;
+
+	assert(x1 >= 0);
+	assert((u32) x1 < canvas.width);
+	assert(x2 >= 0);
+	assert((u32) x2 < canvas.width);
+
+	assert(y1 >= 0);
+	assert((u32) y1 < canvas.height);
+	assert(y2 >= 0);
+	assert((u32) y2 < canvas.height);
+
+	// Lines are clipped to the clip rectangle pixel by pixel, so a
+	// clipped line draws exactly the pixels the unclipped line would.
+	// Lines that miss the clip rectangle are skipped up front.
+	PixelRect drawable = drawableRect(canvas);
+	PixelRect bounds;
+	bounds.xMin = x1 < x2 ? x1 : x2;
+	bounds.yMin = y1 < y2 ? y1 : y2;
+	bounds.xMax = (x1 > x2 ? x1 : x2) + 1;
+	bounds.yMax = (y1 > y2 ? y1 : y2) + 1;
+	if (isEmpty(intersect(bounds, drawable)))
+	{
+		return;
+	}
+
+	if (x1 > x2)
+	{
+		swap(x1, x2);
+		swap(y1, y2);
+	}
+
+	i32 dx = x2 - x1;
+	i32 dy = y2 - y1;
+
+	// Lines with a negative slope need to decrement rows rather
+	// than increment them, and the start and end indices need
+	// to be swapped.
+	i32 incrY, stepY;
+	u32 startY, endY;
+	if (dy < 0)
+	{
+		incrY = -canvas.pitch;
+		stepY = -1;
+		dy = -dy;
+		startY = y2;
+		endY = y1;
+	} else
+	{
+		incrY = canvas.pitch;
+		stepY = 1;
+		startY = y1;
+		endY = y2;
+	}
+
+	// If the magnitude of the slope is greater than one, increment
+	// the y value by one each iteration instead of the x value, and
+	// increment the x value dependent on the error instead of the y
+	// value. Otherwise, the line will not draw correctly since the
+	// algorithm assumes that vertical changes will be either 0 or 1
+	// pixels, which is not the case when the slope is greater than one.
+	i32 pixelSize = (i32) bytesPerPixel(canvas.format);
+	i32 i, endI, d1, d2;
+	size_t incr1, incr2;
+	i32 stepX1, stepY1, stepX2, stepY2;
+	if (dx >= dy)
+	{
+		i = x1;
+		endI = x2;
+		d1 = dy;
+		d2 = dx;
+		incr1 = pixelSize;
+		incr2 = incrY;
+		stepX1 = 1;
+		stepY1 = 0;
+		stepX2 = 0;
+		stepY2 = stepY;
+	} else
+	{
+		i = startY;
+		endI = endY;
+		d1 = dx;
+		d2 = dy;
+		incr1 = incrY;
+		incr2 = pixelSize;
+		stepX1 = 0;
+		stepY1 = stepY;
+		stepX2 = 1;
+		stepY2 = 0;
+	}
+
+	// Opaque lines store the pixel as is. The branches on `opaque`
+	// and `linear` are the same every iteration, so they predict well.
+	bool opaque = color.a == 255;
+	bool linear = canvas.format == PixelFormat::LinearBgra16;
+	u32 pixel = opaque ? packPixel(color) : premultiplyPixel(color);
+	u64 pixelLinear = linear ? linearPixel(color) : 0;
+	// fully transparent lines change no colors, so they leave IDs
+	// alone too
+	u8 *shapeIds = color.a > 0 ? canvas.shapeIds : nullptr;
+
+	u32 drawableWidth = (u32) (drawable.xMax - drawable.xMin);
+	u32 drawableHeight = (u32) (drawable.yMax - drawable.yMin);
+
+	// Bresenham's algorithm
+	i32 error = 0;
+	i32 x = x1;
+	i32 y = y1;
+	auto pPixels = canvas.pixels + y1 * canvas.pitch + pixelSize * x1;
+
+	// When clipped, only walk the steps whose major coordinate is in
+	// the clip rectangle. After k steps, the minor coordinate has
+	// advanced floor((2 k d1 + d2) / (2 d2)) times, which gives the
+	// state to start from.
+	if (canvas.clipped)
+	{
+		i32 majorMin, majorMax, major;
+		if (stepX1 != 0)
+		{
+			majorMin = drawable.xMin;
+			majorMax = drawable.xMax - 1;
+			major = x1;
+		} else if (stepY > 0)
+		{
+			majorMin = drawable.yMin;
+			majorMax = drawable.yMax - 1;
+			major = y1;
+		} else
+		{
+			// y decreases each step, so count steps down from y1
+			majorMin = -(drawable.yMax - 1);
+			majorMax = -drawable.yMin;
+			major = -y1;
+		}
+
+		i32 stepCount = endI - i;
+		i32 firstStep = majorMin - major > 0 ? majorMin - major : 0;
+		i32 lastStep = majorMax - major < stepCount ? majorMax - major : stepCount;
+		if (firstStep > lastStep)
+		{
+			return;
+		}
+
+		if (firstStep > 0)
+		{
+			i64 minorSteps = (2 * (i64) firstStep * d1 + d2) / (2 * (i64) d2);
+			error = (i32) ((i64) firstStep * d1 - minorSteps * d2);
+			x += stepX1 * firstStep + stepX2 * (i32) minorSteps;
+			y += stepY1 * firstStep + stepY2 * (i32) minorSteps;
+			pPixels += incr1 * (size_t) firstStep + incr2 * (size_t) minorSteps;
+		}
+		endI = i + lastStep;
+		i += firstStep;
+	}
+
+	while (i <= endI)
+	{
+		bool inside = (u32) (x - drawable.xMin) < drawableWidth
+			&& (u32) (y - drawable.yMin) < drawableHeight;
+		if (inside && linear)
+		{
+			auto *pPixel = (u64*) pPixels;
+			*pPixel = opaque ? pixelLinear : blendLinearPixel(*pPixel, pixelLinear);
+		} else if (inside)
+		{
+			auto *pPixel = (u32*) pPixels;
+			*pPixel = opaque ? pixel : blendPixel(*pPixel, pixel);
+		}
+		if (inside && shapeIds != nullptr)
+		{
+			((u32*) (shapeIds + y * canvas.shapeIdPitch))[x] = canvas.shapeId;
+		}
+		pPixels += incr1;
+		x += stepX1;
+		y += stepY1;
+		++i;
+
+		error += d1;
+		if ((error << 1) >= d2)
+		{
+			pPixels += incr2;
+			x += stepX2;
+			y += stepY2;
+			error -= d2;
+		}
+	}
+}
+
+// How a line writes its pixels, worked out once per line.
+struct LinePen
+{
+	bool opaque;
+	bool linear;
+	// packed if opaque, premultiplied otherwise
+	u32 pixel;
+	u64 pixelLinear;
+	// null when the line writes no shape IDs
+	u8 *shapeIds;
+};
+
+inline static LinePen newLinePen(Bitmap canvas, ColorU8 color)
+{
+	LinePen pen;
+	pen.opaque = color.a == 255;
+	pen.linear = canvas.format == PixelFormat::LinearBgra16;
+	pen.pixel = pen.opaque ? packPixel(color) : premultiplyPixel(color);
+	pen.pixelLinear = pen.linear ? linearPixel(color) : 0;
+	// fully transparent lines change no colors, so they leave IDs
+	// alone too
+	pen.shapeIds = color.a > 0 ? canvas.shapeIds : nullptr;
+	return pen;
+}
+
+// Writes `count` pixels starting at (x, y), moving by (stepX, stepY)
+// after each one. Vertical, diagonal and short horizontal runs go
+// through here.
+inline static void drawLineRun(
+	Bitmap canvas, const LinePen& pen, i32 x, i32 y, i32 stepX, i32 stepY, u32 count)
+{
+	// The pen is copied into locals, since stores to the canvas could
+	// otherwise alias it and force reloads every iteration.
+	i32 pixelSize = (i32) bytesPerPixel(canvas.format);
+	auto *pPixels = canvas.pixels + y * canvas.pitch + x * pixelSize;
+	ptrdiff_t incr = stepY * canvas.pitch + stepX * pixelSize;
+	if (pen.linear)
+	{
+		u64 pixel = pen.pixelLinear;
+		if (pen.opaque)
+		{
+			for (u32 i = 0; i < count; ++i, pPixels += incr)
+			{
+				*(u64*) pPixels = pixel;
+			}
+		} else
+		{
+			for (u32 i = 0; i < count; ++i, pPixels += incr)
+			{
+				*(u64*) pPixels = blendLinearPixel(*(u64*) pPixels, pixel);
+			}
+		}
+	} else
+	{
+		u32 pixel = pen.pixel;
+		if (pen.opaque)
+		{
+			for (u32 i = 0; i < count; ++i, pPixels += incr)
+			{
+				*(u32*) pPixels = pixel;
+			}
+		} else
+		{
+			for (u32 i = 0; i < count; ++i, pPixels += incr)
+			{
+				*(u32*) pPixels = blendPixel(*(u32*) pPixels, pixel);
+			}
+		}
+	}
+
+	if (pen.shapeIds != nullptr)
+	{
+		u32 shapeId = canvas.shapeId;
+		auto *pIds = pen.shapeIds + y * canvas.shapeIdPitch + x * 4;
+		ptrdiff_t idIncr = stepY * canvas.shapeIdPitch + stepX * 4;
+		for (u32 i = 0; i < count; ++i, pIds += idIncr)
+		{
+			*(u32*) pIds = shapeId;
+		}
+	}
+}
+
+// Writes a horizontal run of `count` pixels starting at (x, y).
+inline static void drawLineSpan(
+	const CpuFeatures& cpu, Bitmap canvas, const LinePen& pen, i32 x, i32 y, u32 count)
+{
+	// Short runs, as in lines close to 45 degrees, cost less written
+	// pixel by pixel than dispatched to the span kernels.
+	if (count < 8)
+	{
+		drawLineRun(canvas, pen, x, y, 1, 0, count);
+		return;
+	}
+
+	auto *pPixels = canvas.pixels + y * canvas.pitch + x * (i32) bytesPerPixel(canvas.format);
+	if (pen.linear && pen.opaque)
+	{
+		fillLinearPixels(cpu, (u64*) pPixels, count, pen.pixelLinear);
+	} else if (pen.linear)
+	{
+		blendLinearPixels(cpu, (u64*) pPixels, count, pen.pixelLinear);
+	} else if (pen.opaque)
+	{
+		fillPixels(cpu, (u32*) pPixels, count, pen.pixel, false);
+	} else
+	{
+		blendPixels(cpu, (u32*) pPixels, count, pen.pixel);
+	}
+	if (pen.shapeIds != nullptr)
+	{
+		auto *pIds = pen.shapeIds + y * canvas.shapeIdPitch + x * 4;
+		fillPixels(cpu, (u32*) pIds, count, canvas.shapeId, false);
+	}
+}
+
+// Below this average run length, lines are drawn a pixel at a time.
+// Each run costs about as much as several pixels to set up.
+const i32 minLineRunLength = 8;
+
+// Draws a line's pixels one step at a time, like drawLine, but only
+// over the steps whose pixels are within the clip ranges, so the loop
+// needs no clip tests. See drawLineRunSlice for the parameters.
+static void drawLineSteps(
+	Bitmap canvas,
+	const LinePen& pen,
+	i32 x1,
+	i32 y1,
+	i32 stepY,
+	bool shallow,
+	i32 d1,
+	i32 d2,
+	i32 kMin,
+	i32 kMax,
+	i32 mMin,
+	i32 mMax)
+{
+	// Step k is the first of run m when k = ceil((2 m - 1) d2 / (2 d1)).
+	i64 denominator = 2 * (i64) d1;
+	if (mMin > 0)
+	{
+		i32 start = (i32) (((2 * (i64) mMin - 1) * d2 + denominator - 1) / denominator);
+		kMin = kMin > start ? kMin : start;
+	}
+	i32 end = (i32) (((2 * (i64) mMax + 1) * d2 + denominator - 1) / denominator) - 1;
+	kMax = kMax < end ? kMax : end;
+	if (kMin > kMax)
+	{
+		return;
+	}
+
+	// error = 2 k d1 + d2 - 2 m(k) d2, which stays in [0, 2 d2)
+	i32 m = (i32) ((2 * (i64) kMin * d1 + d2) / (2 * (i64) d2));
+	i32 error = (i32) (2 * (i64) kMin * d1 + d2 - 2 * (i64) m * d2);
+	i32 x = shallow ? x1 + kMin : x1 + m;
+	i32 y = shallow ? y1 + stepY * m : y1 + stepY * kMin;
+
+	i32 pixelSize = (i32) bytesPerPixel(canvas.format);
+	ptrdiff_t incrY = stepY * canvas.pitch;
+	ptrdiff_t majorIncr = shallow ? pixelSize : incrY;
+	ptrdiff_t minorIncr = shallow ? incrY : pixelSize;
+	auto *pPixels = canvas.pixels + y * canvas.pitch + x * pixelSize;
+
+	// Without IDs, the ID pointer stays null and never moves.
+	bool writeIds = pen.shapeIds != nullptr;
+	ptrdiff_t idIncrY = writeIds ? stepY * canvas.shapeIdPitch : 0;
+	ptrdiff_t idMajorIncr = shallow ? (writeIds ? 4 : 0) : idIncrY;
+	ptrdiff_t idMinorIncr = shallow ? idIncrY : (writeIds ? 4 : 0);
+	u8 *pIds = writeIds ? pen.shapeIds + y * canvas.shapeIdPitch + x * 4 : nullptr;
+
+	bool opaque = pen.opaque;
+	bool linear = pen.linear;
+	u32 pixel = pen.pixel;
+	u64 pixelLinear = pen.pixelLinear;
+	u32 shapeId = canvas.shapeId;
+	i32 errorIncr = 2 * d1;
+	i32 errorMax = 2 * d2;
+	for (i32 k = kMin; k <= kMax; ++k)
+	{
+		if (linear)
+		{
+			*(u64*) pPixels = opaque ? pixelLinear : blendLinearPixel(*(u64*) pPixels, pixelLinear);
+		} else
+		{
+			*(u32*) pPixels = opaque ? pixel : blendPixel(*(u32*) pPixels, pixel);
+		}
+		if (writeIds)
+		{
+			*(u32*) pIds = shapeId;
+		}
+		pPixels += majorIncr;
+		pIds += idMajorIncr;
+
+		error += errorIncr;
+		if (error >= errorMax)
+		{
+			error -= errorMax;
+			pPixels += minorIncr;
+			pIds += idMinorIncr;
+		}
+	}
+}
+
+// Clips a line to [0, max.x] by [0, max.y] with the Liang-Barsky
+// algorithm, and returns false if no part of it is inside. Lines with
+// both ends inside, or both beyond the same edge, are settled by
+// their outcodes first. Lines with NaN coordinates are rejected.
+// Rounding can put clipped ends a hair outside the bounds, so they
+// are clamped. clipLinesAvx2 returns exactly the same results.
+inline static bool clipLineLiangBarsky(Vec2 max, LineF32& line)
+{
+	f32 x1 = line.p1.x;
+	f32 y1 = line.p1.y;
+	f32 x2 = line.p2.x;
+	f32 y2 = line.p2.y;
+
+	bool inside1 = x1 >= 0.0f && x1 <= max.x && y1 >= 0.0f && y1 <= max.y;
+	bool inside2 = x2 >= 0.0f && x2 <= max.x && y2 >= 0.0f && y2 <= max.y;
+	if (inside1 && inside2)
+	{
+		return true;
+	}
+	if ((x1 < 0.0f && x2 < 0.0f) || (x1 > max.x && x2 > max.x)
+		|| (y1 < 0.0f && y2 < 0.0f) || (y1 > max.y && y2 > max.y))
+	{
+		return false;
+	}
+	if (x1 != x1 || y1 != y1 || x2 != x2 || y2 != y2)
+	{
+		return false;
+	}
+
+	// The line is p1 + t (p2 - p1) for t in [0, 1]. Each edge keeps
+	// the part where p t <= q. Edges the line enters through raise t0,
+	// and edges it leaves through lower t1.
+	f32 dx = x2 - x1;
+	f32 dy = y2 - y1;
+	f32 p[4] = {-dx, dx, -dy, dy};
+	f32 q[4] = {x1, max.x - x1, y1, max.y - y1};
+	f32 t0 = 0.0f;
+	f32 t1 = 1.0f;
+	for (u32 e = 0; e < 4; ++e)
+	{
+		if (p[e] < 0.0f)
+		{
+			f32 r = q[e] / p[e];
+			t0 = r > t0 ? r : t0;
+		} else if (p[e] > 0.0f)
+		{
+			f32 r = q[e] / p[e];
+			t1 = r < t1 ? r : t1;
+		} else if (q[e] < 0.0f)
+		{
+			// parallel to the edge, and outside it
+			return false;
+		}
+	}
+	if (!(t0 <= t1))
+	{
+		return false;
+	}
+
+	f32 clipped[4] = {
+		t0 > 0.0f ? x1 + t0 * dx : x1,
+		t0 > 0.0f ? y1 + t0 * dy : y1,
+		t1 < 1.0f ? x1 + t1 * dx : x2,
+		t1 < 1.0f ? y1 + t1 * dy : y2};
+	f32 limits[4] = {max.x, max.y, max.x, max.y};
+	for (u32 c = 0; c < 4; ++c)
+	{
+		clipped[c] = clipped[c] > 0.0f ? clipped[c] : 0.0f;
+		clipped[c] = clipped[c] < limits[c] ? clipped[c] : limits[c];
+	}
+	line.p1 = {clipped[0], clipped[1]};
+	line.p2 = {clipped[2], clipped[3]};
+	return true;
+}
+
+// Clips eight lines, held one coordinate per register, the way
+// clipLineLiangBarsky clips one. Returns a mask of the lines with a
+// part inside. The other lanes' coordinates are left undefined.
+TARGET_AVX2
+inline static __m256 clipLinesAvx2(__m256& x1, __m256& y1, __m256& x2, __m256& y2, __m256 maxX, __m256 maxY)
+{
+	__m256 zero = _mm256_setzero_ps();
+	__m256 inside1 = _mm256_and_ps(
+		_mm256_and_ps(_mm256_cmp_ps(x1, zero, _CMP_GE_OQ), _mm256_cmp_ps(x1, maxX, _CMP_LE_OQ)),
+		_mm256_and_ps(_mm256_cmp_ps(y1, zero, _CMP_GE_OQ), _mm256_cmp_ps(y1, maxY, _CMP_LE_OQ)));
+	__m256 inside2 = _mm256_and_ps(
+		_mm256_and_ps(_mm256_cmp_ps(x2, zero, _CMP_GE_OQ), _mm256_cmp_ps(x2, maxX, _CMP_LE_OQ)),
+		_mm256_and_ps(_mm256_cmp_ps(y2, zero, _CMP_GE_OQ), _mm256_cmp_ps(y2, maxY, _CMP_LE_OQ)));
+	__m256 accepted = _mm256_and_ps(inside1, inside2);
+	if (_mm256_movemask_ps(accepted) == 0xFF)
+	{
+		return accepted;
+	}
+
+	__m256 rejected = _mm256_or_ps(
+		_mm256_or_ps(
+			_mm256_and_ps(_mm256_cmp_ps(x1, zero, _CMP_LT_OQ), _mm256_cmp_ps(x2, zero, _CMP_LT_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(x1, maxX, _CMP_GT_OQ), _mm256_cmp_ps(x2, maxX, _CMP_GT_OQ))),
+		_mm256_or_ps(
+			_mm256_and_ps(_mm256_cmp_ps(y1, zero, _CMP_LT_OQ), _mm256_cmp_ps(y2, zero, _CMP_LT_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(y1, maxY, _CMP_GT_OQ), _mm256_cmp_ps(y2, maxY, _CMP_GT_OQ))));
+	rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(x1, y1, _CMP_UNORD_Q));
+	rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(x2, y2, _CMP_UNORD_Q));
+	// Zoomed in, most lines miss the canvas entirely, and whole groups
+	// are settled by their outcodes without dividing.
+	if (_mm256_movemask_ps(_mm256_or_ps(accepted, rejected)) == 0xFF)
+	{
+		return accepted;
+	}
+
+	__m256 signBits = _mm256_set1_ps(-0.0f);
+	__m256 dx = _mm256_sub_ps(x2, x1);
+	__m256 dy = _mm256_sub_ps(y2, y1);
+	__m256 negDx = _mm256_xor_ps(dx, signBits);
+	__m256 negDy = _mm256_xor_ps(dy, signBits);
+	__m256 p[4] = {negDx, dx, negDy, dy};
+	__m256 q[4] = {x1, _mm256_sub_ps(maxX, x1), y1, _mm256_sub_ps(maxY, y1)};
+	__m256 t0 = zero;
+	__m256 t1 = _mm256_set1_ps(1.0f);
+	for (u32 e = 0; e < 4; ++e)
+	{
+		// Lanes parallel to the edge divide by zero, and don't use
+		// the result.
+		__m256 r = _mm256_div_ps(q[e], p[e]);
+		__m256 entering = _mm256_cmp_ps(p[e], zero, _CMP_LT_OQ);
+		__m256 leaving = _mm256_cmp_ps(p[e], zero, _CMP_GT_OQ);
+		__m256 parallel = _mm256_cmp_ps(p[e], zero, _CMP_EQ_OQ);
+		t0 = _mm256_blendv_ps(t0, _mm256_max_ps(r, t0), entering);
+		t1 = _mm256_blendv_ps(t1, _mm256_min_ps(r, t1), leaving);
+		rejected = _mm256_or_ps(rejected, _mm256_and_ps(parallel, _mm256_cmp_ps(q[e], zero, _CMP_LT_OQ)));
+	}
+	rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(t0, t1, _CMP_NLE_UQ));
+
+	__m256 clipStart = _mm256_cmp_ps(t0, zero, _CMP_GT_OQ);
+	__m256 clipEnd = _mm256_cmp_ps(t1, _mm256_set1_ps(1.0f), _CMP_LT_OQ);
+	__m256 clipped[4] = {
+		_mm256_blendv_ps(x1, _mm256_add_ps(x1, _mm256_mul_ps(t0, dx)), clipStart),
+		_mm256_blendv_ps(y1, _mm256_add_ps(y1, _mm256_mul_ps(t0, dy)), clipStart),
+		_mm256_blendv_ps(x2, _mm256_add_ps(x1, _mm256_mul_ps(t1, dx)), clipEnd),
+		_mm256_blendv_ps(y2, _mm256_add_ps(y1, _mm256_mul_ps(t1, dy)), clipEnd)};
+	__m256 limits[4] = {maxX, maxY, maxX, maxY};
+	for (u32 c = 0; c < 4; ++c)
+	{
+		clipped[c] = _mm256_min_ps(_mm256_max_ps(clipped[c], zero), limits[c]);
+	}
+
+	// Lines inside the bounds come through unchanged.
+	x1 = _mm256_blendv_ps(clipped[0], x1, accepted);
+	y1 = _mm256_blendv_ps(clipped[1], y1, accepted);
+	x2 = _mm256_blendv_ps(clipped[2], x2, accepted);
+	y2 = _mm256_blendv_ps(clipped[3], y2, accepted);
+	rejected = _mm256_andnot_ps(accepted, rejected);
+	return _mm256_xor_ps(rejected, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+}
+
+// Draws a line whose ends are on the canvas, with the pixels drawLine
+// draws for it, a run at a time instead of a pixel at a time.
+// Bresenham's line takes one step along its major axis per pixel, and
+// after k steps has taken m(k) = floor((2 k d1 + d2) / (2 d2)) steps
+// along its minor axis, where d1 and d2 are the minor and major
+// extents. The pixels sharing a minor coordinate form a run. Shallow
+// lines' runs are horizontal spans, written with the span kernels.
+// Steep lines' runs are vertical. Axis-aligned and 45 degree lines
+// are a single run.
+static void drawAliasedLine(const CpuFeatures& cpu, Bitmap canvas, LineF32 line, ColorU8 color)
+{
+	i32 x1 = (i32) line.p1.x;
+	i32 y1 = (i32) line.p1.y;
+	i32 x2 = (i32) line.p2.x;
+	i32 y2 = (i32) line.p2.y;
+	if (x1 > x2)
+	{
+		swap(x1, x2);
+		swap(y1, y2);
+	}
+
+	// Pixel k of the line is at (x1 + k, y1 + stepY m(k)) when it is
+	// shallow, and at (x1 + m(k), y1 + stepY k) when it is steep.
+	i32 dx = x2 - x1;
+	i32 dy = y2 - y1;
+	i32 stepY = dy < 0 ? -1 : 1;
+	dy = dy < 0 ? -dy : dy;
+	bool shallow = dx >= dy;
+	i32 d1 = shallow ? dy : dx;
+	i32 d2 = shallow ? dx : dy;
+
+	// Clipping limits the steps taken along each axis. Along y, steps
+	// are counted in the line's direction.
+	PixelRect drawable = drawableRect(canvas);
+	i32 xStepMin = drawable.xMin - x1;
+	i32 xStepMax = drawable.xMax - 1 - x1;
+	i32 yStepMin = stepY > 0 ? drawable.yMin - y1 : y1 - (drawable.yMax - 1);
+	i32 yStepMax = stepY > 0 ? drawable.yMax - 1 - y1 : y1 - drawable.yMin;
+	i32 kMin = shallow ? xStepMin : yStepMin;
+	i32 kMax = shallow ? xStepMax : yStepMax;
+	i32 mMin = shallow ? yStepMin : xStepMin;
+	i32 mMax = shallow ? yStepMax : xStepMax;
+	kMin = kMin > 0 ? kMin : 0;
+	kMax = kMax < d2 ? kMax : d2;
+	mMin = mMin > 0 ? mMin : 0;
+	mMax = mMax < d1 ? mMax : d1;
+	if (kMin > kMax || mMin > mMax)
+	{
+		return;
+	}
+
+	LinePen pen = newLinePen(canvas, color);
+
+	if (d1 == 0)
+	{
+		// horizontal, vertical, or a single pixel
+		u32 count = (u32) (kMax - kMin + 1);
+		if (shallow)
+		{
+			drawLineSpan(cpu, canvas, pen, x1 + kMin, y1, count);
+		} else
+		{
+			drawLineRun(canvas, pen, x1, y1 + stepY * kMin, 0, stepY, count);
+		}
+		return;
+	}
+
+	if (d1 == d2)
+	{
+		// 45 degrees, so m(k) = k
+		i32 first = kMin > mMin ? kMin : mMin;
+		i32 last = kMax < mMax ? kMax : mMax;
+		if (first <= last)
+		{
+			drawLineRun(canvas, pen, x1 + first, y1 + stepY * first, 1, stepY, (u32) (last - first + 1));
+		}
+		return;
+	}
+
+	// Only the runs holding steps kMin through kMax can be drawn.
+	i32 mFirst = (i32) ((2 * (i64) kMin * d1 + d2) / (2 * (i64) d2));
+	i32 mLast = (i32) ((2 * (i64) kMax * d1 + d2) / (2 * (i64) d2));
+	mMin = mMin > mFirst ? mMin : mFirst;
+	mMax = mMax < mLast ? mMax : mLast;
+	if (mMin > mMax)
+	{
+		return;
+	}
+
+	if (d2 < minLineRunLength * d1)
+	{
+		drawLineSteps(canvas, pen, x1, y1, stepY, shallow, d1, d2, kMin, kMax, mMin, mMax);
+		return;
+	}
+
+	// Run m starts at the first step with m(k) = m, which is
+	// ceil((2 m - 1) d2 / (2 d1)). The start of the next run is
+	// tracked as that quotient and the remainder `error`, such that
+	// nextStart * denominator - error = (2 m + 1) d2. Moving to the
+	// following run adds 2 d2 to the numerator.
+	i32 denominator = 2 * d1;
+	i32 quotientIncr = d2 / d1;
+	i32 remainderIncr = (2 * d2) % denominator;
+	i64 numerator = (2 * (i64) mMin + 1) * d2;
+	i32 nextStart = (i32) ((numerator + denominator - 1) / denominator);
+	i32 error = (i32) ((i64) nextStart * denominator - numerator);
+	i32 start = mMin == 0
+		? 0
+		: (i32) (((2 * (i64) mMin - 1) * d2 + denominator - 1) / denominator);
+
+	for (i32 m = mMin; m <= mMax; ++m)
+	{
+		i32 first = start > kMin ? start : kMin;
+		i32 last = nextStart - 1 < kMax ? nextStart - 1 : kMax;
+		u32 count = (u32) (last - first + 1);
+		if (shallow)
+		{
+			drawLineSpan(cpu, canvas, pen, x1 + first, y1 + stepY * m, count);
+		} else
+		{
+			drawLineRun(canvas, pen, x1 + m, y1 + stepY * first, 0, stepY, count);
+		}
+
+		start = nextStart;
+		nextStart += quotientIncr;
+		error -= remainderIncr;
+		if (error < 0)
+		{
+			error += denominator;
+			++nextStart;
+		}
+	}
+}
+
+// Blends a color scaled by `coverage`, out of coverageOne, over a
+// pixel of an anti-aliased line.
+inline static void coverLinePixel(u8 *pPixel, bool linear, u32 pixel, u64 pixelLinear, u32 coverage)
+{
+	if (linear)
+	{
+		*(u64*) pPixel = blendLinearPixel(*(u64*) pPixel, scaleLinearPixel(pixelLinear, coverage));
+	} else
+	{
+		// 8-bit coverage, rounded
+		u32 scale = (coverage * 255 + coverageOne / 2) >> 16;
+		*(u32*) pPixel = blendPixel(*(u32*) pPixel, scalePixel(pixel, scale));
+	}
+}
+
+// Draws a line whose ends are on the canvas with anti-aliased edges,
+// the way Wu's algorithm does, in 16.16 fixed point. The line is a
+// pixel wide. At the center of each pixel along its major axis, its
+// minor coordinate splits the coverage between the two pixels whose
+// centers straddle it. Each of those columns' coverage is weighted by
+// how much of the column the line spans, so the end points keep their
+// subpixel positions. The color is scaled by the coverage and blended
+// like any translucent color. The shape ID goes to the pixel holding
+// most of each column's coverage.
+static void drawAntialiasedLine(Bitmap canvas, LineF32 line, ColorU8 color)
+{
+	const i64 one = coverageOne;
+	f32 dx = line.p2.x - line.p1.x;
+	f32 dy = line.p2.y - line.p1.y;
+	bool shallow = (dx < 0.0f ? -dx : dx) >= (dy < 0.0f ? -dy : dy);
+
+	// a is the major coordinate and b the minor one. Clipping left
+	// them non-negative, so they round by adding a half.
+	i64 a1 = (i64) ((shallow ? line.p1.x : line.p1.y) * (f32) one + 0.5f);
+	i64 b1 = (i64) ((shallow ? line.p1.y : line.p1.x) * (f32) one + 0.5f);
+	i64 a2 = (i64) ((shallow ? line.p2.x : line.p2.y) * (f32) one + 0.5f);
+	i64 b2 = (i64) ((shallow ? line.p2.y : line.p2.x) * (f32) one + 0.5f);
+	if (a1 > a2)
+	{
+		i64 a = a1, b = b1;
+		a1 = a2;
+		b1 = b2;
+		a2 = a;
+		b2 = b;
+	}
+	if (a1 == a2)
+	{
+		// the line covers no area
+		return;
+	}
+
+	// The minor coordinate at the center of column i is
+	// base + i * gradient. It is computed from scratch for the first
+	// column drawn rather than accumulated from the line's start, so
+	// the pixels don't depend on how the canvas is clipped.
+	i64 gradient = (b2 - b1) * one / (a2 - a1);
+	i64 base = b1 + (((one / 2 - a1) * gradient) >> 16);
+
+	PixelRect drawable = drawableRect(canvas);
+	i32 majorMin = shallow ? drawable.xMin : drawable.yMin;
+	i32 majorMax = shallow ? drawable.xMax : drawable.yMax;
+	i32 minorMin = shallow ? drawable.yMin : drawable.xMin;
+	i32 minorMax = shallow ? drawable.yMax : drawable.xMax;
+	i32 first = (i32) (a1 >> 16);
+	i32 last = (i32) ((a2 - 1) >> 16);
+	first = first > majorMin ? first : majorMin;
+	last = last < majorMax - 1 ? last : majorMax - 1;
+
+	bool linear = canvas.format == PixelFormat::LinearBgra16;
+	u32 pixel = premultiplyPixel(color);
+	u64 pixelLinear = linear ? linearPixel(color) : 0;
+	u8 *shapeIds = color.a > 0 ? canvas.shapeIds : nullptr;
+
+	// Only the columns at the line's ends can be partly spanned.
+	i32 fullFirst = (i32) ((a1 + one - 1) >> 16);
+	i32 fullLast = (i32) (a2 >> 16) - 1;
+	i32 pixelSize = (i32) bytesPerPixel(canvas.format);
+	ptrdiff_t majorIncr = shallow ? pixelSize : canvas.pitch;
+	ptrdiff_t minorIncr = shallow ? canvas.pitch : pixelSize;
+	ptrdiff_t majorIdIncr = shallow ? 4 : canvas.shapeIdPitch;
+	ptrdiff_t minorIdIncr = shallow ? canvas.shapeIdPitch : 4;
+
+	i64 minor = base + first * gradient - one / 2;
+	for (i32 i = first; i <= last; ++i, minor += gradient)
+	{
+		u32 weight = (u32) one;
+		if (i < fullFirst || i > fullLast)
+		{
+			i64 columnMin = (i64) i << 16;
+			i64 spanMin = a1 > columnMin ? a1 : columnMin;
+			i64 spanMax = a2 < columnMin + one ? a2 : columnMin + one;
+			weight = (u32) (spanMax - spanMin);
+		}
+
+		// The pixel centers at minor coordinates j + 1/2 and j + 3/2
+		// straddle the line.
+		i32 j = (i32) (minor >> 16);
+		u32 fraction = (u32) (minor & (one - 1));
+		u32 coverage0 = (u32) (((one - fraction) * weight) >> 16);
+		u32 coverage1 = (u32) (((i64) fraction * weight) >> 16);
+		if (j >= minorMin && j + 1 < minorMax)
+		{
+			u8 *pPixel = canvas.pixels + i * majorIncr + j * minorIncr;
+			coverLinePixel(pPixel, linear, pixel, pixelLinear, coverage0);
+			coverLinePixel(pPixel + minorIncr, linear, pixel, pixelLinear, coverage1);
+		} else
+		{
+			if (j >= minorMin && j < minorMax)
+			{
+				u8 *pPixel = canvas.pixels + i * majorIncr + j * minorIncr;
+				coverLinePixel(pPixel, linear, pixel, pixelLinear, coverage0);
+			}
+			if (j + 1 >= minorMin && j + 1 < minorMax)
+			{
+				u8 *pPixel = canvas.pixels + i * majorIncr + (j + 1) * minorIncr;
+				coverLinePixel(pPixel, linear, pixel, pixelLinear, coverage1);
+			}
+		}
+
+		i32 jId = fraction < one / 2 ? j : j + 1;
+		if (shapeIds != nullptr && jId >= minorMin && jId < minorMax)
+		{
+			*(u32*) (shapeIds + i * majorIdIncr + jId * minorIdIncr) = canvas.shapeId;
+		}
+	}
+}
+
+// Aliased lines truncate their end points to pixels, so they are
+// clipped to the last pixels' corners. Anti-aliased lines cover the
+// canvas up to its edges.
+inline static Vec2 lineClipMax(Bitmap canvas)
+{
+	f32 inset = canvas.antialiased ? 0.0f : 1.0f;
+	return {(f32) canvas.width - inset, (f32) canvas.height - inset};
+}
+
+// Draws a line that clipLineLiangBarsky has clipped to lineClipMax.
+inline static void drawClippedLine(const CpuFeatures& cpu, Bitmap canvas, LineF32 line, ColorU8 color)
+{
+	if (canvas.antialiased)
+	{
+		drawAntialiasedLine(canvas, line, color);
+	} else
+	{
+		drawAliasedLine(cpu, canvas, line, color);
+	}
+}
+
+// Draws a line like drawLine does, a run at a time. Lines crossing the
+// canvas edges are clipped with Liang-Barsky rather than
+// Cohen-Sutherland, so their clipped ends may round to a neighboring
+// pixel. On an anti-aliased canvas, the line is anti-aliased instead.
+void drawLineRunSlice(const CpuFeatures& cpu, Bitmap canvas, LineF32 line, ColorU8 color)
+{
+	assert(canvas.width > 0 && canvas.height > 0);
+
+	Vec2 max = lineClipMax(canvas);
+	if (!clipLineLiangBarsky(max, line))
+	{
+		return;
+	}
+	drawClippedLine(cpu, canvas, line, color);
+}
+
+// Transforms eight lines to pixel space and clips them to the canvas.
+// The lines are loaded two to a register and transposed, which leaves
+// line j in lane (j / 2) + 4 (j % 2). Returns the clipped coordinates
+// in those lanes, and a bit mask, in line order, of the lines to draw.
+TARGET_AVX2
+static u32 clipLineBlockAvx2(
+	const LineF32 *lines, Vec2 viewportMin, f32 pixelsPerUnit, Vec2 max, f32 coordsPx[4][8])
+{
+	static_assert(sizeof(LineF32) == 4 * sizeof(f32), "lines are loaded as four floats");
+	// Broadcasting the (x, y) pair as one 64-bit value keeps the
+	// compiler from assembling the vector in memory from smaller stores.
+	static_assert(sizeof(Vec2) == sizeof(f64), "viewportMin is loaded as one 64-bit value");
+	__m256 offset = _mm256_castpd_ps(_mm256_broadcast_sd((const f64*) &viewportMin));
+	__m256 scale = _mm256_set1_ps(pixelsPerUnit);
+	__m256 pairs[4];
+	for (u32 i = 0; i < 4; ++i)
+	{
+		pairs[i] = _mm256_loadu_ps((const f32*) (lines + 2 * i));
+		pairs[i] = _mm256_mul_ps(_mm256_sub_ps(pairs[i], offset), scale);
+	}
+
+	__m256 low01 = _mm256_unpacklo_ps(pairs[0], pairs[1]);
+	__m256 high01 = _mm256_unpackhi_ps(pairs[0], pairs[1]);
+	__m256 low23 = _mm256_unpacklo_ps(pairs[2], pairs[3]);
+	__m256 high23 = _mm256_unpackhi_ps(pairs[2], pairs[3]);
+	__m256 x1 = _mm256_shuffle_ps(low01, low23, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 y1 = _mm256_shuffle_ps(low01, low23, _MM_SHUFFLE(3, 2, 3, 2));
+	__m256 x2 = _mm256_shuffle_ps(high01, high23, _MM_SHUFFLE(1, 0, 1, 0));
+	__m256 y2 = _mm256_shuffle_ps(high01, high23, _MM_SHUFFLE(3, 2, 3, 2));
+
+	__m256 visible = clipLinesAvx2(x1, y1, x2, y2, _mm256_set1_ps(max.x), _mm256_set1_ps(max.y));
+	_mm256_storeu_ps(coordsPx[0], x1);
+	_mm256_storeu_ps(coordsPx[1], y1);
+	_mm256_storeu_ps(coordsPx[2], x2);
+	_mm256_storeu_ps(coordsPx[3], y2);
+
+	// lanes 0-3 hold the even lines, and 4-7 the odd ones
+	u32 laneMask = (u32) _mm256_movemask_ps(visible);
+	u32 mask = 0;
+	for (u32 j = 0; j < 8; ++j)
+	{
+		mask |= ((laneMask >> ((j >> 1) + 4 * (j & 1))) & 1) << j;
+	}
+	return mask;
+}
+
+// Draws lines given in world space, in order. The lines are
+// transformed to pixel space and clipped to the canvas eight at a
+// time, so only the lines that reach the canvas are handed to the
+// rasterizer, one call each. The pixels are the same as calling
+// drawLineRunSlice on each transformed line. When `shapeIds` is given,
+// each line writes its own ID to the shape ID plane instead of
+// canvas.shapeId.
+void drawLines(
+	const CpuFeatures& cpu,
+	Bitmap canvas,
+	const LineF32 *lines,
+	const ColorU8 *colors,
+	const u32 *shapeIds,
+	u32 count,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit)
+{
+	assert(canvas.width > 0 && canvas.height > 0);
+
+	Vec2 max = lineClipMax(canvas);
+	u32 i = 0;
+	if (cpu.avx2)
+	{
+		f32 coordsPx[4][8];
+		for (; i + 8 <= count; i += 8)
+		{
+			u32 mask = clipLineBlockAvx2(lines + i, viewportMin, pixelsPerUnit, max, coordsPx);
+			for (u32 j = 0; j < 8; ++j)
+			{
+				if ((mask & (1 << j)) == 0)
+				{
+					continue;
+				}
+				u32 lane = (j >> 1) + 4 * (j & 1);
+				LineF32 line;
+				line.p1 = {coordsPx[0][lane], coordsPx[1][lane]};
+				line.p2 = {coordsPx[2][lane], coordsPx[3][lane]};
+				if (shapeIds != nullptr)
+				{
+					canvas.shapeId = shapeIds[i + j];
+				}
+				drawClippedLine(cpu, canvas, line, colors[i + j]);
+			}
+		}
+	}
+
+	for (; i < count; ++i)
+	{
+		LineF32 line;
+		line.p1 = (lines[i].p1 - viewportMin) * pixelsPerUnit;
+		line.p2 = (lines[i].p2 - viewportMin) * pixelsPerUnit;
+		if (clipLineLiangBarsky(max, line))
+		{
+			if (shapeIds != nullptr)
+			{
+				canvas.shapeId = shapeIds[i];
+			}
+			drawClippedLine(cpu, canvas, line, colors[i]);
+		}
+	}
+}
+
+// Consecutive lines of the scene are queued, and drawn together with
+// drawLines once a shape of another type comes up, or the batch fills.
+const u32 lineBatchSize = 64;
+
+struct LineBatch
+{
+	u32 count;
+	LineF32 lines[lineBatchSize];
+	ColorU8 colors[lineBatchSize];
+	u32 shapeIds[lineBatchSize];
+};
+
+inline static void flushLineBatch(
+	const CpuFeatures& cpu, Bitmap canvas, LineBatch& batch, Vec2 viewportMin, f32 pixelsPerUnit)
+{
+	if (batch.count > 0)
+	{
+		drawLines(
+			cpu, canvas, batch.lines, batch.colors, batch.shapeIds, batch.count, viewportMin, pixelsPerUnit);
+		batch.count = 0;
+	}
+}
+
+void drawText(
+	const AsciiFont& font,
+	Bitmap canvas,
+	const char *strBegin,
+	const char *strEnd,
+	i32 leftEdge,
+	i32 baseline,
+	ColorU8 textColor)
+{
+	// Glyph bitmaps hold coverage, which scales the text color.
+	u32 textPixel = premultiplyPixel(textColor);
+	u64 textPixelLinear = 0;
+	bool linear = canvas.format == PixelFormat::LinearBgra16;
+	if (linear)
+	{
+		textPixelLinear = linearPixel(textColor);
+	}
+	u32 pixelSize = bytesPerPixel(canvas.format);
+	PixelRect drawable = drawableRect(canvas);
+
+	u32 bmpSize = font.bitmapWidth * font.bitmapHeight;
+	while (strBegin != strEnd)
+	{
+		char c = *strBegin;
+		++strBegin;
+
+		GlyphMetrics glyph = font.glyphMetrics[c];
+
+		i32 glyphX = leftEdge + glyph.offsetLeft;
+
+		// clip the left edge
+		i32 bmpStartCol;
+		if (glyphX < drawable.xMin)
+		{
+			bmpStartCol = drawable.xMin - glyphX;
+			glyphX = drawable.xMin;
+		} else
+		{
+			bmpStartCol = 0;
+		}
+
+		// clip the right edge
+		i32 bmpEndCol;
+		if (glyphX + (i32) font.bitmapWidth - bmpStartCol >= drawable.xMax)
+		{
+			bmpEndCol = drawable.xMax - glyphX + bmpStartCol;
+		} else
+		{
+			bmpEndCol = font.bitmapWidth;
+		}
+
+		i32 glyphY = baseline - glyph.offsetTop;
+
+		// clip the bottom edge
+		i32 bmpEndRow;
+		if (glyphY - drawable.yMin < (i32) font.bitmapHeight - 1)
+		{
+			bmpEndRow = glyphY - drawable.yMin + 1;
+		} else
+		{
+			bmpEndRow = font.bitmapHeight;
+		}
+
+		// clip the top edge
+		i32 bmpStartRow;
+		if (glyphY >= drawable.yMax)
+		{
+			bmpStartRow = glyphY - drawable.yMax + 1;
+			glyphY = drawable.yMax - 1;
+		} else
+		{
+			bmpStartRow = 0;
+		}
+
+		auto pCanvas = canvas.pixels + canvas.pitch * glyphY;
+		auto pBmp = font.bitmaps + bmpSize * c + bmpStartRow * font.bitmapWidth;
+		for (i32 row = bmpStartRow; row < bmpEndRow; ++row)
+		{
+			auto pCanvasRow = pCanvas + pixelSize * glyphX;
+			auto pBmpRow = pBmp + bmpStartCol;
+			for (i32 col = bmpStartCol; col < bmpEndCol; ++col)
+			{
+				if (linear)
+				{
+					auto *pPixel = (u64*) pCanvasRow;
+					u32 coverage = (u32) *pBmpRow * 257;
+					*pPixel = blendLinearPixel(*pPixel, scaleLinearPixel(textPixelLinear, coverage));
+				} else
+				{
+					auto *pPixel = (u32*) pCanvasRow;
+					*pPixel = blendPixel(*pPixel, scalePixel(textPixel, *pBmpRow));
+				}
+				pCanvasRow += pixelSize;
+				++pBmpRow;
+			}
+			pCanvas -= canvas.pitch;
+			pBmp += font.bitmapWidth;
+		}
+
+		leftEdge += glyph.advanceX;
+	}
+}
+
+inline Vec2 globalToPixelSpace(Vec2 viewportMin, f32 pixelsPerUnit, Vec2 v)
+{
+	return (v - viewportMin) * pixelsPerUnit;
+}
+
+inline RectF32 globalToPixelSpace(Vec2 viewportMin, f32 pixelsPerUnit, RectF32 rect)
+{
+	rect.min = globalToPixelSpace(viewportMin, pixelsPerUnit, rect.min);
+	rect.width *= pixelsPerUnit;
+	rect.height *= pixelsPerUnit;
+	return rect;
+}
+
+inline LineF32 globalToPixelSpace(Vec2 viewportMin, f32 pixelsPerUnit, LineF32 line)
+{
+	line.p1 = globalToPixelSpace(viewportMin, pixelsPerUnit, line.p1);
+	line.p2 = globalToPixelSpace(viewportMin, pixelsPerUnit, line.p2);
+	return line;
+}
+
+Vec2 pixelToGlobalSpace(Vec2 viewportMin, f32 unitsPerPixel, Vec2 v)
+{
+	return v * unitsPerPixel + viewportMin;
+}
+
+// Transforms one coordinate (x or y) of the points at the listed
+// indices into pixel space. Other elements of coordsPx are untouched.
+static void coordsToPixelSpace(
+	u32 count, const u32 *indices, const f32 *coords, f32 viewportMin, f32 pixelsPerUnit, f32 *coordsPx)
+{
+	for (u32 k = 0; k < count; ++k)
+	{
+		u32 i = indices[k];
+		coordsPx[i] = (coords[i] - viewportMin) * pixelsPerUnit;
+	}
+}
+
+static void lengthsToPixelSpace(
+	u32 count, const u32 *indices, const f32 *lengths, f32 pixelsPerUnit, f32 *lengthsPx)
+{
+	for (u32 k = 0; k < count; ++k)
+	{
+		u32 i = indices[k];
+		lengthsPx[i] = lengths[i] * pixelsPerUnit;
+	}
+}
+
+inline ShapeRef makeShapeRef(ShapeType type, u32 index)
+{
+	assert(index <= shapeRefIndexMask);
+	return ((u32) type << shapeRefTypeShift) | index;
+}
+
+inline ShapeType shapeRefType(ShapeRef ref)
+{
+	return (ShapeType) (ref >> shapeRefTypeShift);
+}
+
+inline u32 shapeRefIndex(ShapeRef ref)
+{
+	return ref & shapeRefIndexMask;
+}
+
+inline u32 sceneShapeCount(const Scene& scene)
+{
+	return scene.shapeCount;
+}
+
+inline ShapeHandle makeShapeHandle(u32 slot, u32 generation)
+{
+	assert(slot < maxShapeCount);
+	return ((ShapeHandle) generation << shapeHandleGenerationShift) | slot;
+}
+
+// Finds the slot of the shape a handle refers to. Returns false
+// if the handle is null, or the shape has been removed.
+inline bool resolveShapeHandle(const Scene& scene, ShapeHandle handle, u32& slot)
+{
+	slot = (u32) handle;
+	return handle != nullShapeHandle
+		&& slot < scene.slotSoa.count
+		&& makeShapeHandle(slot, scene.generations[slot]) == handle;
+}
+
+inline ShapeHandle slotShapeHandle(const Scene& scene, u32 slot)
+{
+	return makeShapeHandle(slot, scene.generations[slot]);
+}
+
+static bool newScene(Scene& scene, PermanentMem& mem)
+{
+	scene = {};
+
+	RectShapes& rects = scene.rects;
+	if (!newSoaArrays(rects.soa, 7, 4, maxShapeCount, mem, MemSubsystem::Shapes))
+	{
+		return false;
+	}
+	rects.minX = (f32*) soaColumn(rects.soa, 0);
+	rects.minY = (f32*) soaColumn(rects.soa, 1);
+	rects.width = (f32*) soaColumn(rects.soa, 2);
+	rects.height = (f32*) soaColumn(rects.soa, 3);
+	rects.colors = (ColorU8*) soaColumn(rects.soa, 4);
+	rects.z = (u32*) soaColumn(rects.soa, 5);
+	rects.slots = (u32*) soaColumn(rects.soa, 6);
+
+	LineShapes& lines = scene.lines;
+	if (!newSoaArrays(lines.soa, 11, 4, maxShapeCount, mem, MemSubsystem::Shapes))
+	{
+		return false;
+	}
+	lines.x1 = (f32*) soaColumn(lines.soa, 0);
+	lines.y1 = (f32*) soaColumn(lines.soa, 1);
+	lines.x2 = (f32*) soaColumn(lines.soa, 2);
+	lines.y2 = (f32*) soaColumn(lines.soa, 3);
+	lines.minX = (f32*) soaColumn(lines.soa, 4);
+	lines.minY = (f32*) soaColumn(lines.soa, 5);
+	lines.maxX = (f32*) soaColumn(lines.soa, 6);
+	lines.maxY = (f32*) soaColumn(lines.soa, 7);
+	lines.colors = (ColorU8*) soaColumn(lines.soa, 8);
+	lines.z = (u32*) soaColumn(lines.soa, 9);
+	lines.slots = (u32*) soaColumn(lines.soa, 10);
+
+	if (!newSoaArrays(scene.slotSoa, 4, 4, maxShapeCount, mem, MemSubsystem::Shapes))
+	{
+		return false;
+	}
+	scene.generations = (u32*) soaColumn(scene.slotSoa, 0);
+	scene.refs = (u32*) soaColumn(scene.slotSoa, 1);
+	scene.zPrev = (u32*) soaColumn(scene.slotSoa, 2);
+	scene.zNext = (u32*) soaColumn(scene.slotSoa, 3);
+
+	scene.firstFreeSlot = noSlot;
+	scene.zBack = noSlot;
+	scene.zFront = noSlot;
+	scene.nextZ = 1;
+
+	return true;
+}
+
+Shape getShape(const Scene& scene, ShapeRef ref)
+{
+	Shape shape = {};
+	shape.type = shapeRefType(ref);
+	u32 i = shapeRefIndex(ref);
+	switch (shape.type)
+	{
+	case ShapeType::Rectangle:
+	{
+		const RectShapes& rects = scene.rects;
+		assert(i < rects.soa.count);
+		shape.color = rects.colors[i];
+		shape.data.rect.min = {rects.minX[i], rects.minY[i]};
+		shape.data.rect.width = rects.width[i];
+		shape.data.rect.height = rects.height[i];
+	} break;
+	case ShapeType::Line:
+	{
+		const LineShapes& lines = scene.lines;
+		assert(i < lines.soa.count);
+		shape.color = lines.colors[i];
+		shape.data.line.p1 = {lines.x1[i], lines.y1[i]};
+		shape.data.line.p2 = {lines.x2[i], lines.y2[i]};
+	} break;
+	default:
+		unreachable();
+		break;
+	}
+	return shape;
+}
+
+// Commits memory for at least `count` more shapes of the given
+// type, so a bulk insert does not commit pages piece by piece.
+bool reserveShapes(Application& app, ShapeType type, u32 count)
+{
+	Scene& scene = app.scene;
+	SoaArrays *typeSoa;
+	switch (type)
+	{
+	case ShapeType::Rectangle:
+		typeSoa = &scene.rects.soa;
+		break;
+	case ShapeType::Line:
+		typeSoa = &scene.lines.soa;
+		break;
+	default:
+		unreachable();
+		return false;
+	}
+
+	if (count > maxShapeCount - sceneShapeCount(scene))
+	{
+		return false;
+	}
+
+	// This may reserve more slots than needed, since free slots are
+	// reused.
+	return reserveSoaArrays(*typeSoa, typeSoa->count + count)
+		&& reserveSoaArrays(scene.slotSoa, scene.slotSoa.count + count);
+}
+
+// Adds a slot to the front of the z-order.
+static void linkZFront(Scene& scene, u32 slot)
+{
+	scene.zPrev[slot] = scene.zFront;
+	scene.zNext[slot] = noSlot;
+	if (scene.zFront == noSlot)
+	{
+		scene.zBack = slot;
+	} else
+	{
+		scene.zNext[scene.zFront] = slot;
+	}
+	scene.zFront = slot;
+}
+
+static void unlinkZ(Scene& scene, u32 slot)
+{
+	u32 prev = scene.zPrev[slot];
+	u32 next = scene.zNext[slot];
+	if (prev == noSlot)
+	{
+		scene.zBack = next;
+	} else
+	{
+		scene.zNext[prev] = next;
+	}
+	if (next == noSlot)
+	{
+		scene.zFront = prev;
+	} else
+	{
+		scene.zPrev[next] = prev;
+	}
+}
+
+inline static u32* shapeZKey(Scene& scene, ShapeRef ref)
+{
+	u32 i = shapeRefIndex(ref);
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+		return scene.rects.z + i;
+	case ShapeType::Line:
+		return scene.lines.z + i;
+	default:
+		unreachable();
+		return nullptr;
+	}
+}
+
+inline static u32 shapeRefSlot(const Scene& scene, ShapeRef ref)
+{
+	u32 i = shapeRefIndex(ref);
+	return shapeRefType(ref) == ShapeType::Rectangle ? scene.rects.slots[i] : scene.lines.slots[i];
+}
+
+// Shapes are written into shape ID planes as their slot plus one, so
+// an ID of zero means no shape.
+inline static u32 slotShapeId(u32 slot)
+{
+	return slot + 1;
+}
+
+// Adds line i of the scene to a batch, drawing the batch first if it
+// is full.
+inline static void queueSceneLine(
+	const CpuFeatures& cpu,
+	Bitmap canvas,
+	LineBatch& batch,
+	const Scene& scene,
+	u32 i,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit)
+{
+	if (batch.count == lineBatchSize)
+	{
+		flushLineBatch(cpu, canvas, batch, viewportMin, pixelsPerUnit);
+	}
+	const LineShapes& lines = scene.lines;
+	LineF32& line = batch.lines[batch.count];
+	line.p1 = {lines.x1[i], lines.y1[i]};
+	line.p2 = {lines.x2[i], lines.y2[i]};
+	batch.colors[batch.count] = lines.colors[i];
+	batch.shapeIds[batch.count] = slotShapeId(lines.slots[i]);
+	++batch.count;
+}
+
+// Takes a new z-order key for a shape added to the front. Keys only
+// run out after billions of shapes have been added, in which case all
+// shapes are given new keys, starting over from one.
+static u32 takeFrontZKey(Scene& scene)
+{
+	if (scene.nextZ == 0xFFFFFFFF)
+	{
+		u32 z = 1;
+		for (u32 slot = scene.zBack; slot != noSlot; slot = scene.zNext[slot])
+		{
+			*shapeZKey(scene, scene.refs[slot]) = z;
+			++z;
+		}
+		scene.nextZ = z;
+	}
+	u32 z = scene.nextZ;
+	++scene.nextZ;
+	return z;
+}
+
+// Transforms one shape into pixel space and draws it. Lines are only
+// queued, so the batch must be flushed after the last shape.
+static void drawSceneShape(
+	const CpuFeatures& cpu,
+	Bitmap canvas,
+	const Scene& scene,
+	ShapeRef ref,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	LineBatch& batch)
+{
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+	{
+		flushLineBatch(cpu, canvas, batch, viewportMin, pixelsPerUnit);
+		canvas.shapeId = slotShapeId(shapeRefSlot(scene, ref));
+		Shape shape = getShape(scene, ref);
+		RectF32 rect = globalToPixelSpace(viewportMin, pixelsPerUnit, shape.data.rect);
+		fillRect(cpu, canvas, rect, shape.color);
+	} break;
+	case ShapeType::Line:
+	{
+		queueSceneLine(cpu, canvas, batch, scene, shapeRefIndex(ref), viewportMin, pixelsPerUnit);
+	} break;
+	default:
+		unreachable();
+		break;
+	}
+}
+
+static bool newShapeGrid(ShapeGrid& grid, PermanentMem& mem)
+{
+	grid = {};
+
+	// The permanent stack commits zero-filled pages, so every bucket
+	// starts out empty.
+	grid.bucketHeads = (u32*) allocatePermanent(
+		mem, MemSubsystem::Caches, gridBucketCount * sizeof(u32), cacheLineSize);
+	if (grid.bucketHeads == nullptr)
+	{
+		return false;
+	}
+
+	if (!newSoaArrays(grid.entrySoa, 2, 4, maxGridEntryCount, mem, MemSubsystem::Caches))
+	{
+		return false;
+	}
+	grid.entrySlots = (u32*) soaColumn(grid.entrySoa, 0);
+	grid.entryNext = (u32*) soaColumn(grid.entrySoa, 1);
+
+	if (!newSoaArrays(grid.largeSoa, 1, 4, maxShapeCount, mem, MemSubsystem::Caches))
+	{
+		return false;
+	}
+	grid.largeSlots = (u32*) soaColumn(grid.largeSoa, 0);
+
+	return true;
+}
+
+// the index of the grid cell containing a coordinate
+inline static i32 gridCell(f32 coord)
+{
+	// Keep the cast to i32 in range. Coordinates past the limit all
+	// fall in the outermost cells.
+	f32 limit = 1.0e9f;
+	return (i32) clamp(std::floor(coord * (1.0f / gridCellSize)), -limit, limit);
+}
+
+inline static u32 gridBucket(i32 cellX, i32 cellY)
+{
+	u32 hash = (u32) cellX * 0x9E3779B1u ^ (u32) cellY * 0x85EBCA77u;
+	return hash >> (32 - gridBucketBits);
+}
+
+// Returns the inclusive range of cells covering a world-space box.
+inline static PixelRect gridCells(f32 minX, f32 minY, f32 maxX, f32 maxY)
+{
+	PixelRect cells;
+	cells.xMin = gridCell(minX);
+	cells.yMin = gridCell(minY);
+	cells.xMax = gridCell(maxX);
+	cells.yMax = gridCell(maxY);
+	return cells;
+}
+
+inline static i64 gridCellCount(PixelRect cells)
+{
+	return ((i64) cells.xMax - cells.xMin + 1) * ((i64) cells.yMax - cells.yMin + 1);
+}
+
+static PixelRect shapeGridCells(const Scene& scene, ShapeRef ref)
+{
+	u32 i = shapeRefIndex(ref);
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+	{
+		const RectShapes& rects = scene.rects;
+		f32 minX = rects.minX[i];
+		f32 minY = rects.minY[i];
+		return gridCells(minX, minY, minX + rects.width[i], minY + rects.height[i]);
+	}
+	case ShapeType::Line:
+	{
+		const LineShapes& lines = scene.lines;
+		return gridCells(lines.minX[i], lines.minY[i], lines.maxX[i], lines.maxY[i]);
+	}
+	default:
+		unreachable();
+		return PixelRect{};
+	}
+}
+
+static void addGridShape(ShapeGrid& grid, const Scene& scene, u32 slot)
+{
+	PixelRect cells = shapeGridCells(scene, scene.refs[slot]);
+	i64 cellCount = gridCellCount(cells);
+
+	// Commit room for every new entry up front, so the shape is
+	// either in all of its cells or in the large list. This may
+	// commit more than needed, since free entries are reused.
+	bool fits = cellCount <= maxGridCellsPerShape
+		&& reserveSoaArrays(grid.entrySoa, grid.entrySoa.count + (u32) cellCount);
+	if (!fits)
+	{
+		u32 l;
+		if (!pushSoaElement(grid.largeSoa, l))
+		{
+			assert(false);
+			return;
+		}
+		grid.largeSlots[l] = slot;
+		return;
+	}
+
+	for (i32 cy = cells.yMin; cy <= cells.yMax; ++cy)
+	{
+		for (i32 cx = cells.xMin; cx <= cells.xMax; ++cx)
+		{
+			u32 e;
+			if (grid.firstFreeEntry != 0)
+			{
+				e = grid.firstFreeEntry - 1;
+				grid.firstFreeEntry = grid.entryNext[e];
+			} else
+			{
+				// Room for the entry was committed above.
+				if (!pushSoaElement(grid.entrySoa, e))
+				{
+					assert(false);
+					return;
+				}
+			}
+
+			u32 bucket = gridBucket(cx, cy);
+			grid.entrySlots[e] = slot;
+			grid.entryNext[e] = grid.bucketHeads[bucket];
+			grid.bucketHeads[bucket] = e + 1;
+		}
+	}
+}
+
+// Removes a shape from the grid. This must be called before the
+// shape's coordinates change, since they give the cells it is in.
+static void removeGridShape(ShapeGrid& grid, const Scene& scene, u32 slot)
+{
+	PixelRect cells = shapeGridCells(scene, scene.refs[slot]);
+	bool inCells = false;
+	if (gridCellCount(cells) <= maxGridCellsPerShape)
+	{
+		for (i32 cy = cells.yMin; cy <= cells.yMax; ++cy)
+		{
+			for (i32 cx = cells.xMin; cx <= cells.xMax; ++cx)
+			{
+				u32 *link = &grid.bucketHeads[gridBucket(cx, cy)];
+				while (*link != 0 && grid.entrySlots[*link - 1] != slot)
+				{
+					link = &grid.entryNext[*link - 1];
+				}
+				if (*link == 0)
+				{
+					continue;
+				}
+
+				u32 e = *link - 1;
+				*link = grid.entryNext[e];
+				grid.entryNext[e] = grid.firstFreeEntry;
+				grid.firstFreeEntry = e + 1;
+				inCells = true;
+			}
+		}
+	}
+
+	if (inCells)
+	{
+		return;
+	}
+
+	// The shape was too big for the grid, or its entries could not
+	// be committed.
+	u32 largeCount = grid.largeSoa.count;
+	for (u32 l = 0; l < largeCount; ++l)
+	{
+		if (grid.largeSlots[l] == slot)
+		{
+			grid.largeSlots[l] = grid.largeSlots[largeCount - 1];
+			--grid.largeSoa.count;
+			return;
+		}
+	}
+	assert(false);
+}
+
+// Sorts values by their keys, in place. This is an LSD radix sort,
+// one byte of the keys per pass, which is stable and takes linear
+// time. Keys and values are packed together while sorting, so each
+// pass moves one array instead of two.
+static void radixSort(u32 count, u32 *keys, u32 *values, MemStack& scratchMem)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	auto memMark = mark(scratchMem);
+	u64 *src = allocateAlignedArray<u64>(scratchMem, count, cacheLineSize);
+	u64 *dst = allocateAlignedArray<u64>(scratchMem, count, cacheLineSize);
+
+	// Count the keys' bytes for every pass at once.
+	u32 offsets[4][256] = {};
+	for (u32 i = 0; i < count; ++i)
+	{
+		u32 key = keys[i];
+		src[i] = (u64) key << 32 | values[i];
+		++offsets[0][key & 0xFF];
+		++offsets[1][(key >> 8) & 0xFF];
+		++offsets[2][(key >> 16) & 0xFF];
+		++offsets[3][key >> 24];
+	}
+
+	for (u32 pass = 0; pass < 4; ++pass)
+	{
+		u32 shift = 32 + 8 * pass;
+		u32 *passOffsets = offsets[pass];
+
+		// Keys often share their high bytes, which makes whole
+		// passes unnecessary.
+		if (passOffsets[(src[0] >> shift) & 0xFF] == count)
+		{
+			continue;
+		}
+
+		u32 offset = 0;
+		for (u32 b = 0; b < 256; ++b)
+		{
+			u32 bucketCount = passOffsets[b];
+			passOffsets[b] = offset;
+			offset += bucketCount;
+		}
+		for (u32 i = 0; i < count; ++i)
+		{
+			u64 element = src[i];
+			dst[passOffsets[(element >> shift) & 0xFF]++] = element;
+		}
+
+		u64 *swapped = src;
+		src = dst;
+		dst = swapped;
+	}
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		keys[i] = (u32) (src[i] >> 32);
+		values[i] = (u32) src[i];
+	}
+	release(scratchMem, memMark);
+}
+
+// The distance along a Hilbert curve filling a 2^16 by 2^16 grid to
+// the cell (x, y).
+static u32 hilbertIndex(u32 x, u32 y)
+{
+	const u32 n = 1 << 16;
+	u32 d = 0;
+	for (u32 s = n / 2; s > 0; s /= 2)
+	{
+		u32 rx = (x & s) != 0;
+		u32 ry = (y & s) != 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		// Rotate the quadrant, so the curve through it starts and ends
+		// next to its neighbors. Quadrants are flipped by complementing
+		// the coordinates, and both steps are done with masks, since
+		// branches on the coordinates' bits are unpredictable.
+		u32 swapMask = ry - 1;
+		u32 flipMask = swapMask & (0 - rx) & (n - 1);
+		x ^= flipMask;
+		y ^= flipMask;
+		u32 swapped = (x ^ y) & swapMask;
+		x ^= swapped;
+		y ^= swapped;
+	}
+	return d;
+}
+
+// BVH bounds are padded by this fraction of their coordinates'
+// magnitudes, which covers the rounding of any query that tests the
+// candidates it finds in pixel space.
+const f32 bvhBoundsPad = 1.0f / 65536.0f;
+
+static bool newShapeBvh(ShapeBvh& bvh, PermanentMem& mem)
+{
+	bvh = {};
+
+	if (!newSoaArrays(bvh.nodeSoa, 5, 4, maxBvhNodeCount, mem, MemSubsystem::Caches))
+	{
+		return false;
+	}
+	bvh.minX = (f32*) soaColumn(bvh.nodeSoa, 0);
+	bvh.minY = (f32*) soaColumn(bvh.nodeSoa, 1);
+	bvh.maxX = (f32*) soaColumn(bvh.nodeSoa, 2);
+	bvh.maxY = (f32*) soaColumn(bvh.nodeSoa, 3);
+	bvh.leafSlots = (u32*) soaColumn(bvh.nodeSoa, 4);
+
+	if (!newSoaArrays(bvh.slotSoa, 1, 4, maxShapeCount, mem, MemSubsystem::Caches))
+	{
+		return false;
+	}
+	bvh.slotLeaves = (u32*) soaColumn(bvh.slotSoa, 0);
+
+	if (!newSoaArrays(bvh.pendingSoa, 1, 4, maxShapeCount, mem, MemSubsystem::Caches))
+	{
+		return false;
+	}
+	bvh.pendingSlots = (u32*) soaColumn(bvh.pendingSoa, 0);
+
+	if (!newSoaArrays(bvh.resultSoa, 1, 4, maxShapeCount, mem, MemSubsystem::Caches))
+	{
+		return false;
+	}
+	bvh.resultSlots = (u32*) soaColumn(bvh.resultSoa, 0);
+
+	return true;
+}
+
+// Writes the padded bounds of a shape into bounds[0..3], as minX,
+// minY, maxX and maxY. NaN bounds become infinite, so shapes with NaN
+// coordinates are found by every query.
+static void bvhShapeBounds(const Scene& scene, ShapeRef ref, f32 bounds[4])
+{
+	u32 i = shapeRefIndex(ref);
+	f32 minX, minY, maxX, maxY;
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+	{
+		const RectShapes& rects = scene.rects;
+		f32 x1 = rects.minX[i];
+		f32 y1 = rects.minY[i];
+		f32 x2 = x1 + rects.width[i];
+		f32 y2 = y1 + rects.height[i];
+		minX = min(x1, x2);
+		minY = min(y1, y2);
+		maxX = max(x1, x2);
+		maxY = max(y1, y2);
+	} break;
+	case ShapeType::Line:
+	{
+		const LineShapes& lines = scene.lines;
+		minX = lines.minX[i];
+		minY = lines.minY[i];
+		maxX = lines.maxX[i];
+		maxY = lines.maxY[i];
+	} break;
+	default:
+		unreachable();
+		return;
+	}
+
+	f32 padX = (std::abs(minX) + std::abs(maxX)) * bvhBoundsPad;
+	f32 padY = (std::abs(minY) + std::abs(maxY)) * bvhBoundsPad;
+	bounds[0] = minX - padX;
+	bounds[1] = minY - padY;
+	bounds[2] = maxX + padX;
+	bounds[3] = maxY + padY;
+	if (!(bounds[0] <= bounds[2]))
+	{
+		bounds[0] = -INFINITY;
+		bounds[2] = INFINITY;
+	}
+	if (!(bounds[1] <= bounds[3]))
+	{
+		bounds[1] = -INFINITY;
+		bounds[3] = INFINITY;
+	}
+}
+
+// Sets the bounds of a node above the leaves to enclose its children.
+// Returns whether they changed.
+static bool refitBvhNode(ShapeBvh& bvh, u32 level, u32 node)
+{
+	u32 childBegin = bvh.levelStarts[level - 1] + (node - bvh.levelStarts[level]) * bvhFanout;
+	u32 childEnd = childBegin + bvhFanout;
+	if (childEnd > bvh.levelStarts[level])
+	{
+		childEnd = bvh.levelStarts[level];
+	}
+
+	f32 minX = bvh.minX[childBegin];
+	f32 minY = bvh.minY[childBegin];
+	f32 maxX = bvh.maxX[childBegin];
+	f32 maxY = bvh.maxY[childBegin];
+	for (u32 child = childBegin + 1; child < childEnd; ++child)
+	{
+		minX = min(minX, bvh.minX[child]);
+		minY = min(minY, bvh.minY[child]);
+		maxX = max(maxX, bvh.maxX[child]);
+		maxY = max(maxY, bvh.maxY[child]);
+	}
+
+	bool changed = minX != bvh.minX[node]
+		|| minY != bvh.minY[node]
+		|| maxX != bvh.maxX[node]
+		|| maxY != bvh.maxY[node];
+	bvh.minX[node] = minX;
+	bvh.minY[node] = minY;
+	bvh.maxX[node] = maxX;
+	bvh.maxY[node] = maxY;
+	return changed;
+}
+
+// Builds the tree over every shape in the scene, emptying the pending
+// list. If memory for the tree can't be committed, the old tree is kept.
+static void buildShapeBvh(ShapeBvh& bvh, const Scene& scene, MemStack& scratchMem)
+{
+	u32 shapeCount = sceneShapeCount(scene);
+
+	u32 levelStarts[maxBvhLevelCount + 1];
+	u32 levelCount = 0;
+	u32 nodeCount = 0;
+	levelStarts[0] = 0;
+	for (u32 levelSize = shapeCount; levelSize > 0; levelSize = (levelSize + bvhFanout - 1) / bvhFanout)
+	{
+		assert(levelCount < maxBvhLevelCount);
+		nodeCount += levelSize;
+		++levelCount;
+		levelStarts[levelCount] = nodeCount;
+		if (levelSize == 1)
+		{
+			break;
+		}
+	}
+
+	if (!reserveSoaArrays(bvh.nodeSoa, nodeCount))
+	{
+		assert(false);
+		return;
+	}
+
+	auto memMark = mark(scratchMem);
+
+	// Gather the shapes' bounds, and find the bounds of their centers.
+	// The infinite bounds of NaN shapes are left out.
+	f32 *shapeMinX = allocateAlignedArray<f32>(scratchMem, shapeCount, cacheLineSize);
+	f32 *shapeMinY = allocateAlignedArray<f32>(scratchMem, shapeCount, cacheLineSize);
+	f32 *shapeMaxX = allocateAlignedArray<f32>(scratchMem, shapeCount, cacheLineSize);
+	f32 *shapeMaxY = allocateAlignedArray<f32>(scratchMem, shapeCount, cacheLineSize);
+	u32 *shapeSlots = allocateAlignedArray<u32>(scratchMem, shapeCount, cacheLineSize);
+	Vec2 centerMin = {FLT_MAX, FLT_MAX};
+	Vec2 centerMax = {-FLT_MAX, -FLT_MAX};
+	u32 s = 0;
+	for (u32 type = 0; type < 2; ++type)
+	{
+		bool rects = type == 0;
+		u32 typeCount = rects ? scene.rects.soa.count : scene.lines.soa.count;
+		const u32 *typeSlots = rects ? scene.rects.slots : scene.lines.slots;
+		for (u32 i = 0; i < typeCount; ++i, ++s)
+		{
+			u32 slot = typeSlots[i];
+			f32 bounds[4];
+			bvhShapeBounds(scene, scene.refs[slot], bounds);
+			shapeMinX[s] = bounds[0];
+			shapeMinY[s] = bounds[1];
+			shapeMaxX[s] = bounds[2];
+			shapeMaxY[s] = bounds[3];
+			shapeSlots[s] = slot;
+
+			Vec2 center = {0.5f * bounds[0] + 0.5f * bounds[2], 0.5f * bounds[1] + 0.5f * bounds[3]};
+			if (std::abs(center.x) <= FLT_MAX && std::abs(center.y) <= FLT_MAX)
+			{
+				centerMin.x = min(centerMin.x, center.x);
+				centerMin.y = min(centerMin.y, center.y);
+				centerMax.x = max(centerMax.x, center.x);
+				centerMax.y = max(centerMax.y, center.y);
+			}
+		}
+	}
+	assert(s == shapeCount);
+
+	// Sort the shapes along a Hilbert curve through a grid spanning
+	// their centers.
+	f32 extent = max(centerMax.x - centerMin.x, centerMax.y - centerMin.y);
+	f32 scale = 65535.0f / max(extent, FLT_MIN);
+	u32 *keys = allocateAlignedArray<u32>(scratchMem, shapeCount, cacheLineSize);
+	u32 *order = allocateAlignedArray<u32>(scratchMem, shapeCount, cacheLineSize);
+	for (u32 i = 0; i < shapeCount; ++i)
+	{
+		// Written so that NaN falls in the first cell.
+		f32 gx = ((0.5f * shapeMinX[i] + 0.5f * shapeMaxX[i]) - centerMin.x) * scale;
+		f32 gy = ((0.5f * shapeMinY[i] + 0.5f * shapeMaxY[i]) - centerMin.y) * scale;
+		u32 x = gx > 0.0f ? (u32) min(gx, 65535.0f) : 0;
+		u32 y = gy > 0.0f ? (u32) min(gy, 65535.0f) : 0;
+		keys[i] = hilbertIndex(x, y);
+		order[i] = i;
+	}
+	radixSort(shapeCount, keys, order, scratchMem);
+
+	bvh.nodeSoa.count = nodeCount;
+	bvh.leafCount = shapeCount;
+	bvh.deadLeafCount = 0;
+	bvh.levelCount = levelCount;
+	for (u32 l = 0; l <= levelCount; ++l)
+	{
+		bvh.levelStarts[l] = levelStarts[l];
+	}
+	bvh.pendingSoa.count = 0;
+
+	for (u32 leaf = 0; leaf < shapeCount; ++leaf)
+	{
+		u32 i = order[leaf];
+		bvh.minX[leaf] = shapeMinX[i];
+		bvh.minY[leaf] = shapeMinY[i];
+		bvh.maxX[leaf] = shapeMaxX[i];
+		bvh.maxY[leaf] = shapeMaxY[i];
+		bvh.leafSlots[leaf] = shapeSlots[i];
+		bvh.slotLeaves[shapeSlots[i]] = leaf;
+	}
+
+	for (u32 level = 1; level < levelCount; ++level)
+	{
+		for (u32 node = levelStarts[level]; node < levelStarts[level + 1]; ++node)
+		{
+			refitBvhNode(bvh, level, node);
+		}
+	}
+
+	release(scratchMem, memMark);
+}
+
+// Rebuilds the tree if too many shapes were added or removed since
+// it was built.
+static void refreshShapeBvh(ShapeBvh& bvh, const Scene& scene, MemStack& scratchMem)
+{
+	u32 staleCount = bvh.pendingSoa.count + bvh.deadLeafCount;
+	u32 maxStaleCount = bvh.leafCount / 4;
+	if (maxStaleCount < minBvhRebuildCount)
+	{
+		maxStaleCount = minBvhRebuildCount;
+	}
+	if (staleCount > maxStaleCount)
+	{
+		buildShapeBvh(bvh, scene, scratchMem);
+	}
+}
+
+// Adds the shape in a slot to the pending list.
+static void addBvhShape(ShapeBvh& bvh, u32 slot)
+{
+	u32 p;
+	// A query can find every shape, so the result list is committed
+	// up front, as shapes are added.
+	bool pushed = reserveSoaArrays(bvh.slotSoa, slot + 1)
+		&& reserveSoaArrays(bvh.resultSoa, slot + 1)
+		&& pushSoaElement(bvh.pendingSoa, p);
+	if (!pushed)
+	{
+		assert(false);
+		return;
+	}
+
+	if (bvh.slotSoa.count <= slot)
+	{
+		bvh.slotSoa.count = slot + 1;
+	}
+	bvh.pendingSlots[p] = slot;
+	bvh.slotLeaves[slot] = p | bvhPendingBit;
+}
+
+static void removeBvhShape(ShapeBvh& bvh, u32 slot)
+{
+	u32 leaf = bvh.slotLeaves[slot];
+	if ((leaf & bvhPendingBit) == 0)
+	{
+		bvh.leafSlots[leaf] = noSlot;
+		++bvh.deadLeafCount;
+		return;
+	}
+
+	u32 p = leaf & ~bvhPendingBit;
+	--bvh.pendingSoa.count;
+	u32 moved = bvh.pendingSlots[bvh.pendingSoa.count];
+	bvh.pendingSlots[p] = moved;
+	bvh.slotLeaves[moved] = p | bvhPendingBit;
+}
+
+// Updates the bounds of a shape whose coordinates changed, along with
+// the nodes above it. Nodes stop changing at the first ancestor whose
+// bounds stay the same.
+static void refitBvhShape(ShapeBvh& bvh, const Scene& scene, u32 slot)
+{
+	u32 node = bvh.slotLeaves[slot];
+	if ((node & bvhPendingBit) != 0)
+	{
+		return;
+	}
+
+	f32 bounds[4];
+	bvhShapeBounds(scene, scene.refs[slot], bounds);
+	bvh.minX[node] = bounds[0];
+	bvh.minY[node] = bounds[1];
+	bvh.maxX[node] = bounds[2];
+	bvh.maxY[node] = bounds[3];
+	for (u32 level = 1; level < bvh.levelCount; ++level)
+	{
+		node = bvh.levelStarts[level] + (node - bvh.levelStarts[level - 1]) / bvhFanout;
+		if (!refitBvhNode(bvh, level, node))
+		{
+			break;
+		}
+	}
+}
+
+// Finds the shapes whose bounds in the tree overlap a world-space box,
+// along with every pending shape, whose bounds are not known to the
+// tree. Their slots are listed in resultSlots, in no particular order.
+// Returns the number of shapes found.
+static u32 queryShapeBvh(ShapeBvh& bvh, f32 minX, f32 minY, f32 maxX, f32 maxY)
+{
+	u32 count = 0;
+	for (u32 p = 0; p < bvh.pendingSoa.count; ++p)
+	{
+		bvh.resultSlots[count++] = bvh.pendingSlots[p];
+	}
+
+	if (bvh.levelCount > 0)
+	{
+		// Each node visited pushes at most all of its children, so the
+		// stack never holds more than a full set of children per level.
+		u32 stackNodes[maxBvhLevelCount * bvhFanout];
+		u32 stackLevels[maxBvhLevelCount * bvhFanout];
+		u32 stackCount = 1;
+		stackNodes[0] = bvh.levelStarts[bvh.levelCount - 1];
+		stackLevels[0] = bvh.levelCount - 1;
+		while (stackCount > 0)
+		{
+			--stackCount;
+			u32 node = stackNodes[stackCount];
+			u32 level = stackLevels[stackCount];
+			bool overlaps = bvh.minX[node] <= maxX
+				&& bvh.maxX[node] >= minX
+				&& bvh.minY[node] <= maxY
+				&& bvh.maxY[node] >= minY;
+			if (!overlaps)
+			{
+				continue;
+			}
+
+			if (level == 0)
+			{
+				u32 slot = bvh.leafSlots[node];
+				if (slot != noSlot)
+				{
+					bvh.resultSlots[count++] = slot;
+				}
+				continue;
+			}
+
+			u32 childBegin = bvh.levelStarts[level - 1] + (node - bvh.levelStarts[level]) * bvhFanout;
+			u32 childEnd = childBegin + bvhFanout;
+			if (childEnd > bvh.levelStarts[level])
+			{
+				childEnd = bvh.levelStarts[level];
+			}
+			for (u32 child = childBegin; child < childEnd; ++child)
+			{
+				stackNodes[stackCount] = child;
+				stackLevels[stackCount] = level - 1;
+				++stackCount;
+			}
+		}
+	}
+
+	bvh.resultSoa.count = count;
+	return count;
+}
+
+static bool newSelection(Selection& selection, PermanentMem& mem)
+{
+	selection = {};
+	if (!newSoaArrays(selection.soa, 1, 4, maxShapeCount, mem, MemSubsystem::Shapes))
+	{
+		return false;
+	}
+	selection.slots = (u32*) soaColumn(selection.soa, 0);
+	return true;
+}
+
+// Returns the position of the first selected slot not less than `slot`.
+static u32 selectionLowerBound(const Selection& selection, u32 slot)
+{
+	u32 low = 0;
+	u32 high = selection.soa.count;
+	while (low < high)
+	{
+		u32 middle = low + (high - low) / 2;
+		if (selection.slots[middle] < slot)
+		{
+			low = middle + 1;
+		} else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+static void deselectShape(Selection& selection, u32 slot)
+{
+	u32 i = selectionLowerBound(selection, slot);
+	u32 count = selection.soa.count;
+	if (i == count || selection.slots[i] != slot)
+	{
+		return;
+	}
+
+	for (; i + 1 < count; ++i)
+	{
+		selection.slots[i] = selection.slots[i + 1];
+	}
+	--selection.soa.count;
+}
+
+// Replaces the selection with `count` slots, given in any order. The
+// slots are sorted in place.
+static void setSelection(
+	Selection& selection, u32 count, u32 *slots, MemStack& scratchMem)
+{
+	selection.soa.count = 0;
+	if (!reserveSoaArrays(selection.soa, count))
+	{
+		assert(false);
+		return;
+	}
+
+	auto memMark = mark(scratchMem);
+	u32 *values = allocateAlignedArray<u32>(scratchMem, count, cacheLineSize);
+	for (u32 i = 0; i < count; ++i)
+	{
+		values[i] = slots[i];
+	}
+	radixSort(count, slots, values, scratchMem);
+	release(scratchMem, memMark);
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		selection.slots[i] = slots[i];
+	}
+	selection.soa.count = count;
+}
+
+ShapeHandle addShape(Application& app, Shape shape)
+{
+	Scene& scene = app.scene;
+	if (sceneShapeCount(scene) == maxShapeCount)
+	{
+		assert(false);
+		return nullShapeHandle;
+	}
+
+	u32 slot;
+	bool pushed;
+	bool reusedSlot = scene.firstFreeSlot != noSlot;
+	if (reusedSlot)
+	{
+		slot = scene.firstFreeSlot;
+		scene.firstFreeSlot = scene.refs[slot];
+	} else
+	{
+		if (!pushSoaElement(scene.slotSoa, slot))
+		{
+			assert(false);
+			return nullShapeHandle;
+		}
+		scene.generations[slot] = 1;
+	}
+
+	u32 z = takeFrontZKey(scene);
+	u32 i;
+	switch (shape.type)
+	{
+	case ShapeType::Rectangle:
+	{
+		RectShapes& rects = scene.rects;
+		pushed = pushSoaElement(rects.soa, i);
+		if (!pushed)
+		{
+			break;
+		}
+		RectF32 rect = shape.data.rect;
+		rects.minX[i] = rect.min.x;
+		rects.minY[i] = rect.min.y;
+		rects.width[i] = rect.width;
+		rects.height[i] = rect.height;
+		rects.colors[i] = shape.color;
+		rects.z[i] = z;
+		rects.slots[i] = slot;
+	} break;
+	case ShapeType::Line:
+	{
+		LineShapes& lines = scene.lines;
+		pushed = pushSoaElement(lines.soa, i);
+		if (!pushed)
+		{
+			break;
+		}
+		LineF32 line = shape.data.line;
+		lines.x1[i] = line.p1.x;
+		lines.y1[i] = line.p1.y;
+		lines.x2[i] = line.p2.x;
+		lines.y2[i] = line.p2.y;
+		lines.minX[i] = min(line.p1.x, line.p2.x);
+		lines.minY[i] = min(line.p1.y, line.p2.y);
+		lines.maxX[i] = max(line.p1.x, line.p2.x);
+		lines.maxY[i] = max(line.p1.y, line.p2.y);
+		lines.colors[i] = shape.color;
+		lines.z[i] = z;
+		lines.slots[i] = slot;
+	} break;
+	default:
+		unreachable();
+		pushed = false;
+		break;
+	}
+
+	if (!pushed)
+	{
+		assert(false);
+		// give the slot back
+		if (reusedSlot)
+		{
+			scene.refs[slot] = scene.firstFreeSlot;
+			scene.firstFreeSlot = slot;
+		} else
+		{
+			--scene.slotSoa.count;
+		}
+		return nullShapeHandle;
+	}
+
+	scene.refs[slot] = makeShapeRef(shape.type, i);
+	linkZFront(scene, slot);
+	++scene.shapeCount;
+
+	addGridShape(app.grid, scene, slot);
+	addBvhShape(app.bvh, slot);
+	app.shapeIdsCurrent = false;
+
+	return slotShapeHandle(scene, slot);
+}
+
+// Removes a shape in constant time. The last shape of the same type
+// is moved into the removed shape's place in the type's arrays.
+// Returns false if the handle does not refer to an existing shape.
+bool removeShape(Application& app, ShapeHandle handle)
+{
+	Scene& scene = app.scene;
+	u32 slot;
+	if (!resolveShapeHandle(scene, handle, slot))
+	{
+		return false;
+	}
+
+	removeGridShape(app.grid, scene, slot);
+	removeBvhShape(app.bvh, slot);
+	deselectShape(app.selection, slot);
+	app.shapeIdsCurrent = false;
+
+	ShapeRef ref = scene.refs[slot];
+	ShapeType type = shapeRefType(ref);
+	u32 i = shapeRefIndex(ref);
+	u32 last;
+	switch (type)
+	{
+	case ShapeType::Rectangle:
+	{
+		RectShapes& rects = scene.rects;
+		--rects.soa.count;
+		last = rects.soa.count;
+		if (i != last)
+		{
+			rects.minX[i] = rects.minX[last];
+			rects.minY[i] = rects.minY[last];
+			rects.width[i] = rects.width[last];
+			rects.height[i] = rects.height[last];
+			rects.colors[i] = rects.colors[last];
+			rects.z[i] = rects.z[last];
+			rects.slots[i] = rects.slots[last];
+			scene.refs[rects.slots[i]] = makeShapeRef(type, i);
+		}
+	} break;
+	case ShapeType::Line:
+	{
+		LineShapes& lines = scene.lines;
+		--lines.soa.count;
+		last = lines.soa.count;
+		if (i != last)
+		{
+			lines.x1[i] = lines.x1[last];
+			lines.y1[i] = lines.y1[last];
+			lines.x2[i] = lines.x2[last];
+			lines.y2[i] = lines.y2[last];
+			lines.minX[i] = lines.minX[last];
+			lines.minY[i] = lines.minY[last];
+			lines.maxX[i] = lines.maxX[last];
+			lines.maxY[i] = lines.maxY[last];
+			lines.colors[i] = lines.colors[last];
+			lines.z[i] = lines.z[last];
+			lines.slots[i] = lines.slots[last];
+			scene.refs[lines.slots[i]] = makeShapeRef(type, i);
+		}
+	} break;
+	default:
+		unreachable();
+		break;
+	}
+
+	unlinkZ(scene, slot);
+	--scene.shapeCount;
+
+	// Changing the generation invalidates all handles to the removed
+	// shape. Generation zero is skipped, so handles are never null.
+	u32 generation = scene.generations[slot] + 1;
+	if (generation == 0)
+	{
+		generation = 1;
+	}
+	scene.generations[slot] = generation;
+	scene.refs[slot] = scene.firstFreeSlot;
+	scene.firstFreeSlot = slot;
+
+	return true;
+}
+
+// Moves a shape by an offset in world units, updating the spatial
+// indices in place. Returns false if the handle does not refer to an
+// existing shape. The caller is responsible for redrawing.
+bool moveShape(Application& app, ShapeHandle handle, Vec2 offset)
+{
+	Scene& scene = app.scene;
+	u32 slot;
+	if (!resolveShapeHandle(scene, handle, slot))
+	{
+		return false;
+	}
+
+	removeGridShape(app.grid, scene, slot);
+
+	ShapeRef ref = scene.refs[slot];
+	u32 i = shapeRefIndex(ref);
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+	{
+		RectShapes& rects = scene.rects;
+		rects.minX[i] += offset.x;
+		rects.minY[i] += offset.y;
+	} break;
+	case ShapeType::Line:
+	{
+		LineShapes& lines = scene.lines;
+		lines.x1[i] += offset.x;
+		lines.y1[i] += offset.y;
+		lines.x2[i] += offset.x;
+		lines.y2[i] += offset.y;
+		lines.minX[i] = min(lines.x1[i], lines.x2[i]);
+		lines.minY[i] = min(lines.y1[i], lines.y2[i]);
+		lines.maxX[i] = max(lines.x1[i], lines.x2[i]);
+		lines.maxY[i] = max(lines.y1[i], lines.y2[i]);
+	} break;
+	default:
+		unreachable();
+		break;
+	}
+
+	addGridShape(app.grid, scene, slot);
+	refitBvhShape(app.bvh, scene, slot);
+	app.shapeIdsCurrent = false;
+	return true;
+}
+
+ShapeHandle addRect(Application& app, RectF32 rect, ColorU8 color)
+{
+	Shape shape = {};
+	shape.color = color;
+	shape.type = ShapeType::Rectangle;
+	shape.data.rect = rect;
+	return addShape(app, shape);
+}
+
+ShapeHandle addLine(Application& app, LineF32 line, ColorU8 color)
+{
+	Shape shape = {};
+	shape.color = color;
+	shape.type = ShapeType::Line;
+	shape.data.line = line;
+	return addShape(app, shape);
+}
+
+//TODO this function is for testing convenience - remove it eventually
+static void addShapes(Application& app)
+{
+	ColorU8 red = {};
+	red.r = 255;
+	red.a = 255;
+
+	ColorU8 green = {};
+	green.g = 255;
+	green.a = 255;
+
+	ColorU8 blue = {};
+	blue.b = 255;
+	blue.a = 255;
+
+	ColorU8 white = {};
+	white.r = 255;
+	white.g = 255;
+	white.b = 255;
+	white.a = 255;
+
+	RectF32 rect = {};
+	rect.width = 0.4f;
 	rect.height = 0.4f;
 
-	LineF32 line = {};
+	LineF32 line = {};
+
+	rect.min = {-0.5f, -0.5f};
+	addRect(app, rect, red);
+
+	line.p1 = {0.1f, 0.1f};
+	line.p2 = {0.5f, 0.5f};
+	addLine(app, line, white);
+
+	rect.min = {-0.5f, 0.1f};
+	addRect(app, rect, green);
+
+	line.p1 = {0.1f, 0.5f};
+	line.p2 = {0.5f, 0.1f};
+	addLine(app, line, white);
+
+	rect.min = {0.1f, -0.5f};
+	addRect(app, rect, blue);
+}
+
+bool init(Application& app, FilePath ttfFile)
+{
+	app.state = ApplicationState::DEFAULT;
+	app.drawCanvas = true;
+	app.cpu = detectCpuFeatures();
+	buildGammaTables(gammaTables);
+
+	// Only the pages the scratch stack touches are committed, so
+	// reserving a large range of address space is cheap. If the
+	// range is exhausted, additional blocks are chained on.
+	app.scratchMem = newMemStack((size_t) 1024 * 1024 * 1024, false);
+	if (app.scratchMem.top == nullptr)
+	{
+		assert(false);
+//TODO show error message to user
+		return false;
+	}
+
+	app.permanentMem = {};
+	app.permanentMem.stack = newMemStack((size_t) 16 * 1024 * 1024 * 1024, false);
+	if (app.permanentMem.stack.top == nullptr)
+	{
+		assert(false);
+//TODO show error message to user
+		return false;
+	}
+
+	if (!newScene(app.scene, app.permanentMem)
+		|| !newShapeGrid(app.grid, app.permanentMem)
+		|| !newShapeBvh(app.bvh, app.permanentMem)
+		|| !newSelection(app.selection, app.permanentMem))
+	{
+		assert(false);
+//TODO show error message to user
+		return false;
+	}
+
+	{
+		bool ttfLoadSuccessful = true;
+
+		auto memMark = mark(app.scratchMem);
+
+		ReadFileError readError;
+		u8 *fileContents;
+		size_t fileSize;
+		PLATFORM_readWholeFile(
+			app.scratchMem,
+			ttfFile,
+			readError,
+			fileContents,
+			fileSize);
+		if (fileContents == nullptr)
+		{
+//TODO show error message to user
+			assert(false);
+			goto ttfLoadError;
+		}
+
+		u32 pixelsPerInch = 96;
+		u32 fontPoint = 12;
+		u32 fontPointsPerInch = 72;
+		u32 bitmapHeightPx = roundUpPowerOf2(pixelsPerInch * fontPoint / fontPointsPerInch);
+//TODO use font metrics to compute a tighter bound on the width
+		u32 bitmapWidthPx = bitmapHeightPx;
+		auto bitmapSizePx = bitmapWidthPx * bitmapHeightPx;
+
+		app.font.bitmapWidth = bitmapWidthPx;
+		app.font.bitmapHeight = bitmapHeightPx;
+
+		stbtt_fontinfo font;
+		if (!stbtt_InitFont(&font, fileContents, 0))
+		{
+//TODO show error message to user
+			assert(false);
+			goto ttfLoadError;
+		}
+		font.userdata = &app.scratchMem;
+
+		auto bitmapStorageSize = 256 * bitmapSizePx;
+		app.font.bitmaps = allocatePermanent(
+			app.permanentMem, MemSubsystem::Font, bitmapStorageSize, cacheLineSize);
+		if (app.font.bitmaps == nullptr)
+		{
+			assert(false);
+			goto ttfLoadError;
+		}
+
+		f32 scale = stbtt_ScaleForPixelHeight(&font, (f32) bitmapHeightPx);
+		i32 ascentUnscaled, descentUnscaled, lineGapUnscaled;
+		stbtt_GetFontVMetrics(&font, &ascentUnscaled, &descentUnscaled, &lineGapUnscaled);
+		app.font.advanceY = (u32) round(((f32) ascentUnscaled - descentUnscaled + lineGapUnscaled) * scale);
+
+		u8 *nextBitmap = app.font.bitmaps;
+		u8 c = 0;
+		for (;;)
+		{
+			GlyphMetrics metrics = {};
+
+			// everything STB allocates for this glyph is freed at once
+			auto glyphMemMark = mark(app.scratchMem);
+
+			auto glyphIndex = stbtt_FindGlyphIndex(&font, c);
+
+			stbtt_MakeGlyphBitmap(
+				&font,
+				nextBitmap,
+				bitmapWidthPx, bitmapHeightPx,
+				bitmapWidthPx,
+				scale, scale,
+				glyphIndex);
+
+			i32 advanceXUnscaled, leftOffsetUnscaled;
+			stbtt_GetGlyphHMetrics(&font, glyphIndex, &advanceXUnscaled, &leftOffsetUnscaled);
+
+			metrics.advanceX = (u32) round((f32) advanceXUnscaled * scale);
+			metrics.offsetLeft  = (i32) round((f32) leftOffsetUnscaled * scale);
+
+			stbtt_GetGlyphBitmapBox(
+				&font, glyphIndex,
+				scale, scale,
+				nullptr, &metrics.offsetTop, nullptr, nullptr);
+
+			app.font.glyphMetrics[c] = metrics;
+
+			release(app.scratchMem, glyphMemMark);
+
+			nextBitmap += bitmapSizePx;
+
+			if (c == 255)
+			{
+				break;
+			}
+			++c;
+		}
+
+		goto ttfLoadSuccess;
+
+ttfLoadError:
+		ttfLoadSuccessful = false;
+ttfLoadSuccess:
+		release(app.scratchMem, memMark);
+		if (!ttfLoadSuccessful)
+		{
+			return false;
+		}
+	}
+
+	app.viewportMin = {-1.0, -1.0};
+	app.viewportSize = 2.0;
+
+	app.selectShape = false;
+	app.selectShapesInRect = false;
+	app.removeSelectedShape = false;
+
+	addShapes(app);
+
+	assert(app.scratchMem.top == app.scratchMem.floor);
+
+	return true;
+}
+
+inline static bool rectContains(const RectShapes& rects, u32 i, Vec2 test)
+{
+	f32 minX = rects.minX[i];
+	f32 minY = rects.minY[i];
+	f32 maxX = minX + rects.width[i];
+	f32 maxY = minY + rects.height[i];
+	return test.x >= minX
+		&& test.x <= maxX
+		&& test.y >= minY
+		&& test.y <= maxY;
+}
+
+// Tests whether a line passes within a distance of a point. The
+// distance is compared in pixels, so the squared world distance is
+// scaled by ppuSq, the square of the pixels per unit.
+inline static bool lineNear(
+	const LineShapes& lines, u32 i, Vec2 test, f32 ppuSq, f32 maxDistSqPx)
+{
+	f32 x1 = lines.x1[i];
+	f32 y1 = lines.y1[i];
+	f32 dx = lines.x2[i] - x1;
+	f32 dy = lines.y2[i] - y1;
+	f32 lineLengthSq = dx * dx + dy * dy;
+
+	// `t` represents the parameter in the parametric equation
+	// of the line. If the line is a single point, the dot product
+	// is zero, so dividing by a tiny length instead of zero makes
+	// `t` zero, and the closest point is the line's only point.
+//TODO guarding against exactly zero is not sufficient. Make this test more robust.
+	f32 t = ((test.x - x1) * dx + (test.y - y1) * dy) / max(lineLengthSq, FLT_MIN);
+	// clamp `t` to the endpoints of the line
+	t = clamp(t, 0.0f, 1.0f);
+
+	// evaluate the line equation for the closest `t` to the test point
+	f32 closestX = x1 + t * dx - test.x;
+	f32 closestY = y1 + t * dy - test.y;
+	f32 distSqPx = (closestX * closestX + closestY * closestY) * ppuSq;
+	return distSqPx <= maxDistSqPx;
+}
+
+inline static void pickCandidate(
+	const Scene& scene,
+	u32 slot,
+	Vec2 test,
+	f32 ppuSq,
+	f32 maxDistSqPx,
+	u32& topHitZ,
+	u32& topHitSlot)
+{
+	ShapeRef ref = scene.refs[slot];
+	u32 i = shapeRefIndex(ref);
+	bool hit;
+	u32 z;
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+		hit = rectContains(scene.rects, i, test);
+		z = scene.rects.z[i];
+		break;
+	case ShapeType::Line:
+		hit = lineNear(scene.lines, i, test, ppuSq, maxDistSqPx);
+		z = scene.lines.z[i];
+		break;
+	default:
+		unreachable();
+		return;
+	}
+
+	if (hit && z > topHitZ)
+	{
+		topHitZ = z;
+		topHitSlot = slot;
+	}
+}
+
+// Tests every rectangle from `begin` up to `end` against `test`,
+// keeping the hit with the greatest z-order key in topHitZ and
+// topHitSlot.
+static void pickRectsScalar(
+	const RectShapes& rects, u32 begin, u32 end, Vec2 test, u32& topHitZ, u32& topHitSlot)
+{
+	for (u32 i = begin; i < end; ++i)
+	{
+		bool top = rectContains(rects, i, test) && rects.z[i] > topHitZ;
+		topHitZ = top ? rects.z[i] : topHitZ;
+		topHitSlot = top ? rects.slots[i] : topHitSlot;
+	}
+}
+
+static void pickLinesScalar(
+	const LineShapes& lines,
+	u32 begin,
+	u32 end,
+	Vec2 test,
+	f32 ppuSq,
+	f32 maxDistSqPx,
+	u32& topHitZ,
+	u32& topHitSlot)
+{
+	for (u32 i = begin; i < end; ++i)
+	{
+		bool top = lineNear(lines, i, test, ppuSq, maxDistSqPx) && lines.z[i] > topHitZ;
+		topHitZ = top ? lines.z[i] : topHitZ;
+		topHitSlot = top ? lines.slots[i] : topHitSlot;
+	}
+}
+
+// The vector kernels keep the top hit of each lane: its z-order key and
+// its index in the shape arrays. Keys are unsigned, while AVX2 only
+// compares signed integers, so keys are kept with their sign bits
+// flipped, which orders them the same way as signed integers.
+struct PickLanesAvx2
+{
+	__m256i topZ;
+	__m256i topIndex;
+};
+
+TARGET_AVX2
+inline static PickLanesAvx2 newPickLanesAvx2(u32 topHitZ)
+{
+	PickLanesAvx2 lanes;
+	lanes.topZ = _mm256_set1_epi32((i32) (topHitZ ^ 0x80000000));
+	lanes.topIndex = _mm256_set1_epi32(-1);
+	return lanes;
+}
+
+TARGET_AVX2
+inline static void updatePickLanesAvx2(PickLanesAvx2& lanes, __m256i hit, const u32 *z, u32 i)
+{
+	__m256i zFlipped = _mm256_xor_si256(
+		_mm256_loadu_si256((const __m256i*) (z + i)), _mm256_set1_epi32((i32) 0x80000000));
+	__m256i top = _mm256_and_si256(hit, _mm256_cmpgt_epi32(zFlipped, lanes.topZ));
+	__m256i indices = _mm256_add_epi32(
+		_mm256_set1_epi32((i32) i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	lanes.topZ = _mm256_blendv_epi8(lanes.topZ, zFlipped, top);
+	lanes.topIndex = _mm256_blendv_epi8(lanes.topIndex, indices, top);
+}
+
+// Merges the lanes' hits into the top hit so far.
+TARGET_AVX2
+inline static void reducePickLanesAvx2(
+	const PickLanesAvx2& lanes, const u32 *slots, u32& topHitZ, u32& topHitSlot)
+{
+	alignas(32) u32 laneZ[8];
+	alignas(32) i32 laneIndex[8];
+	_mm256_store_si256((__m256i*) laneZ, lanes.topZ);
+	_mm256_store_si256((__m256i*) laneIndex, lanes.topIndex);
+	for (u32 lane = 0; lane < 8; ++lane)
+	{
+		u32 z = laneZ[lane] ^ 0x80000000;
+		if (laneIndex[lane] >= 0 && z > topHitZ)
+		{
+			topHitZ = z;
+			topHitSlot = slots[laneIndex[lane]];
+		}
+	}
+}
+
+// Tests eight rectangles per iteration, with the same arithmetic as
+// rectContains, so it finds exactly the same hits.
+TARGET_AVX2
+static void pickRectsAvx2(const RectShapes& rects, Vec2 test, u32& topHitZ, u32& topHitSlot)
+{
+	u32 count = rects.soa.count;
+	__m256 testX = _mm256_set1_ps(test.x);
+	__m256 testY = _mm256_set1_ps(test.y);
+	PickLanesAvx2 lanes = newPickLanesAvx2(topHitZ);
+
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 minX = _mm256_loadu_ps(rects.minX + i);
+		__m256 minY = _mm256_loadu_ps(rects.minY + i);
+		__m256 maxX = _mm256_add_ps(minX, _mm256_loadu_ps(rects.width + i));
+		__m256 maxY = _mm256_add_ps(minY, _mm256_loadu_ps(rects.height + i));
+		__m256 inX = _mm256_and_ps(
+			_mm256_cmp_ps(testX, minX, _CMP_GE_OQ), _mm256_cmp_ps(testX, maxX, _CMP_LE_OQ));
+		__m256 inY = _mm256_and_ps(
+			_mm256_cmp_ps(testY, minY, _CMP_GE_OQ), _mm256_cmp_ps(testY, maxY, _CMP_LE_OQ));
+		__m256i hit = _mm256_castps_si256(_mm256_and_ps(inX, inY));
+		updatePickLanesAvx2(lanes, hit, rects.z, i);
+	}
+
+	reducePickLanesAvx2(lanes, rects.slots, topHitZ, topHitSlot);
+	pickRectsScalar(rects, i, count, test, topHitZ, topHitSlot);
+}
+
+// Tests eight lines per iteration, with the same arithmetic as
+// lineNear, so it finds exactly the same hits.
+TARGET_AVX2
+static void pickLinesAvx2(
+	const LineShapes& lines, Vec2 test, f32 ppuSq, f32 maxDistSqPx, u32& topHitZ, u32& topHitSlot)
+{
+	u32 count = lines.soa.count;
+	__m256 testX = _mm256_set1_ps(test.x);
+	__m256 testY = _mm256_set1_ps(test.y);
+	__m256 ppuSqWide = _mm256_set1_ps(ppuSq);
+	__m256 maxDistSqPxWide = _mm256_set1_ps(maxDistSqPx);
+	__m256 minLengthSq = _mm256_set1_ps(FLT_MIN);
+	__m256 zero = _mm256_setzero_ps();
+	__m256 one = _mm256_set1_ps(1.0f);
+	PickLanesAvx2 lanes = newPickLanesAvx2(topHitZ);
+
+	u32 i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 x1 = _mm256_loadu_ps(lines.x1 + i);
+		__m256 y1 = _mm256_loadu_ps(lines.y1 + i);
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(lines.x2 + i), x1);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(lines.y2 + i), y1);
+		__m256 lineLengthSq = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+
+		// max and min match the scalar max and min, including for NaN
+		__m256 dot = _mm256_add_ps(
+			_mm256_mul_ps(_mm256_sub_ps(testX, x1), dx),
+			_mm256_mul_ps(_mm256_sub_ps(testY, y1), dy));
+		__m256 t = _mm256_div_ps(dot, _mm256_max_ps(lineLengthSq, minLengthSq));
+		t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+
+		__m256 closestX = _mm256_sub_ps(_mm256_add_ps(x1, _mm256_mul_ps(t, dx)), testX);
+		__m256 closestY = _mm256_sub_ps(_mm256_add_ps(y1, _mm256_mul_ps(t, dy)), testY);
+		__m256 distSqPx = _mm256_mul_ps(
+			_mm256_add_ps(_mm256_mul_ps(closestX, closestX), _mm256_mul_ps(closestY, closestY)),
+			ppuSqWide);
+		__m256i hit = _mm256_castps_si256(_mm256_cmp_ps(distSqPx, maxDistSqPxWide, _CMP_LE_OQ));
+		updatePickLanesAvx2(lanes, hit, lines.z, i);
+	}
+
+	reducePickLanesAvx2(lanes, lines.slots, topHitZ, topHitSlot);
+	pickLinesScalar(lines, i, count, test, ppuSq, maxDistSqPx, topHitZ, topHitSlot);
+}
+
+// Hit tests every shape in the scene, with the widest kernels the CPU
+// has. This is how shapes are picked when no spatial index can narrow
+// them down.
+static void pickAllShapes(
+	const CpuFeatures& cpu,
+	const Scene& scene,
+	Vec2 test,
+	f32 ppuSq,
+	f32 maxDistSqPx,
+	u32& topHitSlot)
+{
+	u32 topHitZ = 0;
+	topHitSlot = noSlot;
+	if (cpu.avx2)
+	{
+		pickRectsAvx2(scene.rects, test, topHitZ, topHitSlot);
+		pickLinesAvx2(scene.lines, test, ppuSq, maxDistSqPx, topHitZ, topHitSlot);
+	} else
+	{
+		pickRectsScalar(scene.rects, 0, scene.rects.soa.count, test, topHitZ, topHitSlot);
+		pickLinesScalar(
+			scene.lines, 0, scene.lines.soa.count, test, ppuSq, maxDistSqPx, topHitZ, topHitSlot);
+	}
+}
+
+// Finds the topmost shape hit at `test`, testing only the shapes in
+// the grid cells within `maxDist` world units of it. Returns false
+// without picking if that covers too many cells or candidates, in
+// which case another way of picking is needed.
+static bool pickShapeGrid(
+	const Scene& scene,
+	const ShapeGrid& grid,
+	Vec2 test,
+	f32 maxDist,
+	f32 ppuSq,
+	f32 maxDistSqPx,
+	u32& topHitSlot)
+{
+	PixelRect cells = gridCells(
+		test.x - maxDist, test.y - maxDist, test.x + maxDist, test.y + maxDist);
+	if (gridCellCount(cells) > maxGridQueryCells)
+	{
+		return false;
+	}
+
+	// A shape can be found more than once, through several of its
+	// cells. Testing it again does no harm.
+	u32 topHitZ = 0;
+	u32 candidateCount = grid.largeSoa.count;
+	topHitSlot = noSlot;
+	for (i32 cy = cells.yMin; cy <= cells.yMax; ++cy)
+	{
+		for (i32 cx = cells.xMin; cx <= cells.xMax; ++cx)
+		{
+			u32 link = grid.bucketHeads[gridBucket(cx, cy)];
+			while (link != 0)
+			{
+				if (++candidateCount > maxGridQueryCandidates)
+				{
+					topHitSlot = noSlot;
+					return false;
+				}
+				pickCandidate(
+					scene, grid.entrySlots[link - 1], test, ppuSq, maxDistSqPx, topHitZ, topHitSlot);
+				link = grid.entryNext[link - 1];
+			}
+		}
+	}
+
+	for (u32 l = 0; l < grid.largeSoa.count; ++l)
+	{
+		pickCandidate(scene, grid.largeSlots[l], test, ppuSq, maxDistSqPx, topHitZ, topHitSlot);
+	}
+	return true;
+}
+
+// Finds the topmost shape hit at `test`, testing the shapes the BVH
+// finds within `maxDist` world units of it. Returns false without
+// picking if the tree hasn't been built yet.
+static bool pickShapeBvh(
+	const CpuFeatures& cpu,
+	const Scene& scene,
+	ShapeBvh& bvh,
+	Vec2 test,
+	f32 maxDist,
+	f32 ppuSq,
+	f32 maxDistSqPx,
+	u32& topHitSlot)
+{
+	topHitSlot = noSlot;
+	if (bvh.levelCount == 0)
+	{
+		return false;
+	}
+
+	u32 candidateCount = queryShapeBvh(
+		bvh, test.x - maxDist, test.y - maxDist, test.x + maxDist, test.y + maxDist);
+
+	// When zoomed far out, most shapes are candidates. Streaming through
+	// the shape arrays is then faster than visiting candidates one by one.
+	if (candidateCount > sceneShapeCount(scene) / 4)
+	{
+		pickAllShapes(cpu, scene, test, ppuSq, maxDistSqPx, topHitSlot);
+		return true;
+	}
+
+	u32 topHitZ = 0;
+	for (u32 c = 0; c < candidateCount; ++c)
+	{
+		pickCandidate(scene, bvh.resultSlots[c], test, ppuSq, maxDistSqPx, topHitZ, topHitSlot);
+	}
+	return true;
+}
+
+// Finds the topmost shape drawn near the cursor in the shape ID plane,
+// without testing any geometry. Rectangles are picked by the pixel
+// under the cursor. Lines are thin, so they are also picked by the
+// pixels within maxDistPx of it. Returns false without picking if
+// the plane doesn't match the canvas, or the cursor is off it.
+static bool pickShapeIds(const Application& app, f32 maxDistPx, u32& topHitSlot)
+{
+	topHitSlot = noSlot;
+	u32 width = app.shapeIdsWidth;
+	u32 height = app.shapeIdsHeight;
+	if (!app.shapeIdsCurrent
+		|| width != app.canvas.width
+		|| height != app.canvas.height
+		|| (u32) app.mouseX >= width
+		|| (u32) app.mouseY >= height)
+	{
+		return false;
+	}
+
+	const Scene& scene = app.scene;
+	i32 radius = (i32) maxDistPx;
+	u32 topHitZ = 0;
+	for (i32 dy = -radius; dy <= radius; ++dy)
+	{
+		i32 y = app.mouseY + dy;
+		if ((u32) y >= height)
+		{
+			continue;
+		}
+		for (i32 dx = -radius; dx <= radius; ++dx)
+		{
+			i32 x = app.mouseX + dx;
+			if ((u32) x >= width || dx * dx + dy * dy > radius * radius)
+			{
+				continue;
+			}
+
+			u32 id = app.shapeIds[(size_t) y * width + x];
+			if (id == 0)
+			{
+				continue;
+			}
+
+			// A shape removed without damaging its pixels leaves its
+			// ID behind, and its slot may be free. Free slots don't
+			// hold a shape reference, so the ID is checked against the
+			// shape arrays before use.
+			u32 slot = id - 1;
+			ShapeRef ref = scene.refs[slot];
+			u32 i = shapeRefIndex(ref);
+			bool underCursor = dx == 0 && dy == 0;
+			u32 z;
+			if (shapeRefType(ref) == ShapeType::Rectangle
+				&& i < scene.rects.soa.count && scene.rects.slots[i] == slot)
+			{
+				if (!underCursor)
+				{
+					continue;
+				}
+				z = scene.rects.z[i];
+			} else if (shapeRefType(ref) == ShapeType::Line
+				&& i < scene.lines.soa.count && scene.lines.slots[i] == slot)
+			{
+				z = scene.lines.z[i];
+			} else
+			{
+				continue;
+			}
+
+			if (z > topHitZ)
+			{
+				topHitZ = z;
+				topHitSlot = slot;
+			}
+		}
+	}
+	return true;
+}
+
+inline static void selectShape(Application& app)
+{
+	f32 unitsPerPixel = app.viewportSize / (f32) app.canvas.height;
+	f32 pixelsPerUnit = 1.0f / unitsPerPixel;
+	// transform the mouse position to global coordinates
+
+	Vec2 mousePx = {(f32) app.mouseX, (f32) app.mouseY};
+	Vec2 test = unitsPerPixel * mousePx + app.viewportMin;
+
+	const Scene& scene = app.scene;
+
+	// Clicking exactly on a 1 pixel-wide line is tricky. Allow
+	// 2 pixels of slop on each side to make the task easier.
+	f32 maxDistPx = 5.0f;
+
+	// Shapes are drawn such that the last one in the z-order is on
+	// top. If shapes are overlapping, the hit with the greatest z-order
+	// key is the visible one. Keys start at one, so a key of zero means
+	// no shape was hit.
+	u32 topHitSlot = noSlot;
+
+	// distPx = dist * ppu = sqrt(distSq) * ppu
+	// distPx^2 = (sqrt(distSq) * ppu)^2 = distSq * ppu^2
+	f32 ppuSq = pixelsPerUnit * pixelsPerUnit;
+	f32 maxDistSqPx = maxDistPx * maxDistPx;
+
+	// Lines within the slop of the cursor have a point within the slop
+	// in world units, which lies in one of the cells searched. The
+	// extra pixel covers rounding in the distance test.
+	f32 maxDist = (maxDistPx + 1.0f) * unitsPerPixel;
+	// The shape ID plane answers with a few lookups, when it matches
+	// what is on screen. Otherwise, the grid answers small queries over
+	// sparse regions fastest. The BVH handles dense clusters and zoomed
+	// out views, where the grid gives up.
+	bool picked = pickShapeIds(app, maxDistPx, topHitSlot)
+		|| pickShapeGrid(scene, app.grid, test, maxDist, ppuSq, maxDistSqPx, topHitSlot)
+		|| pickShapeBvh(app.cpu, scene, app.bvh, test, maxDist, ppuSq, maxDistSqPx, topHitSlot);
+	if (!picked)
+	{
+		pickAllShapes(app.cpu, scene, test, ppuSq, maxDistSqPx, topHitSlot);
+	}
+
+	setSelection(app.selection, topHitSlot == noSlot ? 0 : 1, &topHitSlot, app.scratchMem);
+}
+
+// Selects the shapes in a world-space rectangle. When `touching` is
+// set, every shape with a point in the rectangle is selected.
+// Otherwise, only shapes lying entirely inside it are.
+static void selectShapesInRect(Application& app, Vec2 min, Vec2 max, bool touching)
+{
+	const Scene& scene = app.scene;
+	u32 candidateCount = queryShapeBvh(app.bvh, min.x, min.y, max.x, max.y);
+
+	auto memMark = mark(app.scratchMem);
+	u32 *selected = allocateAlignedArray<u32>(app.scratchMem, candidateCount, cacheLineSize);
+	u32 selectedCount = 0;
+	for (u32 c = 0; c < candidateCount; ++c)
+	{
+		u32 slot = app.bvh.resultSlots[c];
+		ShapeRef ref = scene.refs[slot];
+		u32 i = shapeRefIndex(ref);
+		bool inside;
+		switch (shapeRefType(ref))
+		{
+		case ShapeType::Rectangle:
+		{
+			const RectShapes& rects = scene.rects;
+			f32 rectMaxX = rects.minX[i] + rects.width[i];
+			f32 rectMaxY = rects.minY[i] + rects.height[i];
+			if (touching)
+			{
+				inside = rects.minX[i] <= max.x && rectMaxX >= min.x
+					&& rects.minY[i] <= max.y && rectMaxY >= min.y;
+			} else
+			{
+				inside = rects.minX[i] >= min.x && rectMaxX <= max.x
+					&& rects.minY[i] >= min.y && rectMaxY <= max.y;
+			}
+		} break;
+		case ShapeType::Line:
+		{
+			const LineShapes& lines = scene.lines;
+			if (touching)
+			{
+				LineF32 line = {{lines.x1[i], lines.y1[i]}, {lines.x2[i], lines.y2[i]}};
+				inside = clipLineCohenSutherland(min, max, line);
+			} else
+			{
+				inside = lines.minX[i] >= min.x && lines.maxX[i] <= max.x
+					&& lines.minY[i] >= min.y && lines.maxY[i] <= max.y;
+			}
+		} break;
+		default:
+			unreachable();
+			inside = false;
+			break;
+		}
+
+		selected[selectedCount] = slot;
+		selectedCount += inside;
+	}
+
+	setSelection(app.selection, selectedCount, selected, app.scratchMem);
+	release(app.scratchMem, memMark);
+}
+
+const f32 selectionMarkerHalfSizePx = 5.0f;
+
+// Each arrow key press moves the selected shapes this many pixels.
+const f32 selectionNudgePx = 4.0f;
+
+// Above this many markers, drawing them row by row beats filling
+// each one separately.
+const u32 maxSeparateMarkerCount = 64;
+
+// draws rectangles centered at the given points
+static void drawSelectedShapeMarkers(
+	const CpuFeatures& cpu, Bitmap canvas, u32 markerCount, const Vec2 *pointsPx, MemStack& scratchMem)
+{
+	ColorU8 yellow = {};
+	yellow.r = 255;
+	yellow.g = 255;
+	yellow.b = 0;
+	yellow.a = 255;
+
+	f32 halfSizePx = selectionMarkerHalfSizePx;
+	f32 sizePx = 2.0f * halfSizePx;
+
+	RectF32 rect = {};
+	rect.width = sizePx;
+	rect.height = sizePx;
+
+	if (markerCount <= maxSeparateMarkerCount)
+	{
+		for (u32 i = 0; i < markerCount; ++i)
+		{
+			rect.min = pointsPx[i] - Vec2{halfSizePx, halfSizePx};
+			fillRect(cpu, canvas, rect, yellow);
+		}
+		return;
+	}
+
+	// A large selection has markers on most rows, many of them
+	// overlapping. The markers are rounded to whole pixels the way
+	// fillRect does it, then swept top to bottom: each marker adds one
+	// to the columns it covers on the rows it covers, and every row is
+	// written as the spans where the count is non-zero. Markers go on
+	// the overlay, which has no shape IDs.
+	assert(canvas.shapeIds == nullptr);
+	PixelRect drawable = drawableRect(canvas);
+	if (isEmpty(drawable))
+	{
+		return;
+	}
+
+	auto memMark = mark(scratchMem);
+	PixelRect *markerRects = allocateAlignedArray<PixelRect>(scratchMem, markerCount, cacheLineSize);
+	PixelRect bounds = {drawable.xMax, drawable.yMax, drawable.xMin, drawable.yMin};
+	u32 drawnCount = 0;
+	for (u32 i = 0; i < markerCount; ++i)
+	{
+		rect.min = pointsPx[i] - Vec2{halfSizePx, halfSizePx};
+		PixelRect markerRect;
+		markerRect.xMin = (i32) clamp(rect.min.x, 0.0f, (f32) canvas.width);
+		markerRect.xMax = (i32) clamp(rect.min.x + rect.width, 0.0f, (f32) canvas.width);
+		markerRect.yMin = (i32) clamp(rect.min.y, 0.0f, (f32) canvas.height);
+		markerRect.yMax = (i32) clamp(rect.min.y + rect.height, 0.0f, (f32) canvas.height);
+		markerRect = intersect(markerRect, drawable);
+		if (isEmpty(markerRect))
+		{
+			continue;
+		}
+		markerRects[drawnCount] = markerRect;
+		++drawnCount;
+		bounds = enclose(bounds, markerRect);
+	}
+	if (drawnCount == 0)
+	{
+		release(scratchMem, memMark);
+		return;
+	}
+
+	// Bucket the markers by their first and last rows, counted from
+	// bounds.yMin. After the scatter below, bucket y of startOrder runs
+	// from rowStarts[y] to rowStarts[y + 1], and likewise for endOrder.
+	u32 rowCount = (u32) (bounds.yMax - bounds.yMin);
+	u32 *rowStarts = allocateAlignedArray<u32>(scratchMem, rowCount + 2, cacheLineSize);
+	u32 *rowEnds = allocateAlignedArray<u32>(scratchMem, rowCount + 2, cacheLineSize);
+	u32 *startOrder = allocateAlignedArray<u32>(scratchMem, drawnCount, cacheLineSize);
+	u32 *endOrder = allocateAlignedArray<u32>(scratchMem, drawnCount, cacheLineSize);
+	for (u32 y = 0; y < rowCount + 2; ++y)
+	{
+		rowStarts[y] = 0;
+		rowEnds[y] = 0;
+	}
+	for (u32 i = 0; i < drawnCount; ++i)
+	{
+		++rowStarts[markerRects[i].yMin - bounds.yMin + 2];
+		++rowEnds[markerRects[i].yMax - bounds.yMin + 1];
+	}
+	for (u32 y = 2; y < rowCount + 2; ++y)
+	{
+		rowStarts[y] += rowStarts[y - 1];
+		rowEnds[y] += rowEnds[y - 1];
+	}
+	for (u32 i = 0; i < drawnCount; ++i)
+	{
+		startOrder[rowStarts[markerRects[i].yMin - bounds.yMin + 1]++] = i;
+		endOrder[rowEnds[markerRects[i].yMax - bounds.yMin]++] = i;
+	}
+
+	// columnDeltas[x] is the change in coverage from column
+	// bounds.xMin + x - 1 to column bounds.xMin + x, on the current row.
+	u32 columnCount = (u32) (bounds.xMax - bounds.xMin);
+	i32 *columnDeltas = allocateAlignedArray<i32>(scratchMem, columnCount + 1, cacheLineSize);
+	for (u32 x = 0; x <= columnCount; ++x)
+	{
+		columnDeltas[x] = 0;
+	}
+
+	u32 bpp = bytesPerPixel(canvas.format);
+	u64 linear = linearPixel(yellow);
+	u32 packed = packPixel(yellow);
+	u32 activeCount = 0;
+	for (u32 y = 0; y < rowCount; ++y)
+	{
+		// retire the markers whose last row was y - 1, then add the
+		// ones starting on row y
+		for (u32 j = y == 0 ? 0 : rowEnds[y - 1]; j < rowEnds[y]; ++j)
+		{
+			PixelRect markerRect = markerRects[endOrder[j]];
+			--columnDeltas[markerRect.xMin - bounds.xMin];
+			++columnDeltas[markerRect.xMax - bounds.xMin];
+			--activeCount;
+		}
+		for (u32 j = rowStarts[y]; j < rowStarts[y + 1]; ++j)
+		{
+			PixelRect markerRect = markerRects[startOrder[j]];
+			++columnDeltas[markerRect.xMin - bounds.xMin];
+			--columnDeltas[markerRect.xMax - bounds.xMin];
+			++activeCount;
+		}
+		if (activeCount == 0)
+		{
+			continue;
+		}
+
+		auto *pRow = canvas.pixels + (bounds.yMin + (i32) y) * canvas.pitch;
+		i32 coverage = 0;
+		u32 spanStart = 0;
+		for (u32 x = 0; x <= columnCount; ++x)
+		{
+			i32 previous = coverage;
+			coverage += columnDeltas[x];
+			if (previous == 0 && coverage > 0)
+			{
+				spanStart = x;
+			} else if (previous > 0 && coverage == 0)
+			{
+				auto *pPixels = pRow + (bounds.xMin + spanStart) * bpp;
+				if (canvas.format == PixelFormat::LinearBgra16)
+				{
+					fillLinearPixels(cpu, (u64*) pPixels, x - spanStart, linear);
+				} else
+				{
+					fillPixels(cpu, (u32*) pPixels, x - spanStart, packed, false);
+				}
+			}
+		}
+	}
+
+	release(scratchMem, memMark);
+}
+
+// Finds the pixel space points where the selected shapes' markers
+// are drawn: the corners of rectangles and the ends of lines. Returns
+// how many there are, with the points in `markers`, allocated from
+// scratch memory.
+static u32 selectionMarkers(
+	const Application& app, Vec2 viewportMin, f32 pixelsPerUnit, MemStack& scratchMem, Vec2*& markers)
+{
+	const Scene& scene = app.scene;
+	const Selection& selection = app.selection;
+	markers = allocateAlignedArray<Vec2>(scratchMem, 4 * selection.soa.count, cacheLineSize);
+
+	u32 markerCount = 0;
+	for (u32 i = 0; i < selection.soa.count; ++i)
+	{
+		Shape shape = getShape(scene, scene.refs[selection.slots[i]]);
+		switch (shape.type)
+		{
+		case ShapeType::Rectangle:
+		{
+			RectF32 rect = globalToPixelSpace(
+				viewportMin, pixelsPerUnit, shape.data.rect);
+			Vec2 min = rect.min;
+			Vec2 max = min + Vec2{rect.width, rect.height};
+			markers[markerCount] = {min.x, min.y};
+			markers[markerCount + 1] = {min.x, max.y};
+			markers[markerCount + 2] = {max.x, min.y};
+			markers[markerCount + 3] = {max.x, max.y};
+			markerCount += 4;
+			break;
+		}
+		case ShapeType::Line:
+		{
+			LineF32 line = globalToPixelSpace(
+				viewportMin, pixelsPerUnit, shape.data.line);
+			markers[markerCount] = line.p1;
+			markers[markerCount + 1] = line.p2;
+			markerCount += 2;
+			break;
+		}
+		default:
+			unreachable();
+		}
+	}
+	return markerCount;
+}
+
+// Returns the whole pixels covering [minPx, maxPx] on both axes.
+// fillRect and drawLine truncate coordinates that are on the canvas,
+// so they never draw outside these bounds.
+static PixelRect pixelBounds(Vec2 minPx, Vec2 maxPx)
+{
+	// keep the casts to i32 in range
+	f32 limit = 1.0e9f;
+
+	PixelRect bounds;
+	bounds.xMin = (i32) std::floor(clamp(minPx.x, -limit, limit));
+	bounds.yMin = (i32) std::floor(clamp(minPx.y, -limit, limit));
+	bounds.xMax = (i32) std::floor(clamp(maxPx.x, -limit, limit)) + 1;
+	bounds.yMax = (i32) std::floor(clamp(maxPx.y, -limit, limit)) + 1;
+	return bounds;
+}
 
-	rect.min = {-0.5f, -0.5f};
-	addRect(app, rect, red);
+// Anti-aliased lines also cover the pixels on either side of them,
+// so line bounds are padded by a pixel.
+const Vec2 linePaddingPx = {1.0f, 1.0f};
 
-	line.p1 = {0.1f, 0.1f};
-	line.p2 = {0.5f, 0.5f};
-	addLine(app, line, white);
+static PixelRect shapePixelBounds(Shape shape, Vec2 viewportMin, f32 pixelsPerUnit)
+{
+	switch (shape.type)
+	{
+	case ShapeType::Rectangle:
+	{
+		RectF32 rect = globalToPixelSpace(viewportMin, pixelsPerUnit, shape.data.rect);
+		return pixelBounds(rect.min, rect.min + Vec2{rect.width, rect.height});
+	}
+	case ShapeType::Line:
+	{
+		LineF32 line = globalToPixelSpace(viewportMin, pixelsPerUnit, shape.data.line);
+		Vec2 minPx = {min(line.p1.x, line.p2.x), min(line.p1.y, line.p2.y)};
+		Vec2 maxPx = {max(line.p1.x, line.p2.x), max(line.p1.y, line.p2.y)};
+		return pixelBounds(minPx - linePaddingPx, maxPx + linePaddingPx);
+	}
+	default:
+		unreachable();
+		return PixelRect{};
+	}
+}
 
-	rect.min = {-0.5f, 0.1f};
-	addRect(app, rect, green);
+// Tolerance for merging damage rectangles. Nearby rectangles are
+// merged when the rectangle enclosing both adds at most this many
+// pixels that neither of them covers.
+const i64 damageMergeSlackPx = 64 * 64;
+
+// Adds a region of the canvas that needs redrawing. Overlapping
+// rectangles are always merged, so the damage rectangles never share
+// a pixel, and nearby ones are merged to keep the list short. When
+// the list is full, the new rectangle is merged into whichever
+// existing one grows the least.
+static void addDamage(Damage& damage, Bitmap canvas, PixelRect rect)
+{
+	// Off-canvas parts need no redrawing, and would make empty clip
+	// rectangles for the shapes drawn into them.
+	rect = intersect(rect, drawableRect(canvas));
+	if (isEmpty(rect))
+	{
+		return;
+	}
 
-	line.p1 = {0.1f, 0.5f};
-	line.p2 = {0.5f, 0.1f};
-	addLine(app, line, white);
+	// A merged rectangle can overlap rectangles that the original
+	// did not, so keep merging until nothing else qualifies.
+	u32 i = 0;
+	while (i < damage.rectCount)
+	{
+		PixelRect merged = enclose(damage.rects[i], rect);
+		bool overlapping = !isEmpty(intersect(damage.rects[i], rect));
+		if (overlapping
+			|| area(merged) <= area(damage.rects[i]) + area(rect) + damageMergeSlackPx)
+		{
+			rect = merged;
+			--damage.rectCount;
+			damage.rects[i] = damage.rects[damage.rectCount];
+			i = 0;
+		} else
+		{
+			++i;
+		}
+	}
 
-	rect.min = {0.1f, -0.5f};
-	addRect(app, rect, blue);
+	if (damage.rectCount == maxDamageRectCount)
+	{
+		u32 best = 0;
+		i64 bestGrowth = INT64_MAX;
+		for (u32 j = 0; j < damage.rectCount; ++j)
+		{
+			i64 growth = area(enclose(damage.rects[j], rect)) - area(damage.rects[j]);
+			if (growth < bestGrowth)
+			{
+				best = j;
+				bestGrowth = growth;
+			}
+		}
+		rect = enclose(damage.rects[best], rect);
+		--damage.rectCount;
+		damage.rects[best] = damage.rects[damage.rectCount];
+		addDamage(damage, canvas, rect);
+		return;
+	}
+
+	damage.rects[damage.rectCount] = rect;
+	++damage.rectCount;
 }
 
-bool init(Application& app, FilePath ttfFile)
+// Finds the 1 pixel-wide edges of the selection rectangle, whose
+// corners are the pixels at the start and end of the drag.
+static void selectionRectEdges(const Application& app, PixelRect edges[4])
 {
-	app.state = ApplicationState::DEFAULT;
-	app.drawCanvas = true;
+	i32 xMin = app.selectStartX < app.selectEndX ? app.selectStartX : app.selectEndX;
+	i32 yMin = app.selectStartY < app.selectEndY ? app.selectStartY : app.selectEndY;
+	i32 xMax = (app.selectStartX < app.selectEndX ? app.selectEndX : app.selectStartX) + 1;
+	i32 yMax = (app.selectStartY < app.selectEndY ? app.selectEndY : app.selectStartY) + 1;
+	edges[0] = {xMin, yMin, xMax, yMin + 1};
+	edges[1] = {xMin, yMax - 1, xMax, yMax};
+	edges[2] = {xMin, yMin, xMin + 1, yMax};
+	edges[3] = {xMax - 1, yMin, xMax, yMax};
+}
 
-//TODO tune this allocation size
-	app.scratchMem = newMemStack(64 * 1024 * 1024);
-	if (app.scratchMem.top == nullptr)
+static void damageSelectionRect(Application& app)
+{
+	PixelRect edges[4];
+	selectionRectEdges(app, edges);
+	for (u32 i = 0; i < 4; ++i)
 	{
-		assert(false);
-//TODO show error message to user
-		return false;
+		addDamage(app.damage, app.canvas, edges[i]);
 	}
+}
 
+static void damageSelectionMarkers(Application& app, f32 pixelsPerUnit)
+{
+	if (app.drawCanvas)
 	{
-		bool ttfLoadSuccessful = true;
+		return;
+	}
 
-		auto memMark = mark(app.scratchMem);
+	// Markers spread over more damage rectangles than there are get
+	// merged into large ones anyway, so a big selection redraws the
+	// whole canvas.
+	auto memMark = mark(app.scratchMem);
+	Vec2 *markers;
+	u32 markerCount = selectionMarkers(app, app.viewportMin, pixelsPerUnit, app.scratchMem, markers);
+	if (markerCount > 4 * maxDamageRectCount)
+	{
+		app.drawCanvas = true;
+	} else
+	{
+		Vec2 halfSize = {selectionMarkerHalfSizePx, selectionMarkerHalfSizePx};
+		for (u32 i = 0; i < markerCount; ++i)
+		{
+			addDamage(app.damage, app.canvas, pixelBounds(markers[i] - halfSize, markers[i] + halfSize));
+		}
+	}
+	release(app.scratchMem, memMark);
+}
 
-		ReadFileError readError;
-		u8 *fileContents;
-		size_t fileSize;
-		PLATFORM_readWholeFile(
-			app.scratchMem,
-			ttfFile,
-			readError,
-			fileContents,
-			fileSize);
-		if (fileContents == nullptr)
+// lines of the overlay's text, counting down from the top
+const u32 overlayMemoryLine = 0;
+const u32 overlayStateLine = 10;
+
+static void damageOverlayLine(Application& app, u32 line)
+{
+	// Glyphs reach at most a glyph bitmap's height from the baseline.
+	i32 baseline = (i32) app.canvas.height - (i32) ((line + 1) * app.font.advanceY);
+	i32 reach = (i32) app.font.bitmapHeight;
+	PixelRect rect = {0, baseline - reach, (i32) app.canvas.width, baseline + reach + 1};
+	addDamage(app.damage, app.canvas, rect);
+}
+
+static_assert(maxDamageRectCount <= 16, "damage masks are 16 bits");
+
+// Returns a mask with bit i set if the pixels covering [minPx, maxPx]
+// overlap damage rect i.
+inline u16 damageMask(const Damage& damage, PixelRect damageBounds, Vec2 minPx, Vec2 maxPx)
+{
+	// Most shapes miss the damage entirely. Rejecting them before
+	// rounding to whole pixels keeps the common case cheap.
+	if (maxPx.x < (f32) damageBounds.xMin || minPx.x >= (f32) damageBounds.xMax
+		|| maxPx.y < (f32) damageBounds.yMin || minPx.y >= (f32) damageBounds.yMax)
+	{
+		return 0;
+	}
+
+	PixelRect bounds = pixelBounds(minPx, maxPx);
+	u16 mask = 0;
+	for (u32 i = 0; i < damage.rectCount; ++i)
+	{
+		if (!isEmpty(intersect(bounds, damage.rects[i])))
 		{
-//TODO show error message to user
-			assert(false);
-			goto ttfLoadError;
+			mask |= (u16) (1 << i);
 		}
+	}
+	return mask;
+}
 
-		u32 pixelsPerInch = 96;
-		u32 fontPoint = 12;
-		u32 fontPointsPerInch = 72;
-		u32 bitmapHeightPx = roundUpPowerOf2(pixelsPerInch * fontPoint / fontPointsPerInch);
-//TODO use font metrics to compute a tighter bound on the width
-		u32 bitmapWidthPx = bitmapHeightPx;
-		auto bitmapSizePx = bitmapWidthPx * bitmapHeightPx;
+// Finds the shapes near a damage rectangle with the BVH, listing their
+// slots in bvh.resultSlots. The query is widened by a couple of pixels
+// and by the rounding of its coordinates, so it finds every shape that
+// can draw into the rectangle. Returns the number of shapes found.
+static u32 queryDamagedShapes(ShapeBvh& bvh, PixelRect rect, Vec2 viewportMin, f32 pixelsPerUnit)
+{
+	f32 unitsPerPixel = 1.0f / pixelsPerUnit;
+	Vec2 min = unitsPerPixel * Vec2{(f32) rect.xMin, (f32) rect.yMin} + viewportMin;
+	Vec2 max = unitsPerPixel * Vec2{(f32) rect.xMax, (f32) rect.yMax} + viewportMin;
+	f32 padX = 2.0f * unitsPerPixel + (std::abs(min.x) + std::abs(max.x)) * bvhBoundsPad;
+	f32 padY = 2.0f * unitsPerPixel + (std::abs(min.y) + std::abs(max.y)) * bvhBoundsPad;
+	return queryShapeBvh(bvh, min.x - padX, min.y - padY, max.x + padX, max.y + padY);
+}
 
-		app.font.bitmapWidth = bitmapWidthPx;
-		app.font.bitmapHeight = bitmapHeightPx;
+// Redraws the shapes that overlap the damage rectangles, in painter's
+// order. Only the shapes the BVH finds near a damage rectangle are
+// tested against the damage. A shape near several rectangles is found
+// once for each, so the shapes are sorted by their z-order keys, and
+// repeats are skipped.
+static void drawDamagedShapes(
+	const CpuFeatures& cpu,
+	Bitmap canvas,
+	const Scene& scene,
+	ShapeBvh& bvh,
+	const Damage& damage,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	MemStack& scratchMem)
+{
+	PixelRect damageBounds = damage.rects[0];
+	for (u32 i = 1; i < damage.rectCount; ++i)
+	{
+		damageBounds = enclose(damageBounds, damage.rects[i]);
+	}
 
-		stbtt_fontinfo font;
-		if (!stbtt_InitFont(&font, fileContents, 0))
+	// The results of each query overwrite the last, so the rectangles
+	// are queried once to size the list, and again to fill it.
+	u32 candidateCount = 0;
+	for (u32 r = 0; r < damage.rectCount; ++r)
+	{
+		candidateCount += queryDamagedShapes(bvh, damage.rects[r], viewportMin, pixelsPerUnit);
+	}
+	u32 *zKeys = allocateAlignedArray<u32>(scratchMem, candidateCount, cacheLineSize);
+	ShapeRef *refs = allocateAlignedArray<ShapeRef>(scratchMem, candidateCount, cacheLineSize);
+	u32 filledCount = 0;
+	for (u32 r = 0; r < damage.rectCount; ++r)
+	{
+		u32 foundCount = queryDamagedShapes(bvh, damage.rects[r], viewportMin, pixelsPerUnit);
+		for (u32 f = 0; f < foundCount; ++f)
 		{
-//TODO show error message to user
-			assert(false);
-			goto ttfLoadError;
+			ShapeRef ref = scene.refs[bvh.resultSlots[f]];
+			u32 i = shapeRefIndex(ref);
+			zKeys[filledCount] = shapeRefType(ref) == ShapeType::Rectangle ? scene.rects.z[i] : scene.lines.z[i];
+			refs[filledCount] = ref;
+			++filledCount;
+		}
+	}
+	assert(filledCount == candidateCount);
+	radixSort(candidateCount, zKeys, refs, scratchMem);
+
+	// Find the damage rectangles each shape overlaps.
+	const RectShapes& rects = scene.rects;
+	const LineShapes& lines = scene.lines;
+	u32 *masks = allocateAlignedArray<u32>(scratchMem, candidateCount, cacheLineSize);
+	for (u32 c = 0; c < candidateCount; ++c)
+	{
+		masks[c] = 0;
+		if (c > 0 && zKeys[c] == zKeys[c - 1])
+		{
+			continue;
+		}
+
+		ShapeRef ref = refs[c];
+		u32 i = shapeRefIndex(ref);
+		Vec2 minPx, maxPx;
+		if (shapeRefType(ref) == ShapeType::Rectangle)
+		{
+			minPx = {
+				(rects.minX[i] - viewportMin.x) * pixelsPerUnit,
+				(rects.minY[i] - viewportMin.y) * pixelsPerUnit};
+			maxPx = minPx + Vec2{rects.width[i] * pixelsPerUnit, rects.height[i] * pixelsPerUnit};
+		} else
+		{
+			f32 x1 = (lines.x1[i] - viewportMin.x) * pixelsPerUnit;
+			f32 y1 = (lines.y1[i] - viewportMin.y) * pixelsPerUnit;
+			f32 x2 = (lines.x2[i] - viewportMin.x) * pixelsPerUnit;
+			f32 y2 = (lines.y2[i] - viewportMin.y) * pixelsPerUnit;
+			minPx = Vec2{min(x1, x2), min(y1, y2)} - linePaddingPx;
+			maxPx = Vec2{max(x1, x2), max(y1, y2)} + linePaddingPx;
+		}
+
+		masks[c] = damageMask(damage, damageBounds, minPx, maxPx);
+	}
+
+	// The rectangles don't overlap, so each can be drawn on its own,
+	// with the runs of lines in it drawn together.
+	LineBatch batch;
+	batch.count = 0;
+	for (u32 r = 0; r < damage.rectCount; ++r)
+	{
+		Bitmap clipped = clipBitmap(canvas, damage.rects[r]);
+		for (u32 c = 0; c < candidateCount; ++c)
+		{
+			if (masks[c] & (1 << r))
+			{
+				drawSceneShape(cpu, clipped, scene, refs[c], viewportMin, pixelsPerUnit, batch);
+			}
+		}
+		flushLineBatch(cpu, clipped, batch, viewportMin, pixelsPerUnit);
+	}
+}
+
+// Draws everything on top of the scene: the selection markers and
+// the help text.
+static void drawOverlay(const Application& app, Bitmap canvas, f32 pixelsPerUnit, MemStack& scratchMem)
+{
+	auto memMark = mark(scratchMem);
+	Vec2 *markers;
+	u32 markerCount = selectionMarkers(app, app.viewportMin, pixelsPerUnit, scratchMem, markers);
+	drawSelectedShapeMarkers(app.cpu, canvas, markerCount, markers, scratchMem);
+	release(scratchMem, memMark);
+
+	ColorU8 yellow = {};
+	yellow.r = 255;
+	yellow.g = 255;
+	yellow.b = 0;
+	yellow.a = 255;
+
+	if (app.state == ApplicationState::SELECTING)
+	{
+		PixelRect edges[4];
+		selectionRectEdges(app, edges);
+		for (u32 i = 0; i < 4; ++i)
+		{
+			RectF32 rect;
+			rect.min = {(f32) edges[i].xMin, (f32) edges[i].yMin};
+			rect.width = (f32) (edges[i].xMax - edges[i].xMin);
+			rect.height = (f32) (edges[i].yMax - edges[i].yMin);
+			fillRect(app.cpu, canvas, rect, yellow);
+		}
+	}
+
+	// draw help text in upper-left corner
+	const char *stateText = "";
+	switch (app.state)
+	{
+	case ApplicationState::DEFAULT:
+		break;
+	case ApplicationState::PANNING:
+		stateText = "Panning";
+		break;
+	case ApplicationState::ZOOMING:
+		stateText = "Zooming";
+		break;
+	case ApplicationState::SELECTING:
+		stateText = "Selecting";
+		break;
+	default:
+		unreachable();
+		break;
+	}
+
+	// the permanent memory used by each subsystem, in KiB
+	const char *subsystemNames[] = {"font", "shapes", "caches"};
+	static_assert(ArrayLength(subsystemNames) == (size_t) MemSubsystem::Count, "a name for each subsystem");
+	char memoryText[128];
+	char *memoryTextEnd = appendCString(memoryText, "Memory:");
+	for (size_t s = 0; s < (size_t) MemSubsystem::Count; ++s)
+	{
+		memoryTextEnd = appendCString(memoryTextEnd, s == 0 ? " " : ", ");
+		memoryTextEnd = appendCString(memoryTextEnd, subsystemNames[s]);
+		memoryTextEnd = appendCString(memoryTextEnd, " ");
+		memoryTextEnd = appendDecimal(memoryTextEnd, (app.permanentMem.bytesUsed[s] + 1023) / 1024);
+		memoryTextEnd = appendCString(memoryTextEnd, " KiB");
+	}
+	*memoryTextEnd = '\0';
+
+	const char *lines[] =
+	{
+		memoryText,
+		"Hold Q: Pan",
+		"Hold Z: Zoom",
+		"S: Select shape under cursor",
+		"Hold M: Select shapes in a rectangle",
+		"Delete: Remove selected shapes",
+		"Arrow keys: Move selected shapes",
+		"G: Toggle linear blending",
+		"A: Toggle anti-aliasing",
+		"I: Toggle picking by shape ID",
+		stateText,
+	};
+	static_assert(ArrayLength(lines) == overlayStateLine + 1, "the state is on the last line");
+
+	i32 baseline = canvas.height - app.font.advanceY;
+	for (size_t i = 0; i < ArrayLength(lines); ++i)
+	{
+		const char *line = lines[i];
+		size_t lineLength = cStringLength(line);
+		const char *lineEnd = line + lineLength;
+		i32 leftEdge = 5;
+		drawText(app.font, canvas, line, lineEnd, leftEdge, baseline, yellow);
+		baseline -= app.font.advanceY;
+	}
+}
+
+// The shapes that can draw to the canvas. For each type, the indices
+// of the visible shapes are listed. drawList holds all of them, in
+// painter's order.
+struct VisibleShapes
+{
+	u32 rectCount, lineCount;
+	u32 *rects, *lines;
+	ShapeRef *drawList;
+};
+
+// Tests pixel space bounds against a canvas. fillRect and drawLine
+// draw nothing for shapes whose bounds fail this test. The test is
+// written so that NaN bounds count as visible.
+inline static u8 boundsOnCanvas(f32 minXPx, f32 minYPx, f32 maxXPx, f32 maxYPx, f32 widthPx, f32 heightPx)
+{
+	return !(maxXPx < 0.0f || maxYPx < 0.0f || minXPx >= widthPx || minYPx >= heightPx);
+}
+
+inline static u8 rectOnCanvas(
+	const RectShapes& rects, u32 i, Vec2 viewportMin, f32 pixelsPerUnit, f32 widthPx, f32 heightPx)
+{
+	f32 minXPx = (rects.minX[i] - viewportMin.x) * pixelsPerUnit;
+	f32 minYPx = (rects.minY[i] - viewportMin.y) * pixelsPerUnit;
+	f32 maxXPx = minXPx + rects.width[i] * pixelsPerUnit;
+	f32 maxYPx = minYPx + rects.height[i] * pixelsPerUnit;
+	return boundsOnCanvas(minXPx, minYPx, maxXPx, maxYPx, widthPx, heightPx);
+}
+
+// The transform preserves order, so a line's bounds transform to
+// exactly the bounds of its transformed end points.
+inline static u8 lineOnCanvas(
+	const LineShapes& lines, u32 i, Vec2 viewportMin, f32 pixelsPerUnit, f32 widthPx, f32 heightPx)
+{
+	f32 minXPx = (lines.minX[i] - viewportMin.x) * pixelsPerUnit;
+	f32 minYPx = (lines.minY[i] - viewportMin.y) * pixelsPerUnit;
+	f32 maxXPx = (lines.maxX[i] - viewportMin.x) * pixelsPerUnit;
+	f32 maxYPx = (lines.maxY[i] - viewportMin.y) * pixelsPerUnit;
+	return boundsOnCanvas(minXPx, minYPx, maxXPx, maxYPx, widthPx, heightPx);
+}
+
+// Culls the scene, testing only the shapes the BVH finds near the
+// viewport. They are tested exactly like cullScene tests every shape,
+// then sorted by their z-order keys into painter's order.
+static VisibleShapes cullSceneBvh(
+	const Scene& scene,
+	ShapeBvh& bvh,
+	Bitmap canvas,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	MemStack& scratchMem)
+{
+	VisibleShapes visible;
+	f32 widthPx = (f32) canvas.width;
+	f32 heightPx = (f32) canvas.height;
+
+	// Widen the query by a couple of pixels and by the rounding of
+	// the viewport's coordinates, so it finds every shape the exact
+	// test would keep.
+	Vec2 viewportMax = viewportMin + Vec2{widthPx / pixelsPerUnit, heightPx / pixelsPerUnit};
+	f32 padX = 2.0f / pixelsPerUnit + (std::abs(viewportMin.x) + std::abs(viewportMax.x)) * bvhBoundsPad;
+	f32 padY = 2.0f / pixelsPerUnit + (std::abs(viewportMin.y) + std::abs(viewportMax.y)) * bvhBoundsPad;
+	u32 candidateCount = queryShapeBvh(
+		bvh, viewportMin.x - padX, viewportMin.y - padY, viewportMax.x + padX, viewportMax.y + padY);
+
+	const RectShapes& rects = scene.rects;
+	const LineShapes& lines = scene.lines;
+	visible.rects = allocateAlignedArray<u32>(scratchMem, candidateCount, cacheLineSize);
+	visible.lines = allocateAlignedArray<u32>(scratchMem, candidateCount, cacheLineSize);
+	visible.drawList = allocateAlignedArray<ShapeRef>(scratchMem, candidateCount, cacheLineSize);
+	u32 *zKeys = allocateAlignedArray<u32>(scratchMem, candidateCount, cacheLineSize);
+	visible.rectCount = 0;
+	visible.lineCount = 0;
+	u32 visibleCount = 0;
+	for (u32 c = 0; c < candidateCount; ++c)
+	{
+		ShapeRef ref = scene.refs[bvh.resultSlots[c]];
+		u32 i = shapeRefIndex(ref);
+		switch (shapeRefType(ref))
+		{
+		case ShapeType::Rectangle:
+			if (!rectOnCanvas(rects, i, viewportMin, pixelsPerUnit, widthPx, heightPx))
+			{
+				continue;
+			}
+			visible.rects[visible.rectCount++] = i;
+			zKeys[visibleCount] = rects.z[i];
+			break;
+		case ShapeType::Line:
+			if (!lineOnCanvas(lines, i, viewportMin, pixelsPerUnit, widthPx, heightPx))
+			{
+				continue;
+			}
+			visible.lines[visible.lineCount++] = i;
+			zKeys[visibleCount] = lines.z[i];
+			break;
+		default:
+			unreachable();
+			continue;
+		}
+		visible.drawList[visibleCount++] = ref;
+	}
+
+	radixSort(visibleCount, zKeys, visible.drawList, scratchMem);
+	return visible;
+}
+
+// Culls the shapes whose world-space bounds fall outside the canvas,
+// before their geometry is transformed or drawn. Bounds go through
+// the same arithmetic as the shapes' coordinates do when they are
+// drawn, so a shape is only culled if drawing it would change no
+// pixels.
+static VisibleShapes cullScene(
+	const Scene& scene,
+	ShapeBvh& bvh,
+	Bitmap canvas,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	MemStack& scratchMem)
+{
+	// When the viewport covers a small part of the scene, most shapes
+	// are culled, and walking the BVH skips them without touching them.
+	if (bvh.levelCount > 0)
+	{
+		u32 root = bvh.levelStarts[bvh.levelCount - 1];
+		f32 sceneArea = (bvh.maxX[root] - bvh.minX[root]) * (bvh.maxY[root] - bvh.minY[root]);
+		f32 viewportArea = (f32) canvas.width * (f32) canvas.height / (pixelsPerUnit * pixelsPerUnit);
+		if (4.0f * viewportArea < sceneArea)
+		{
+			return cullSceneBvh(scene, bvh, canvas, viewportMin, pixelsPerUnit, scratchMem);
+		}
+	}
+
+	VisibleShapes visible;
+	f32 widthPx = (f32) canvas.width;
+	f32 heightPx = (f32) canvas.height;
+
+	const RectShapes& rects = scene.rects;
+	u32 rectCount = rects.soa.count;
+	visible.rects = allocateAlignedArray<u32>(scratchMem, rectCount, cacheLineSize);
+	u8 *rectFlags = allocateAlignedArray<u8>(scratchMem, rectCount, cacheLineSize);
+	visible.rectCount = 0;
+	for (u32 i = 0; i < rectCount; ++i)
+	{
+		u8 onCanvas = rectOnCanvas(rects, i, viewportMin, pixelsPerUnit, widthPx, heightPx);
+		rectFlags[i] = onCanvas;
+		visible.rects[visible.rectCount] = i;
+		visible.rectCount += onCanvas;
+	}
+
+	const LineShapes& lines = scene.lines;
+	u32 lineCount = lines.soa.count;
+	visible.lines = allocateAlignedArray<u32>(scratchMem, lineCount, cacheLineSize);
+	u8 *lineFlags = allocateAlignedArray<u8>(scratchMem, lineCount, cacheLineSize);
+	visible.lineCount = 0;
+	for (u32 i = 0; i < lineCount; ++i)
+	{
+		u8 onCanvas = lineOnCanvas(lines, i, viewportMin, pixelsPerUnit, widthPx, heightPx);
+		lineFlags[i] = onCanvas;
+		visible.lines[visible.lineCount] = i;
+		visible.lineCount += onCanvas;
+	}
+
+	visible.drawList = allocateAlignedArray<ShapeRef>(
+		scratchMem, visible.rectCount + visible.lineCount, cacheLineSize);
+	u32 visibleCount = 0;
+	for (u32 slot = scene.zBack; slot != noSlot; slot = scene.zNext[slot])
+	{
+		ShapeRef ref = scene.refs[slot];
+		u32 i = shapeRefIndex(ref);
+		bool onCanvas = shapeRefType(ref) == ShapeType::Rectangle ? rectFlags[i] : lineFlags[i];
+		if (onCanvas)
+		{
+			visible.drawList[visibleCount++] = ref;
+		}
+	}
+
+	return visible;
+}
+
+// The scene's coordinates transformed into pixel space, with the same
+// layout as the scene's shape arrays. Only the elements of visible
+// shapes are filled in. Lines are drawn from world space by drawLines,
+// so their elements are only filled in to bin them into tiles. They are
+// clipped to the canvas, and lineVisible is set for those with a part
+// left on it.
+struct ScenePx
+{
+	f32 *rectMinX, *rectMinY, *rectWidth, *rectHeight;
+	f32 *lineX1, *lineY1, *lineX2, *lineY2;
+	u8 *lineVisible;
+};
+
+static void transformLinesScalar(
+	const LineShapes& lines,
+	u32 begin,
+	u32 end,
+	const u32 *indices,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	Vec2 max,
+	ScenePx& px)
+{
+	for (u32 k = begin; k < end; ++k)
+	{
+		u32 i = indices[k];
+		LineF32 line;
+		line.p1 = (Vec2{lines.x1[i], lines.y1[i]} - viewportMin) * pixelsPerUnit;
+		line.p2 = (Vec2{lines.x2[i], lines.y2[i]} - viewportMin) * pixelsPerUnit;
+		px.lineVisible[i] = clipLineLiangBarsky(max, line);
+		px.lineX1[i] = line.p1.x;
+		px.lineY1[i] = line.p1.y;
+		px.lineX2[i] = line.p2.x;
+		px.lineY2[i] = line.p2.y;
+	}
+}
+
+// The AVX2 version of transformLinesScalar. Each group of eight lines
+// is gathered from the scene, transformed and clipped in registers,
+// and scattered to the pixel space arrays.
+TARGET_AVX2
+static void transformLinesAvx2(
+	const LineShapes& lines,
+	u32 count,
+	const u32 *indices,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	Vec2 max,
+	ScenePx& px)
+{
+	__m256 offsetX = _mm256_set1_ps(viewportMin.x);
+	__m256 offsetY = _mm256_set1_ps(viewportMin.y);
+	__m256 scale = _mm256_set1_ps(pixelsPerUnit);
+	__m256 maxX = _mm256_set1_ps(max.x);
+	__m256 maxY = _mm256_set1_ps(max.y);
+
+	u32 k = 0;
+	for (; k + 8 <= count; k += 8)
+	{
+		__m256i index = _mm256_loadu_si256((const __m256i*) (indices + k));
+		__m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_i32gather_ps(lines.x1, index, 4), offsetX), scale);
+		__m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_i32gather_ps(lines.y1, index, 4), offsetY), scale);
+		__m256 x2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_i32gather_ps(lines.x2, index, 4), offsetX), scale);
+		__m256 y2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_i32gather_ps(lines.y2, index, 4), offsetY), scale);
+		u32 visibleMask = (u32) _mm256_movemask_ps(clipLinesAvx2(x1, y1, x2, y2, maxX, maxY));
+
+		f32 coordsPx[4][8];
+		_mm256_storeu_ps(coordsPx[0], x1);
+		_mm256_storeu_ps(coordsPx[1], y1);
+		_mm256_storeu_ps(coordsPx[2], x2);
+		_mm256_storeu_ps(coordsPx[3], y2);
+		for (u32 lane = 0; lane < 8; ++lane)
+		{
+			u32 i = indices[k + lane];
+			px.lineVisible[i] = (u8) ((visibleMask >> lane) & 1);
+			px.lineX1[i] = coordsPx[0][lane];
+			px.lineY1[i] = coordsPx[1][lane];
+			px.lineX2[i] = coordsPx[2][lane];
+			px.lineY2[i] = coordsPx[3][lane];
 		}
+	}
+
+	transformLinesScalar(lines, k, count, indices, viewportMin, pixelsPerUnit, max, px);
+}
+
+// Transforms the visible rectangles into pixel space.
+static ScenePx transformScene(
+	const CpuFeatures& cpu,
+	const Scene& scene,
+	const VisibleShapes& visible,
+	Bitmap canvas,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	MemStack& scratchMem)
+{
+	ScenePx px;
+
+	const RectShapes& rects = scene.rects;
+	u32 rectCount = rects.soa.count;
+	px.rectMinX = allocateAlignedArray<f32>(scratchMem, rectCount, cacheLineSize);
+	px.rectMinY = allocateAlignedArray<f32>(scratchMem, rectCount, cacheLineSize);
+	px.rectWidth = allocateAlignedArray<f32>(scratchMem, rectCount, cacheLineSize);
+	px.rectHeight = allocateAlignedArray<f32>(scratchMem, rectCount, cacheLineSize);
+	coordsToPixelSpace(visible.rectCount, visible.rects, rects.minX, viewportMin.x, pixelsPerUnit, px.rectMinX);
+	coordsToPixelSpace(visible.rectCount, visible.rects, rects.minY, viewportMin.y, pixelsPerUnit, px.rectMinY);
+	lengthsToPixelSpace(visible.rectCount, visible.rects, rects.width, pixelsPerUnit, px.rectWidth);
+	lengthsToPixelSpace(visible.rectCount, visible.rects, rects.height, pixelsPerUnit, px.rectHeight);
+	return px;
+}
+
+// Transforms the visible lines into pixel space, and clips them to the
+// canvas, to find the tiles they cross.
+static void transformSceneLines(
+	const CpuFeatures& cpu,
+	const Scene& scene,
+	const VisibleShapes& visible,
+	Bitmap canvas,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	ScenePx& px,
+	MemStack& scratchMem)
+{
+	const LineShapes& lines = scene.lines;
+	u32 lineCount = lines.soa.count;
+	px.lineX1 = allocateAlignedArray<f32>(scratchMem, lineCount, cacheLineSize);
+	px.lineY1 = allocateAlignedArray<f32>(scratchMem, lineCount, cacheLineSize);
+	px.lineX2 = allocateAlignedArray<f32>(scratchMem, lineCount, cacheLineSize);
+	px.lineY2 = allocateAlignedArray<f32>(scratchMem, lineCount, cacheLineSize);
+	px.lineVisible = allocateAlignedArray<u8>(scratchMem, lineCount, cacheLineSize);
+	Vec2 max = lineClipMax(canvas);
+	if (cpu.avx2)
+	{
+		transformLinesAvx2(lines, visible.lineCount, visible.lines, viewportMin, pixelsPerUnit, max, px);
+	} else
+	{
+		transformLinesScalar(lines, 0, visible.lineCount, visible.lines, viewportMin, pixelsPerUnit, max, px);
+	}
+}
+
+// Draws a shape with its pixel space rectangle, or queues it if it is
+// a line. The batch must be flushed after the last shape.
+inline static void drawShapePx(
+	const CpuFeatures& cpu,
+	Bitmap canvas,
+	const Scene& scene,
+	const ScenePx& px,
+	ShapeRef ref,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	LineBatch& batch)
+{
+	u32 i = shapeRefIndex(ref);
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+	{
+		flushLineBatch(cpu, canvas, batch, viewportMin, pixelsPerUnit);
+		canvas.shapeId = slotShapeId(scene.rects.slots[i]);
+		RectF32 rect;
+		rect.min = {px.rectMinX[i], px.rectMinY[i]};
+		rect.width = px.rectWidth[i];
+		rect.height = px.rectHeight[i];
+		fillRect(cpu, canvas, rect, scene.rects.colors[i]);
+	} break;
+	case ShapeType::Line:
+	{
+		queueSceneLine(cpu, canvas, batch, scene, i, viewportMin, pixelsPerUnit);
+	} break;
+	default:
+		unreachable();
+		break;
+	}
+}
 
-		auto bitmapStorageSize = 256 * bitmapSizePx;
-//TODO allocate this in a different memory pool
-		app.font.bitmaps = (u8*) PLATFORM_alloc(bitmapStorageSize);
-		if (app.font.bitmaps == nullptr)
+// Returns the pixels a shape may draw to, before clipping.
+inline static PixelRect shapePxBounds(const ScenePx& px, ShapeRef ref)
+{
+	u32 i = shapeRefIndex(ref);
+	switch (shapeRefType(ref))
+	{
+	case ShapeType::Rectangle:
+	{
+		Vec2 minPx = {px.rectMinX[i], px.rectMinY[i]};
+		return pixelBounds(minPx, minPx + Vec2{px.rectWidth[i], px.rectHeight[i]});
+	}
+	case ShapeType::Line:
+	{
+		if (!px.lineVisible[i])
 		{
-			assert(false);
-			goto ttfLoadError;
+			return PixelRect{};
 		}
+		Vec2 minPx = {min(px.lineX1[i], px.lineX2[i]), min(px.lineY1[i], px.lineY2[i])};
+		Vec2 maxPx = {max(px.lineX1[i], px.lineX2[i]), max(px.lineY1[i], px.lineY2[i])};
+		return pixelBounds(minPx - linePaddingPx, maxPx + linePaddingPx);
+	}
+	default:
+		unreachable();
+		return PixelRect{};
+	}
+}
 
-		f32 scale = stbtt_ScaleForPixelHeight(&font, (f32) bitmapHeightPx);
-		i32 ascentUnscaled, descentUnscaled, lineGapUnscaled;
-		stbtt_GetFontVMetrics(&font, &ascentUnscaled, &descentUnscaled, &lineGapUnscaled);
-		app.font.advanceY = (u32) round(((f32) ascentUnscaled - descentUnscaled + lineGapUnscaled) * scale);
+// Full redraws are split into square tiles of this many pixels on a
+// side, which are drawn in parallel. A tile of the linear canvas
+// takes 32 KiB, so it stays in L1 or L2 while each shape overlapping
+// it is drawn.
+const u32 tileSizePx = 64;
 
-		u8 *nextBitmap = app.font.bitmaps;
-		u8 c = 0;
-		for (;;)
-		{
-			GlyphMetrics metrics = {};
+// The work shared by the threads drawing one frame's tiles.
+struct TiledFrame
+{
+	const CpuFeatures *cpu;
+	Bitmap target;
+	ColorU8 background;
+	const Scene *scene;
+	ScenePx px;
+	Vec2 viewportMin;
+	f32 pixelsPerUnit;
 
-			auto glyphIndex = stbtt_FindGlyphIndex(&font, c);
+	u32 tileCountX;
+	// The shapes overlapping tile t are binEntries[binStarts[t]]
+	// up to binEntries[binStarts[t + 1]], in painter's order.
+	u32 *binStarts;
+	ShapeRef *binEntries;
+};
 
-			stbtt_MakeGlyphBitmap(
-				&font,
-				nextBitmap,
-				bitmapWidthPx, bitmapHeightPx,
-				bitmapWidthPx,
-				scale, scale,
-				glyphIndex);
+// Narrows the tile columns [tileXMin, tileXMax] that a shape overlaps
+// to those it can draw to within one row of tiles. A long diagonal
+// line only crosses a few tiles of each row its bounds cover.
+inline static void rowTileSpan(
+	const ScenePx& px, ShapeRef ref, i32 tileY, i32& tileXMin, i32& tileXMax)
+{
+	if (shapeRefType(ref) != ShapeType::Line)
+	{
+		return;
+	}
 
-			i32 advanceXUnscaled, leftOffsetUnscaled;
-			stbtt_GetGlyphHMetrics(&font, glyphIndex, &advanceXUnscaled, &leftOffsetUnscaled);
+	u32 i = shapeRefIndex(ref);
+	f32 x1 = px.lineX1[i];
+	f32 y1 = px.lineY1[i];
+	f32 x2 = px.lineX2[i];
+	f32 y2 = px.lineY2[i];
+
+	// drawLine clips and truncates the endpoints before running
+	// Bresenham, so the pixels it draws are within a couple of pixels
+	// of the exact segment, and anti-aliased lines within one. Far
+	// from the canvas, rounding errors grow past that slack, so those
+	// lines keep their full bounds.
+	const f32 slackPx = 2.0f;
+	const f32 maxCoordPx = (f32) (1 << 20);
+	if (!(std::abs(x1) < maxCoordPx && std::abs(y1) < maxCoordPx
+		&& std::abs(x2) < maxCoordPx && std::abs(y2) < maxCoordPx))
+	{
+		return;
+	}
 
-			metrics.advanceX = (u32) round((f32) advanceXUnscaled * scale);
-			metrics.offsetLeft  = (i32) round((f32) leftOffsetUnscaled * scale);
+	if (y1 > y2)
+	{
+		swap(x1, x2);
+		swap(y1, y2);
+	}
 
-			stbtt_GetGlyphBitmapBox(
-				&font, glyphIndex,
-				scale, scale,
-				nullptr, &metrics.offsetTop, nullptr, nullptr);
+	// the part of the line within the row, widened by the slack
+	f32 rowMin = (f32) (tileY * (i32) tileSizePx) - slackPx;
+	f32 rowMax = (f32) ((tileY + 1) * (i32) tileSizePx) + slackPx;
+	f32 xa = x1;
+	f32 xb = x2;
+	f32 dy = y2 - y1;
+	if (dy > 0.0f)
+	{
+		f32 ta = clamp((rowMin - y1) / dy, 0.0f, 1.0f);
+		f32 tb = clamp((rowMax - y1) / dy, 0.0f, 1.0f);
+		xa = x1 + (x2 - x1) * ta;
+		xb = x1 + (x2 - x1) * tb;
+	}
 
-			app.font.glyphMetrics[c] = metrics;
+	i32 spanMin = (i32) std::floor((min(xa, xb) - slackPx) / (f32) tileSizePx);
+	i32 spanMax = (i32) std::floor((max(xa, xb) + slackPx) / (f32) tileSizePx);
+	tileXMin = spanMin > tileXMin ? spanMin : tileXMin;
+	tileXMax = spanMax < tileXMax ? spanMax : tileXMax;
+}
 
-			nextBitmap += bitmapSizePx;
+// Binning a frame's shapes into tiles is split into chunks of at least
+// this many consecutive shapes in painter's order, which are binned in
+// parallel.
+const u32 minBinChunkShapeCount = 4096;
+
+// The work shared by the threads binning one frame's shapes. Chunk c
+// bins shapes [c * chunkShapeCount, (c + 1) * chunkShapeCount) of the
+// draw list. Each chunk counts its own entries in each tile's bin, so
+// the chunks' entries can be laid out one after another in every bin,
+// in chunk order, which keeps each bin in painter's order.
+struct TileBinning
+{
+	const ScenePx *px;
+	const ShapeRef *drawList;
+	u32 shapeCount;
+	u32 chunkShapeCount;
+	PixelRect canvasRect;
+	u32 tileCountX;
+	u32 tileCount;
+
+	// the inclusive range of tiles each shape in the draw list
+	// overlaps, empty for shapes that draw nothing
+	PixelRect *tileRanges;
+	// For chunk c and tile t, chunkBins[c * tileCount + t] first
+	// counts the chunk's entries in the tile's bin, then holds where
+	// the next of them goes in binEntries.
+	u32 *chunkBins;
+	ShapeRef *binEntries;
+};
 
-			if (c == 255)
+// Finds the tiles each shape in a chunk overlaps, and counts the
+// chunk's entries in each bin.
+static void countTileBins(void *data, u32 chunk)
+{
+	const TileBinning& binning = *(const TileBinning*) data;
+	u32 *counts = binning.chunkBins + chunk * binning.tileCount;
+	u32 begin = chunk * binning.chunkShapeCount;
+	u32 end = begin + binning.chunkShapeCount;
+	if (end > binning.shapeCount)
+	{
+		end = binning.shapeCount;
+	}
+	for (u32 d = begin; d < end; ++d)
+	{
+		ShapeRef ref = binning.drawList[d];
+		PixelRect bounds = intersect(shapePxBounds(*binning.px, ref), binning.canvasRect);
+		if (isEmpty(bounds))
+		{
+			binning.tileRanges[d] = PixelRect{0, 0, -1, -1};
+			continue;
+		}
+
+		// inclusive tile coordinates
+		PixelRect tiles;
+		tiles.xMin = bounds.xMin / (i32) tileSizePx;
+		tiles.yMin = bounds.yMin / (i32) tileSizePx;
+		tiles.xMax = (bounds.xMax - 1) / (i32) tileSizePx;
+		tiles.yMax = (bounds.yMax - 1) / (i32) tileSizePx;
+		for (i32 ty = tiles.yMin; ty <= tiles.yMax; ++ty)
+		{
+			i32 txMin = tiles.xMin;
+			i32 txMax = tiles.xMax;
+			rowTileSpan(*binning.px, ref, ty, txMin, txMax);
+			for (i32 tx = txMin; tx <= txMax; ++tx)
 			{
-				break;
+				++counts[ty * binning.tileCountX + tx];
 			}
-			++c;
 		}
+		binning.tileRanges[d] = tiles;
+	}
+}
 
-		goto ttfLoadSuccess;
-
-ttfLoadError:
-		ttfLoadSuccessful = false;
-ttfLoadSuccess:
-		release(app.scratchMem, memMark);
-		if (!ttfLoadSuccessful)
+// Adds the shapes in a chunk to the bins of the tiles they overlap.
+static void fillTileBins(void *data, u32 chunk)
+{
+	const TileBinning& binning = *(const TileBinning*) data;
+	u32 *next = binning.chunkBins + chunk * binning.tileCount;
+	u32 begin = chunk * binning.chunkShapeCount;
+	u32 end = begin + binning.chunkShapeCount;
+	if (end > binning.shapeCount)
+	{
+		end = binning.shapeCount;
+	}
+	for (u32 d = begin; d < end; ++d)
+	{
+		ShapeRef ref = binning.drawList[d];
+		PixelRect tiles = binning.tileRanges[d];
+		for (i32 ty = tiles.yMin; ty <= tiles.yMax; ++ty)
 		{
-			return false;
+			i32 txMin = tiles.xMin;
+			i32 txMax = tiles.xMax;
+			rowTileSpan(*binning.px, ref, ty, txMin, txMax);
+			for (i32 tx = txMin; tx <= txMax; ++tx)
+			{
+				binning.binEntries[next[ty * binning.tileCountX + tx]++] = ref;
+			}
 		}
 	}
+}
 
-	app.viewportMin = {-1.0, -1.0};
-	app.viewportSize = 2.0;
+inline static PixelRect tileRect(Bitmap canvas, u32 tileX, u32 tileY)
+{
+	PixelRect rect;
+	rect.xMin = (i32) (tileX * tileSizePx);
+	rect.yMin = (i32) (tileY * tileSizePx);
+	rect.xMax = rect.xMin + (i32) tileSizePx;
+	rect.yMax = rect.yMin + (i32) tileSizePx;
+	PixelRect canvasRect = {0, 0, (i32) canvas.width, (i32) canvas.height};
+	return intersect(rect, canvasRect);
+}
 
-	app.selectShape = false;
-	app.shapeSelected = false;
+// Clears one tile and draws the shapes binned into it. Each tile is
+// drawn through a bitmap clipped to it, and the kernels draw exactly
+// the pixels of the unclipped shape that fall inside the clip. Every
+// pixel therefore sees the same writes in the same order as in a
+// serial draw, whichever thread draws its tile.
+static void drawTile(void *data, u32 tile)
+{
+	const TiledFrame& frame = *(const TiledFrame*) data;
+	PixelRect rect = tileRect(frame.target, tile % frame.tileCountX, tile / frame.tileCountX);
+	Bitmap canvas = clipBitmap(frame.target, rect);
+
+	RectF32 clear;
+	clear.min = {(f32) rect.xMin, (f32) rect.yMin};
+	clear.width = (f32) (rect.xMax - rect.xMin);
+	clear.height = (f32) (rect.yMax - rect.yMin);
+	fillRect(*frame.cpu, canvas, clear, frame.background);
+
+	LineBatch batch;
+	batch.count = 0;
+	for (u32 e = frame.binStarts[tile]; e < frame.binStarts[tile + 1]; ++e)
+	{
+		drawShapePx(
+			*frame.cpu, canvas, *frame.scene, frame.px, frame.binEntries[e],
+			frame.viewportMin, frame.pixelsPerUnit, batch);
+	}
+	flushLineBatch(*frame.cpu, canvas, batch, frame.viewportMin, frame.pixelsPerUnit);
+}
 
-	addShapes(app);
+// Clears the canvas and draws the scene, binning the shapes into the
+// tiles their bounds overlap and drawing the tiles in parallel. The
+// result is identical to clearing and drawing the scene on one thread.
+static void drawSceneTiled(
+	const CpuFeatures& cpu,
+	Bitmap target,
+	ColorU8 background,
+	const Scene& scene,
+	ShapeBvh& bvh,
+	Vec2 viewportMin,
+	f32 pixelsPerUnit,
+	MemStack& scratchMem)
+{
+	TiledFrame frame;
+	frame.cpu = &cpu;
+	frame.target = target;
+	frame.background = background;
+	frame.scene = &scene;
+	frame.viewportMin = viewportMin;
+	frame.pixelsPerUnit = pixelsPerUnit;
+	VisibleShapes visible = cullScene(scene, bvh, target, viewportMin, pixelsPerUnit, scratchMem);
+	frame.px = transformScene(cpu, scene, visible, target, viewportMin, pixelsPerUnit, scratchMem);
+	transformSceneLines(cpu, scene, visible, target, viewportMin, pixelsPerUnit, frame.px, scratchMem);
+
+	frame.tileCountX = (target.width + tileSizePx - 1) / tileSizePx;
+	u32 tileCountY = (target.height + tileSizePx - 1) / tileSizePx;
+	u32 tileCount = frame.tileCountX * tileCountY;
+
+	TileBinning binning;
+	binning.px = &frame.px;
+	binning.drawList = visible.drawList;
+	binning.shapeCount = visible.rectCount + visible.lineCount;
+	binning.canvasRect = {0, 0, (i32) target.width, (i32) target.height};
+	binning.tileCountX = frame.tileCountX;
+	binning.tileCount = tileCount;
+
+	// Small frames are binned on one thread, where splitting the work
+	// costs more than it saves.
+	u32 chunkCount = (binning.shapeCount + minBinChunkShapeCount - 1) / minBinChunkShapeCount;
+	if (chunkCount > PLATFORM_threadCount())
+	{
+		chunkCount = PLATFORM_threadCount();
+	}
+	if (chunkCount == 0)
+	{
+		chunkCount = 1;
+	}
+	binning.chunkShapeCount = (binning.shapeCount + chunkCount - 1) / chunkCount;
+	binning.tileRanges = allocateAlignedArray<PixelRect>(scratchMem, binning.shapeCount, cacheLineSize);
+	binning.chunkBins = allocateAlignedArray<u32>(scratchMem, chunkCount * tileCount, cacheLineSize);
+	for (u32 i = 0; i < chunkCount * tileCount; ++i)
+	{
+		binning.chunkBins[i] = 0;
+	}
+	PLATFORM_parallelFor(countTileBins, &binning, chunkCount);
 
-	assert(app.scratchMem.top == app.scratchMem.floor);
+	// Each bin holds the entries of every chunk in turn. Turn the
+	// counts into where each chunk's entries start.
+	frame.binStarts = allocateAlignedArray<u32>(scratchMem, tileCount + 1, cacheLineSize);
+	u32 entryCount = 0;
+	for (u32 t = 0; t < tileCount; ++t)
+	{
+		frame.binStarts[t] = entryCount;
+		for (u32 c = 0; c < chunkCount; ++c)
+		{
+			u32 count = binning.chunkBins[c * tileCount + t];
+			binning.chunkBins[c * tileCount + t] = entryCount;
+			entryCount += count;
+		}
+	}
+	frame.binStarts[tileCount] = entryCount;
 
-	return true;
+	binning.binEntries = allocateAlignedArray<ShapeRef>(scratchMem, entryCount, cacheLineSize);
+	PLATFORM_parallelFor(fillTileBins, &binning, chunkCount);
+	frame.binEntries = binning.binEntries;
+
+	PLATFORM_parallelFor(drawTile, &frame, tileCount);
 }
 
-inline static void selectShape(Application& app)
+struct ResolveBands
 {
-	f32 unitsPerPixel = app.viewportSize / (f32) app.canvas.height;
-	f32 pixelsPerUnit = 1.0f / unitsPerPixel;
-	// transform the mouse position to global coordinates
+	const CpuFeatures *cpu;
+	Bitmap linear;
+	Bitmap canvas;
+};
 
-	Vec2 mousePx = {(f32) app.mouseX, (f32) app.mouseY};
-	Vec2 test = unitsPerPixel * mousePx + app.viewportMin;
+static void resolveBand(void *data, u32 band)
+{
+	const ResolveBands& bands = *(const ResolveBands*) data;
+	PixelRect rect = {
+		0, (i32) (band * tileSizePx),
+		(i32) bands.canvas.width, (i32) ((band + 1) * tileSizePx)};
+	resolveLinearCanvas(*bands.cpu, bands.linear, bands.canvas, rect);
+}
 
-	// Shapes are drawn such that the last one is on top.
-	// Iterate through the shapes backwards so that if shapes
-	// are overlapping, the visible one is chosen.
-	u32 i = app.shapeCount;
-	while (i > 0)
+// Resolves the whole linear canvas in parallel, one band of tile
+// rows at a time.
+static void resolveLinearCanvasTiled(const CpuFeatures& cpu, Bitmap linear, Bitmap canvas)
+{
+	ResolveBands bands;
+	bands.cpu = &cpu;
+	bands.linear = linear;
+	bands.canvas = canvas;
+	PLATFORM_parallelFor(resolveBand, &bands, (canvas.height + tileSizePx - 1) / tileSizePx);
+}
+
+// Makes the linear canvas match the size of the presented canvas.
+static bool resizeLinearCanvas(Application& app)
+{
+	Bitmap& linear = app.linearCanvas;
+	if (linear.pixels != nullptr
+		&& linear.width == app.canvas.width
+		&& linear.height == app.canvas.height)
 	{
-		--i;
-		Shape shape = app.shapes[i];
-		switch (shape.type)
-		{
-		case ShapeType::Rectangle:
-		{
-			RectF32 rect = shape.data.rect;
-			Vec2 min = rect.min;
-			Vec2 max = min + Vec2{rect.width, rect.height};
-			if (test.x >= min.x
-				&& test.x <= max.x
-				&& test.y >= min.y
-				&& test.y <= max.y)
-			{
-				goto hitShape;
-			}
-		} break;
-		case ShapeType::Line:
-		{
-			LineF32 line = shape.data.line;
-			Vec2 v21 = line.p2 - line.p1;
-			f32 lineLengthSq = normSq(v21);
-			Vec2 closest;
-//TODO checking for exactly zero is not sufficient. Make this test more robust.
-			if (lineLengthSq == 0.0f)
-			{
-				// This branch is taken if the line is a single point.
-				// In this case, the x and y points are coincident, thus
-				// the closest point on the line is either one of these.
-				closest = line.p1;
-			} else
-			{
-				// `t` represents the parameter in the parametric
-				// equation of the line
-				f32 t = dot(test - line.p1, v21) / lineLengthSq;
-				// clamp `t` to the endpoints of the line
-				t = clamp(t, 0.0f, 1.0f);
-				// evaluate the line equation for the closest `t` to the test point
-				closest = line.p1 + t * v21;
-			}
+		return true;
+	}
 
-			f32 distSq = normSq(closest - test);
+	if (linear.pixels != nullptr)
+	{
+		PLATFORM_free(linear.pixels);
+	}
+	linear = {};
 
-			// distPx = dist * ppu = sqrt(distSq) * ppu
-			// distPx^2 = (sqrt(distSq) * ppu)^2 = distSq * ppu^2
-			f32 distSqPx = distSq * (pixelsPerUnit * pixelsPerUnit);
+	// the new canvas holds nothing to partially redraw over
+	app.drawCanvas = true;
 
-			// Clicking exactly on a 1 pixel-wide line is tricky. Allow
-			// 2 pixels of slop on each side to make the task easier.
-			f32 maxDistPx = 5.0f;
-			if (distSqPx <= maxDistPx * maxDistPx)
-			{
-				goto hitShape;
-			}
-		} break;
-		default:
-			unreachable();
-		}
+	size_t size = (size_t) app.canvas.width * app.canvas.height * bytesPerPixel(PixelFormat::LinearBgra16);
+	auto *pixels = (u8*) PLATFORM_alloc(size);
+	if (pixels == nullptr)
+	{
+		return false;
 	}
-	app.shapeSelected = false;
-	return;
 
-hitShape:
-	app.selectedShapeIndex = i;
-	app.shapeSelected = true;
+	linear.width = app.canvas.width;
+	linear.height = app.canvas.height;
+	linear.pitch = (i32) (app.canvas.width * bytesPerPixel(PixelFormat::LinearBgra16));
+	linear.pixels = pixels;
+	linear.format = PixelFormat::LinearBgra16;
+	return true;
 }
 
-// draws rectangles centered at the given points
-static void drawSelectedShapeMarkers(
-	Bitmap canvas, u32 markerCount, Vec2 *pointsPx)
+// Makes the shape ID plane as large as the canvas. Returns false if it
+// could not be allocated.
+static bool resizeShapeIds(Application& app)
 {
-	ColorU8 yellow = {};
-	yellow.r = 255;
-	yellow.g = 255;
-	yellow.b = 0;
-	yellow.a = 255;
+	if (app.shapeIds != nullptr
+		&& app.shapeIdsWidth == app.canvas.width
+		&& app.shapeIdsHeight == app.canvas.height)
+	{
+		return true;
+	}
 
-	f32 halfSizePx = 5.0f;
-	f32 sizePx = 2.0f * halfSizePx;
+	if (app.shapeIds != nullptr)
+	{
+		PLATFORM_free(app.shapeIds);
+	}
+	app.shapeIds = nullptr;
+	app.shapeIdsCurrent = false;
 
-	RectF32 rect = {};
-	rect.width = sizePx;
-	rect.height = sizePx;
+	// the new plane holds no IDs to partially redraw over
+	app.drawCanvas = true;
 
-	for (u32 i = 0; i < markerCount; ++i)
+	size_t size = (size_t) app.canvas.width * app.canvas.height * sizeof(u32);
+	app.shapeIds = (u32*) PLATFORM_alloc(size);
+	if (app.shapeIds == nullptr)
 	{
-		rect.min = pointsPx[i] - Vec2{halfSizePx, halfSizePx};
-		fillRect(canvas, rect, yellow);
+		return false;
 	}
+	app.shapeIdsWidth = app.canvas.width;
+	app.shapeIdsHeight = app.canvas.height;
+	return true;
 }
 
 void update(Application& app)
@@ -859,16 +6377,130 @@ void update(Application& app)
 	f32 unitsPerPixel = app.viewportSize / (f32) app.canvas.height;
 	f32 pixelsPerUnit = 1.0f / unitsPerPixel;
 
+	// Shapes added or removed since the last frame may call for a new
+	// BVH. It is rebuilt before anything queries it.
+	refreshShapeBvh(app.bvh, app.scene, app.scratchMem);
+
 	switch (app.state)
 	{
 	case ApplicationState::DEFAULT:
 	{
 		if (app.selectShape)
 		{
+			// Only the markers change, so only they are redrawn.
 			app.selectShape = false;
+			damageSelectionMarkers(app, pixelsPerUnit);
 			selectShape(app);
+			damageSelectionMarkers(app, pixelsPerUnit);
+		}
+		if (app.selectShapesInRect)
+		{
+			app.selectShapesInRect = false;
+			damageSelectionRect(app);
+			damageSelectionMarkers(app, pixelsPerUnit);
+
+			// Dragging to the right selects the shapes inside the
+			// rectangle. Dragging to the left also selects the shapes
+			// crossing its edges.
+			Vec2 startPx = {(f32) app.selectStartX, (f32) app.selectStartY};
+			Vec2 endPx = {(f32) app.selectEndX, (f32) app.selectEndY};
+			Vec2 start = unitsPerPixel * startPx + app.viewportMin;
+			Vec2 end = unitsPerPixel * endPx + app.viewportMin;
+			Vec2 min = {start.x < end.x ? start.x : end.x, start.y < end.y ? start.y : end.y};
+			Vec2 max = {start.x < end.x ? end.x : start.x, start.y < end.y ? end.y : start.y};
+			selectShapesInRect(app, min, max, app.selectEndX < app.selectStartX);
+			damageSelectionMarkers(app, pixelsPerUnit);
+		}
+		if (app.toggleLinearBlending)
+		{
+			app.toggleLinearBlending = false;
+			app.linearBlending = !app.linearBlending;
 			app.drawCanvas = true;
 		}
+		if (app.toggleAntialiasing)
+		{
+			app.toggleAntialiasing = false;
+			app.antialiasing = !app.antialiasing;
+			app.drawCanvas = true;
+		}
+		if (app.toggleShapeIds)
+		{
+			app.toggleShapeIds = false;
+			app.shapeIdsEnabled = !app.shapeIdsEnabled;
+			app.shapeIdsCurrent = false;
+			if (app.shapeIdsEnabled)
+			{
+				// the IDs are only written as the scene is drawn
+				app.drawCanvas = true;
+			} else if (app.shapeIds != nullptr)
+			{
+				PLATFORM_free(app.shapeIds);
+				app.shapeIds = nullptr;
+			}
+		}
+		if (app.removeSelectedShape)
+		{
+			app.removeSelectedShape = false;
+			damageSelectionMarkers(app, pixelsPerUnit);
+
+			// Removing a shape also deselects it, so the selection is
+			// copied and cleared first.
+			Selection& selection = app.selection;
+			u32 removeCount = selection.soa.count;
+			auto memMark = mark(app.scratchMem);
+			u32 *slots = allocateAlignedArray<u32>(app.scratchMem, removeCount, cacheLineSize);
+			for (u32 i = 0; i < removeCount; ++i)
+			{
+				slots[i] = selection.slots[i];
+			}
+			selection.soa.count = 0;
+
+			if (removeCount > maxDamageRectCount)
+			{
+				app.drawCanvas = true;
+			}
+			for (u32 i = 0; i < removeCount; ++i)
+			{
+				if (!app.drawCanvas)
+				{
+					Shape shape = getShape(app.scene, app.scene.refs[slots[i]]);
+					addDamage(app.damage, app.canvas, shapePixelBounds(shape, app.viewportMin, pixelsPerUnit));
+				}
+				removeShape(app, slotShapeHandle(app.scene, slots[i]));
+			}
+			release(app.scratchMem, memMark);
+		}
+		if (app.nudgeSelectionX != 0 || app.nudgeSelectionY != 0)
+		{
+			Vec2 stepsPx = {(f32) app.nudgeSelectionX, (f32) app.nudgeSelectionY};
+			Vec2 offset = (selectionNudgePx * unitsPerPixel) * stepsPx;
+			app.nudgeSelectionX = 0;
+			app.nudgeSelectionY = 0;
+			damageSelectionMarkers(app, pixelsPerUnit);
+
+			// Each shape damages where it was and where it ends up.
+			const Selection& selection = app.selection;
+			if (2 * selection.soa.count > maxDamageRectCount)
+			{
+				app.drawCanvas = true;
+			}
+			for (u32 i = 0; i < selection.soa.count; ++i)
+			{
+				u32 slot = selection.slots[i];
+				if (!app.drawCanvas)
+				{
+					Shape shape = getShape(app.scene, app.scene.refs[slot]);
+					addDamage(app.damage, app.canvas, shapePixelBounds(shape, app.viewportMin, pixelsPerUnit));
+				}
+				moveShape(app, slotShapeHandle(app.scene, slot), offset);
+				if (!app.drawCanvas)
+				{
+					Shape shape = getShape(app.scene, app.scene.refs[slot]);
+					addDamage(app.damage, app.canvas, shapePixelBounds(shape, app.viewportMin, pixelsPerUnit));
+				}
+			}
+			damageSelectionMarkers(app, pixelsPerUnit);
+		}
 	} break;
 	case ApplicationState::PANNING:
 	{
@@ -898,122 +6530,164 @@ void update(Application& app)
 		app.zoomStartY = app.mouseY;
 		app.drawCanvas = true;
 	} break;
+	case ApplicationState::SELECTING:
+	{
+		// Only the rectangle's outline changes while dragging.
+		if (app.selectEndX != app.mouseX || app.selectEndY != app.mouseY)
+		{
+			damageSelectionRect(app);
+			app.selectEndX = app.mouseX;
+			app.selectEndY = app.mouseY;
+			damageSelectionRect(app);
+		}
+	} break;
 	default:
 		unreachable();
 		break;
 	}
 
+	// The overlay shows how much memory each subsystem uses, so its
+	// line is redrawn when the totals change.
+	bool memoryChanged = false;
+	for (size_t s = 0; s < (size_t) MemSubsystem::Count; ++s)
+	{
+		if (app.overlayBytesUsed[s] != app.permanentMem.bytesUsed[s])
+		{
+			app.overlayBytesUsed[s] = app.permanentMem.bytesUsed[s];
+			memoryChanged = true;
+		}
+	}
+	if (memoryChanged)
+	{
+		damageOverlayLine(app, overlayMemoryLine);
+	}
+
+	// The overlay names the state, and outlines the rectangle being
+	// dragged while selecting.
+	if (app.state != app.overlayState)
+	{
+		damageOverlayLine(app, overlayStateLine);
+		if (app.state == ApplicationState::SELECTING
+			|| app.overlayState == ApplicationState::SELECTING)
+		{
+			damageSelectionRect(app);
+		}
+		app.overlayState = app.state;
+	}
+
 	// If the canvas has no area (width or height is zero), no
 	// pixels can be drawn, so we can skip drawing altogether.
 	// This case also causes the line drawing algorithm to fail,
 	// so this test avoids this problem as well.
-	if (app.drawCanvas && app.canvas.width > 0 && app.canvas.height > 0)
+	if ((app.drawCanvas || app.damage.rectCount > 0)
+		&& app.canvas.width > 0 && app.canvas.height > 0)
 	{
+		// Everything is drawn into `target`, which is resolved into the
+		// presented canvas at the end if it is the linear canvas.
+		Bitmap target = app.canvas;
+		if (app.linearBlending && resizeLinearCanvas(app))
+		{
+			target = app.linearCanvas;
+		}
+
+		// The scene is drawn into `sceneTarget`, which writes shape IDs
+		// too. The overlay isn't part of the scene, so it is drawn
+		// into `target`.
+		Bitmap sceneTarget = target;
+		sceneTarget.antialiased = app.antialiasing;
+		if (app.shapeIdsEnabled && resizeShapeIds(app))
+		{
+			sceneTarget.shapeIds = (u8*) app.shapeIds;
+			sceneTarget.shapeIdPitch = (i32) (app.canvas.width * sizeof(u32));
+			sceneTarget.shapeId = 0;
+		}
+
+		// Each damaged region is redrawn separately, which walks the
+		// scene once per region. Past a point, a full redraw is cheaper.
+		i64 damagedArea = 0;
+		for (u32 i = 0; i < app.damage.rectCount; ++i)
+		{
+			damagedArea += area(app.damage.rects[i]);
+		}
+		if (2 * damagedArea > area(drawableRect(target)))
+		{
+			app.drawCanvas = true;
+		}
+
 		ColorU8 background = {};
-		clearBitmap(app.canvas, background);
+		background.a = 255;
 
 		Vec2 viewportMin = app.viewportMin;
+		const Scene& scene = app.scene;
 
-		// Draw all shapes. A shape is transformed into window
-		// space prior to drawing it.
-		for (u32 i = 0; i < app.shapeCount; ++i)
+		if (app.drawCanvas)
 		{
-			Shape shape = app.shapes[i];
-			switch (shape.type)
-			{
-			case ShapeType::Rectangle:
+			auto memMark = mark(app.scratchMem);
+
+			bool tiled = PLATFORM_threadCount() > 1;
+			if (tiled)
 			{
-				RectF32 rect = globalToPixelSpace(
-					viewportMin, pixelsPerUnit, shape.data.rect);
-				fillRect(app.canvas, rect, shape.color);
-			} break;
-			case ShapeType::Line:
+				drawSceneTiled(
+					app.cpu, sceneTarget, background, scene, app.bvh, viewportMin, pixelsPerUnit, app.scratchMem);
+			} else
 			{
-				LineF32 line = globalToPixelSpace(
-					viewportMin, pixelsPerUnit, shape.data.line);
-				drawLine(app.canvas, line, shape.color);
-			} break;
-			default:
-				unreachable();
-				break;
+				clearBitmap(app.cpu, sceneTarget, background);
+				VisibleShapes visible = cullScene(
+					scene, app.bvh, sceneTarget, viewportMin, pixelsPerUnit, app.scratchMem);
+				ScenePx px = transformScene(
+					app.cpu, scene, visible, sceneTarget, viewportMin, pixelsPerUnit, app.scratchMem);
+				LineBatch batch;
+				batch.count = 0;
+				for (u32 d = 0; d < visible.rectCount + visible.lineCount; ++d)
+				{
+					drawShapePx(
+						app.cpu, sceneTarget, scene, px, visible.drawList[d], viewportMin, pixelsPerUnit, batch);
+				}
+				flushLineBatch(app.cpu, sceneTarget, batch, viewportMin, pixelsPerUnit);
 			}
-		}
 
-		// draw markers for the selected shape
-		if (app.shapeSelected)
-		{
-			Shape shape = app.shapes[app.selectedShapeIndex];
-			switch (shape.type)
-			{
-			case ShapeType::Rectangle:
+			release(app.scratchMem, memMark);
+
+			drawOverlay(app, target, pixelsPerUnit, app.scratchMem);
+
+			if (target.format == PixelFormat::LinearBgra16 && tiled)
 			{
-				RectF32 rect = globalToPixelSpace(
-					viewportMin, pixelsPerUnit, shape.data.rect);
-				Vec2 min = rect.min;
-				Vec2 max = min + Vec2{rect.width, rect.height};
-				Vec2 markers[4] = {
-					{min.x, min.y},
-					{min.x, max.y},
-					{max.x, min.y},
-					{max.x, max.y}};
-				drawSelectedShapeMarkers(app.canvas, 4, markers);
-			} break;
-			case ShapeType::Line:
+				resolveLinearCanvasTiled(app.cpu, target, app.canvas);
+			} else if (target.format == PixelFormat::LinearBgra16)
 			{
-				LineF32 line = globalToPixelSpace(
-					viewportMin, pixelsPerUnit, shape.data.line);
-				Vec2 markers[2] = {line.p1, line.p2};
-				drawSelectedShapeMarkers(app.canvas, 2, markers);
-			} break;
-			default:
-				unreachable();
-				break;
+				resolveLinearCanvas(app.cpu, target, app.canvas, drawableRect(target));
 			}
-		}
-
-		// draw help text in upper-left corner
+		} else
 		{
-			const char *stateText = "";
-			switch (app.state)
+			// The damage rectangles don't overlap, so each can be
+			// cleared and drawn into independently.
+			for (u32 i = 0; i < app.damage.rectCount; ++i)
 			{
-			case ApplicationState::DEFAULT:
-				break;
-			case ApplicationState::PANNING:
-				stateText = "Panning";
-				break;
-			case ApplicationState::ZOOMING:
-				stateText = "Zooming";
-				break;
-			default:
-				unreachable();
-				break;
+				PixelRect damaged = app.damage.rects[i];
+				RectF32 rect;
+				rect.min = {(f32) damaged.xMin, (f32) damaged.yMin};
+				rect.width = (f32) (damaged.xMax - damaged.xMin);
+				rect.height = (f32) (damaged.yMax - damaged.yMin);
+				fillRect(app.cpu, clipBitmap(sceneTarget, damaged), rect, background);
 			}
 
-			const char *lines[] =
-			{
-				"Hold Q: Pan",
-				"Hold Z: Zoom",
-				"S: Select shape under cursor",
-				stateText,
-			};
-
-			ColorU8 yellow = {};
-			yellow.r = 255;
-			yellow.g = 255;
-			yellow.b = 0;
-			yellow.a = 255;
+			auto memMark = mark(app.scratchMem);
+			drawDamagedShapes(
+				app.cpu, sceneTarget, scene, app.bvh, app.damage, viewportMin, pixelsPerUnit, app.scratchMem);
+			release(app.scratchMem, memMark);
 
-			i32 baseline = app.canvas.height - app.font.advanceY;
-			for (size_t i = 0; i < ArrayLength(lines); ++i)
+			for (u32 i = 0; i < app.damage.rectCount; ++i)
 			{
-				const char *line = lines[i];
-				size_t lineLength = cStringLength(line);
-				const char *lineEnd = line + lineLength;
-				i32 leftEdge = 5;
-				drawText(app.font, app.canvas, line, lineEnd, leftEdge, baseline, yellow);
-				baseline -= app.font.advanceY;
+				drawOverlay(app, clipBitmap(target, app.damage.rects[i]), pixelsPerUnit, app.scratchMem);
+
+				if (target.format == PixelFormat::LinearBgra16)
+				{
+					resolveLinearCanvas(app.cpu, target, app.canvas, app.damage.rects[i]);
+				}
 			}
 		}
+
+		app.shapeIdsCurrent = sceneTarget.shapeIds != nullptr;
 	}
 
 	assert(app.scratchMem.top == app.scratchMem.floor);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
 
 typedef int8_t i8;
@@ -22,10 +24,26 @@ struct FilePath
 	const char *_0;
 };
 
+// A stack allocator made of one or more memory blocks. The fields
+// describe the block currently being allocated from. When that block
+// fills up, a new block is chained on, and `next` points to a saved
+// copy of the previous block's state. Blocks emptied by `release` are
+// kept in the `retired` list, so they can be reused by later growth.
+//
+// A block's address space is reserved up front, but its pages are
+// only committed as the top advances. Memory below `committed` is
+// usable, and memory between `committed` and `ceiling` is reserved.
+//
+// `paddingBytes` counts the bytes skipped over to satisfy aligned
+// allocations over the lifetime of the stack.
 struct MemStack
 {
 	u8 *floor, *top, *ceiling;
+	u8 *committed;
 	MemStack *next;
+	MemStack *retired;
+	size_t paddingBytes;
+	bool largePages;
 };
 
 struct MemMarker
@@ -35,10 +53,22 @@ struct MemMarker
 
 #define unreachable() assert(false)
 
-#define stackAllocArray(mem, type, count) (type*) allocate(mem, sizeof(type) * count)
+// The size of a cache line on the processors we target. Buffers
+// accessed with SIMD loads and stores should be aligned to this.
+const size_t cacheLineSize = 64;
 
-MemStack newMemStack(size_t capacity);
+#define stackAllocArray(mem, type, count) (type*) allocateAligned(mem, sizeof(type) * (count), alignof(type))
+
+MemStack newMemStack(size_t capacity, bool largePages);
 u8* allocate(MemStack& m, size_t size);
+// `alignment` must be a power of two
+u8* allocateAligned(MemStack& m, size_t size, size_t alignment);
 MemMarker mark(MemStack m);
 void release(MemStack& m, MemMarker marker);
 
+template <typename T>
+inline T* allocateAlignedArray(MemStack& m, size_t count, size_t alignment)
+{
+	assert(alignment >= alignof(T));
+	return (T*) allocateAligned(m, sizeof(T) * count, alignment);
+}
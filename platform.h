@@ -24,8 +24,46 @@ enum class ReadFileError
 
 void* PLATFORM_alloc(size_t size);
 
+// Reserves a range of address space without committing any memory
+// to it. The size is rounded up to the page size used for the range.
+//
+// When `largePages` is set, the range is backed by large pages.
+// Operating systems generally require large pages to be committed
+// up front, so the whole range is committed before returning. If
+// large pages are unavailable, nullptr is returned.
+void* PLATFORM_reserve(size_t& size, bool largePages);
+
+// Commits memory in a range of reserved address space, so
+// that it can be accessed. The memory is zero-filled.
+bool PLATFORM_commit(void* memory, size_t size);
+
+// Returns the physical memory backing a committed range of
+// addresses to the OS. The range stays reserved, and can be
+// committed again later.
+bool PLATFORM_decommit(void* memory, size_t size);
+
 bool PLATFORM_free(void* memory);
 
+// Returns the size in bytes of the largest data cache on the
+// machine, or 0 if it cannot be determined.
+size_t PLATFORM_lastLevelCacheSize();
+
+// Returns a monotonic timestamp. Divide differences between two
+// timestamps by PLATFORM_ticksPerSecond() to get seconds.
+u64 PLATFORM_ticks();
+u64 PLATFORM_ticksPerSecond();
+
+typedef void PlatformWorkFn(void *data, u32 index);
+
+// Returns the number of threads PLATFORM_parallelFor spreads work
+// across, including the calling thread.
+u32 PLATFORM_threadCount();
+
+// Calls `work(data, i)` once for every i in [0, count), spread across
+// the worker threads and the calling thread, and returns once all of
+// the calls have finished. The calls may run in any order.
+void PLATFORM_parallelFor(PlatformWorkFn *work, void *data, u32 count);
+
 void PLATFORM_readWholeFile(
 	MemStack& mem,
 	FilePath filePath,
@@ -1,3 +1,5 @@
+#include <cstdio>
+
 void drawTestGradient(Bitmap canvas)
 {
 	auto *pPixels = canvas.pixels;
@@ -21,23 +23,23 @@ void drawTestGradient(Bitmap canvas)
 	}
 }
 
-void testClearBitmap(Bitmap canvas)
+void testClearBitmap(const CpuFeatures& cpu, Bitmap canvas)
 {
 	ColorU8 color = {};
 	color.r = 255;
 	color.g = 127;
 	color.b = 0;
-	color.a = 0;
-	clearBitmap(canvas, color);
+	color.a = 255;
+	clearBitmap(cpu, canvas, color);
 }
 
-void drawTestRectangles(Bitmap canvas)
+void drawTestRectangles(const CpuFeatures& cpu, Bitmap canvas)
 {
 	ColorU8 color = {};
 	color.r = 0;
 	color.g = 0;
 	color.b = 255;
-	color.a = 0;
+	color.a = 255;
 
 	RectF32 rect = {};
 	rect.width = 100.0f;
@@ -45,31 +47,61 @@ void drawTestRectangles(Bitmap canvas)
 
 	// bottom-left corner
 	rect.min = {-50.0f, -50.0f};
-	fillRect(canvas, rect, color);
+	fillRect(cpu, canvas, rect, color);
 
 	// top-left corner
 	rect.min = {
 		-50.0f,
 		canvas.height - rect.height + 50.0f};
-	fillRect(canvas, rect, color);
+	fillRect(cpu, canvas, rect, color);
 
 	// top-right corner
 	rect.min = {
 		canvas.width - rect.width + 50.0f,
 		canvas.height - rect.height + 50.0f};
-	fillRect(canvas, rect, color);
+	fillRect(cpu, canvas, rect, color);
 
 	// bottom-right corner
 	rect.min = {
 		canvas.width - rect.width + 50.0f,
 		-50.0};
-	fillRect(canvas, rect, color);
+	fillRect(cpu, canvas, rect, color);
 
 	// zero-area rectangle
 	rect.min = {0.0f, 0.0f};
 	rect.width = 0.0f;
 	rect.height = 0.0f;
-	fillRect(canvas, rect, color);
+	fillRect(cpu, canvas, rect, color);
+}
+
+// Overlapping translucent rectangles and lines. Where everything
+// overlaps, each fill should still show through the ones on top.
+void drawTestTranslucentShapes(const CpuFeatures& cpu, Bitmap canvas)
+{
+	ColorU8 colors[3] = {};
+	colors[0].r = 255;
+	colors[0].a = 160;
+	colors[1].g = 255;
+	colors[1].a = 96;
+	colors[2].b = 255;
+	colors[2].a = 32;
+
+	RectF32 rect = {};
+	rect.width = 200.0f;
+	rect.height = 150.0f;
+
+	LineF32 line = {};
+
+	for (u32 i = 0; i < ArrayLength(colors); ++i)
+	{
+		// odd offsets so that spans start and end unaligned
+		rect.min = {50.0f + 61.0f * i, 50.0f + 37.0f * i};
+		fillRect(cpu, canvas, rect, colors[i]);
+
+		line.p1 = rect.min;
+		line.p2 = rect.min + Vec2{rect.width, rect.height};
+		drawLine(canvas, line, colors[i]);
+	}
 }
 
 void drawTestLines(Bitmap canvas)
@@ -78,7 +110,7 @@ void drawTestLines(Bitmap canvas)
 	color.r = 255;
 	color.g = 128;
 	color.b = 0;
-	color.a = 0;
+	color.a = 255;
 
 	LineF32 line = {};
 
@@ -120,7 +152,7 @@ void drawTestLines(Bitmap canvas)
 	color.r = 128;
 	color.g = 0;
 	color.b = 255;
-	color.a = 0;
+	color.a = 255;
 
 	// between clip regions
 	Vec2 points[] =
@@ -250,3 +282,462 @@ void testDrawText(const AsciiFont& font, Bitmap canvas)
 	}
 }
 
+
+// The byte-at-a-time loop fillRect used before it had a span kernel,
+// kept as a baseline for benchmarkSpanFill.
+static void fillRectBytewise(Bitmap canvas, u32 xMin, u32 yMin, u32 width, u32 height, ColorU8 color)
+{
+	auto *pPixels = canvas.pixels + yMin * canvas.pitch;
+	for (u32 y = yMin; y < yMin + height; ++y)
+	{
+		auto pRow = pPixels + xMin * 4;
+		for (u32 x = xMin; x < xMin + width; ++x)
+		{
+			pRow[0] = color.b;
+			pRow[1] = color.g;
+			pRow[2] = color.r;
+			pRow[3] = color.a;
+			pRow += 4;
+		}
+		pPixels += canvas.pitch;
+	}
+}
+
+// Times the byte loop against the span kernel for a range of span
+// widths, and prints nanoseconds per pixel for each onto the canvas.
+// Spans start one pixel in, so the kernel's unaligned head and tail
+// are included in the timings.
+void benchmarkSpanFill(const CpuFeatures& cpu, const AsciiFont& font, Bitmap canvas)
+{
+	ColorU8 color = {};
+	color.r = 0;
+	color.g = 128;
+	color.b = 255;
+	color.a = 255;
+
+	ColorU8 textColor;
+	textColor.r = 255;
+	textColor.g = 255;
+	textColor.b = 255;
+	textColor.a = 255;
+
+	u32 spanWidths[] = {1, 3, 8, 17, 64, 255, 1024, 4096};
+	u32 height = canvas.height < 64 ? canvas.height : 64;
+	u32 pixelsPerRun = 1 << 24;
+	f64 nsPerTick = 1.0e9 / (f64) PLATFORM_ticksPerSecond();
+
+	i32 baseline = canvas.height - 20;
+	for (u32 i = 0; i < ArrayLength(spanWidths); ++i)
+	{
+		u32 width = spanWidths[i];
+		if (width + 1 > canvas.width || height == 0)
+		{
+			break;
+		}
+
+		u32 repeatCount = pixelsPerRun / (width * height) + 1;
+		f64 pixelCount = (f64) repeatCount * width * height;
+
+		u64 start = PLATFORM_ticks();
+		for (u32 r = 0; r < repeatCount; ++r)
+		{
+			fillRectBytewise(canvas, 1, 0, width, height, color);
+		}
+		f64 bytewiseNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / pixelCount;
+
+		RectF32 rect = {};
+		rect.min = {1.0f, 0.0f};
+		rect.width = (f32) width;
+		rect.height = (f32) height;
+
+		start = PLATFORM_ticks();
+		for (u32 r = 0; r < repeatCount; ++r)
+		{
+			fillRect(cpu, canvas, rect, color);
+		}
+		f64 spanNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / pixelCount;
+
+		char text[128];
+		i32 textLength = snprintf(
+			text, sizeof(text),
+			"width %4u: bytewise %.3f ns/px, span %.3f ns/px",
+			width, bytewiseNs, spanNs);
+		drawText(font, canvas, text, text + textLength, 10, baseline, textColor);
+		baseline -= font.advanceY;
+	}
+}
+
+// Returns a pseudo-random number in [0, 1), advancing `state`.
+static f32 nextRandom(u32& state)
+{
+	state = state * 1664525u + 1013904223u;
+	return (f32) (state >> 8) / (f32) (1 << 24);
+}
+
+// Times drawLine against drawLineRunSlice for lines of several slopes,
+// and prints nanoseconds per pixel for each onto the canvas. Each line
+// starts in the bottom-left corner and reaches as far as the canvas
+// allows. Then times drawing a batch of short lines, most of which
+// miss the canvas, with drawLines against one drawLineRunSlice call
+// per line.
+void benchmarkLineDrawing(const CpuFeatures& cpu, const AsciiFont& font, Bitmap canvas)
+{
+	ColorU8 color = {};
+	color.r = 0;
+	color.g = 128;
+	color.b = 255;
+	color.a = 255;
+
+	ColorU8 textColor;
+	textColor.r = 255;
+	textColor.g = 255;
+	textColor.b = 255;
+	textColor.a = 255;
+
+	struct LineSlope
+	{
+		const char *name;
+		f32 rise, run;
+	};
+	LineSlope slopes[] =
+	{
+		{"horizontal", 0.0f, 1.0f},
+		{"vertical", 1.0f, 0.0f},
+		{"45 degrees", 1.0f, 1.0f},
+		{"slope 1/20", 1.0f, 20.0f},
+		{"slope 1/5", 1.0f, 5.0f},
+		{"slope 5", 5.0f, 1.0f},
+	};
+
+	f32 length = (f32) (canvas.width < canvas.height ? canvas.width : canvas.height) - 1.0f;
+	if (length < 1.0f)
+	{
+		return;
+	}
+	u32 pixelsPerRun = 1 << 24;
+	f64 nsPerTick = 1.0e9 / (f64) PLATFORM_ticksPerSecond();
+
+	i32 baseline = canvas.height - 20;
+	for (u32 i = 0; i < ArrayLength(slopes); ++i)
+	{
+		LineSlope slope = slopes[i];
+		f32 scale = length / (slope.rise > slope.run ? slope.rise : slope.run);
+		Vec2 extent = {slope.run * scale, slope.rise * scale};
+		u32 pixelsPerLine = (u32) (extent.x > extent.y ? extent.x : extent.y) + 1;
+		u32 repeatCount = pixelsPerRun / pixelsPerLine + 1;
+		f64 pixelCount = (f64) repeatCount * pixelsPerLine;
+
+		LineF32 line = {};
+		line.p1 = {0.0f, 0.0f};
+		line.p2 = extent;
+		u64 start = PLATFORM_ticks();
+		for (u32 r = 0; r < repeatCount; ++r)
+		{
+			drawLine(canvas, line, color);
+		}
+		f64 bresenhamNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / pixelCount;
+
+		start = PLATFORM_ticks();
+		for (u32 r = 0; r < repeatCount; ++r)
+		{
+			drawLineRunSlice(cpu, canvas, line, color);
+		}
+		f64 runSliceNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / pixelCount;
+
+		Bitmap antialiased = canvas;
+		antialiased.antialiased = true;
+		start = PLATFORM_ticks();
+		for (u32 r = 0; r < repeatCount; ++r)
+		{
+			drawLineRunSlice(cpu, antialiased, line, color);
+		}
+		f64 antialiasedNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / pixelCount;
+
+		char text[128];
+		i32 textLength = snprintf(
+			text, sizeof(text),
+			"%-10s: Bresenham %.3f ns/px, run-slice %.3f ns/px, anti-aliased %.3f ns/px",
+			slope.name, bresenhamNs, runSliceNs, antialiasedNs);
+		drawText(font, canvas, text, text + textLength, 10, baseline, textColor);
+		baseline -= font.advanceY;
+	}
+
+	// The lines are spread over three times the canvas in each
+	// direction, as in a zoomed in scene, so about one in nine of them
+	// needs to be drawn. drawLines takes world space lines, and world
+	// space here is pixel space.
+	const u32 batchLineCount = 1024;
+	LineF32 batchLines[batchLineCount];
+	ColorU8 batchColors[batchLineCount];
+	u32 randomState = 1;
+	f32 width = (f32) canvas.width;
+	f32 height = (f32) canvas.height;
+	for (u32 i = 0; i < batchLineCount; ++i)
+	{
+		Vec2 p1 = {(3.0f * nextRandom(randomState) - 1.0f) * width, (3.0f * nextRandom(randomState) - 1.0f) * height};
+		Vec2 offset = {(nextRandom(randomState) - 0.5f) * 64.0f, (nextRandom(randomState) - 0.5f) * 64.0f};
+		batchLines[i].p1 = p1;
+		batchLines[i].p2 = p1 + offset;
+		batchColors[i] = color;
+	}
+
+	u32 batchRepeatCount = 256;
+	f64 lineCount = (f64) batchRepeatCount * batchLineCount;
+	u64 start = PLATFORM_ticks();
+	for (u32 r = 0; r < batchRepeatCount; ++r)
+	{
+		for (u32 i = 0; i < batchLineCount; ++i)
+		{
+			drawLineRunSlice(cpu, canvas, batchLines[i], batchColors[i]);
+		}
+	}
+	f64 perLineNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / lineCount;
+
+	start = PLATFORM_ticks();
+	for (u32 r = 0; r < batchRepeatCount; ++r)
+	{
+		drawLines(cpu, canvas, batchLines, batchColors, nullptr, batchLineCount, Vec2{0.0f, 0.0f}, 1.0f);
+	}
+	f64 batchNs = (f64) (PLATFORM_ticks() - start) * nsPerTick / lineCount;
+
+	char text[128];
+	i32 textLength = snprintf(
+		text, sizeof(text),
+		"%u short lines: one call each %.1f ns/line, drawLines %.1f ns/line",
+		batchLineCount, perLineNs, batchNs);
+	drawText(font, canvas, text, text + textLength, 10, baseline, textColor);
+}
+
+// Redraws the canvas from scratch and marks it presented.
+static void drawFullFrame(Application& app)
+{
+	app.drawCanvas = true;
+	update(app);
+	app.drawCanvas = false;
+	app.damage.rectCount = 0;
+}
+
+// Removes shapes that cross the edges of the canvas, or lie just past
+// them, one at a time through the selection, so only the damage they
+// and their markers leave is redrawn. Each result is compared against
+// a full redraw. Returns how many of the partial redraws differ. The
+// scene gains a translucent rectangle covering the whole view, so any
+// shape drawn twice over it shows.
+u32 testEdgeDamage(Application& app)
+{
+	if (app.canvas.width == 0 || app.canvas.height == 0)
+	{
+		return 0;
+	}
+
+	f32 unitsPerPixel = app.viewportSize / (f32) app.canvas.height;
+	Vec2 min = app.viewportMin;
+	Vec2 size = {(f32) app.canvas.width * unitsPerPixel, (f32) app.canvas.height * unitsPerPixel};
+	Vec2 max = min + size;
+	Vec2 center = min + 0.5f * size;
+	Vec2 margin = 0.1f * size;
+
+	ColorU8 translucent = {};
+	translucent.r = 200;
+	translucent.g = 40;
+	translucent.b = 40;
+	translucent.a = 100;
+	RectF32 backdrop = {};
+	backdrop.min = min - margin;
+	backdrop.width = size.x + 2.0f * margin.x;
+	backdrop.height = size.y + 2.0f * margin.y;
+	addRect(app, backdrop, translucent);
+
+	// Lines from the center out past each edge and corner, and small
+	// rectangles straddling each edge and lying just past it.
+	ColorU8 color = {};
+	color.r = 40;
+	color.g = 200;
+	color.b = 255;
+	color.a = 160;
+	Vec2 edges[4] = {{center.x, min.y}, {center.x, max.y}, {min.x, center.y}, {max.x, center.y}};
+	Vec2 outside[8] = {
+		{center.x, min.y - margin.y}, {center.x, max.y + margin.y},
+		{min.x - margin.x, center.y}, {max.x + margin.x, center.y},
+		min - margin, max + margin,
+		{min.x - margin.x, max.y + margin.y}, {max.x + margin.x, min.y - margin.y}};
+	ShapeHandle handles[16];
+	u32 handleCount = 0;
+	for (u32 i = 0; i < 8; ++i)
+	{
+		LineF32 line = {};
+		line.p1 = center;
+		line.p2 = outside[i];
+		handles[handleCount++] = addLine(app, line, color);
+	}
+	for (u32 i = 0; i < 4; ++i)
+	{
+		RectF32 rect = {};
+		rect.width = margin.x;
+		rect.height = margin.y;
+		rect.min = edges[i] - 0.5f * margin;
+		handles[handleCount++] = addRect(app, rect, color);
+		rect.min = outside[i] - 0.5f * margin;
+		handles[handleCount++] = addRect(app, rect, color);
+	}
+
+	size_t rowSize = (size_t) app.canvas.width * 4;
+	// update needs the scratch stack empty, so the copy lives elsewhere
+	auto *damaged = (u8*) PLATFORM_alloc(rowSize * app.canvas.height);
+	if (damaged == nullptr)
+	{
+		return 0;
+	}
+	u32 failureCount = 0;
+	for (u32 i = 0; i < handleCount; ++i)
+	{
+		u32 slot;
+		if (!resolveShapeHandle(app.scene, handles[i], slot))
+		{
+			continue;
+		}
+		setSelection(app.selection, 1, &slot, app.scratchMem);
+		drawFullFrame(app);
+
+		app.removeSelectedShape = true;
+		update(app);
+		bool partial = !app.drawCanvas;
+		for (u32 y = 0; y < app.canvas.height; ++y)
+		{
+			memcpy(damaged + y * rowSize, app.canvas.pixels + y * app.canvas.pitch, rowSize);
+		}
+		app.drawCanvas = false;
+		app.damage.rectCount = 0;
+
+		drawFullFrame(app);
+		for (u32 y = 0; y < app.canvas.height && partial; ++y)
+		{
+			if (memcmp(damaged + y * rowSize, app.canvas.pixels + y * app.canvas.pitch, rowSize) != 0)
+			{
+				++failureCount;
+				break;
+			}
+		}
+	}
+	PLATFORM_free(damaged);
+	return failureCount;
+}
+
+// Scatters small shapes over the view and moves a third of them at a
+// time, then checks that the BVH and the grid, which moveShape updates
+// in place, still answer like testing every shape does. Each round
+// culls a zoomed in view both ways, and picks at the middle of each
+// moved shape. Returns how many of the queries differ. The shapes
+// are removed again at the end.
+u32 testMovedShapeQueries(Application& app)
+{
+	if (app.canvas.width == 0 || app.canvas.height == 0)
+	{
+		return 0;
+	}
+
+	f32 unitsPerPixel = app.viewportSize / (f32) app.canvas.height;
+	f32 pixelsPerUnit = 1.0f / unitsPerPixel;
+	Vec2 size = {(f32) app.canvas.width * unitsPerPixel, (f32) app.canvas.height * unitsPerPixel};
+
+	const u32 shapeCount = 4096;
+	auto *handles = (ShapeHandle*) PLATFORM_alloc(shapeCount * sizeof(ShapeHandle));
+	if (handles == nullptr)
+	{
+		return 0;
+	}
+	ColorU8 color = {};
+	color.r = 40;
+	color.g = 200;
+	color.b = 255;
+	color.a = 255;
+	u32 random = 1;
+	for (u32 i = 0; i < shapeCount; ++i)
+	{
+		Vec2 p = app.viewportMin + Vec2{nextRandom(random) * size.x, nextRandom(random) * size.y};
+		Vec2 extent = 0.02f * Vec2{nextRandom(random) * size.x, nextRandom(random) * size.y};
+		if (i % 2 == 0)
+		{
+			RectF32 rect = {};
+			rect.min = p;
+			rect.width = extent.x;
+			rect.height = extent.y;
+			handles[i] = addRect(app, rect, color);
+		} else
+		{
+			LineF32 line = {};
+			line.p1 = p;
+			line.p2 = p + extent;
+			handles[i] = addLine(app, line, color);
+		}
+	}
+	// builds the BVH
+	drawFullFrame(app);
+
+	const Scene& scene = app.scene;
+	f32 maxDistPx = 5.0f;
+	f32 ppuSq = pixelsPerUnit * pixelsPerUnit;
+	f32 maxDistSqPx = maxDistPx * maxDistPx;
+	f32 maxDist = (maxDistPx + 1.0f) * unitsPerPixel;
+	// Culling with an empty BVH tests every shape.
+	ShapeBvh noBvh = {};
+	u32 failureCount = 0;
+	for (u32 round = 0; round < 8; ++round)
+	{
+		for (u32 i = round % 3; i < shapeCount; i += 3)
+		{
+			Vec2 offset = 0.2f * Vec2{(nextRandom(random) - 0.5f) * size.x, (nextRandom(random) - 0.5f) * size.y};
+			moveShape(app, handles[i], offset);
+		}
+
+		// A view a tenth the size of the canvas covers little enough
+		// of the scene that culling would use the BVH.
+		f32 zoomedPixelsPerUnit = 10.0f * pixelsPerUnit;
+		Vec2 zoomedMin = app.viewportMin + Vec2{nextRandom(random) * size.x, nextRandom(random) * size.y};
+		auto memMark = mark(app.scratchMem);
+		VisibleShapes found = cullSceneBvh(
+			scene, app.bvh, app.canvas, zoomedMin, zoomedPixelsPerUnit, app.scratchMem);
+		VisibleShapes all = cullScene(
+			scene, noBvh, app.canvas, zoomedMin, zoomedPixelsPerUnit, app.scratchMem);
+		u32 foundCount = found.rectCount + found.lineCount;
+		if (foundCount != all.rectCount + all.lineCount
+			|| memcmp(found.drawList, all.drawList, foundCount * sizeof(ShapeRef)) != 0)
+		{
+			++failureCount;
+		}
+		release(app.scratchMem, memMark);
+
+		for (u32 i = round % 3; i < shapeCount; i += 3)
+		{
+			u32 slot;
+			if (!resolveShapeHandle(scene, handles[i], slot))
+			{
+				continue;
+			}
+			Shape shape = getShape(scene, scene.refs[slot]);
+			Vec2 test = shape.type == ShapeType::Rectangle
+				? shape.data.rect.min + 0.5f * Vec2{shape.data.rect.width, shape.data.rect.height}
+				: 0.5f * (shape.data.line.p1 + shape.data.line.p2);
+
+			u32 allSlot, bvhSlot, gridSlot;
+			pickAllShapes(app.cpu, scene, test, ppuSq, maxDistSqPx, allSlot);
+			if (pickShapeBvh(app.cpu, scene, app.bvh, test, maxDist, ppuSq, maxDistSqPx, bvhSlot)
+				&& bvhSlot != allSlot)
+			{
+				++failureCount;
+			}
+			if (pickShapeGrid(scene, app.grid, test, maxDist, ppuSq, maxDistSqPx, gridSlot)
+				&& gridSlot != allSlot)
+			{
+				++failureCount;
+			}
+		}
+	}
+
+	for (u32 i = 0; i < shapeCount; ++i)
+	{
+		removeShape(app, handles[i]);
+	}
+	PLATFORM_free(handles);
+	return failureCount;
+}
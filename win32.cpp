@@ -26,6 +26,8 @@ struct Win32Bitmap
 static HDC hdcMem = nullptr;
 static DimensionU16 windowSize = {};
 static Win32Bitmap bitmap = {};
+// set at startup if the process may allocate large pages
+static bool largePagesEnabled = false;
 
 inline void* PLATFORM_alloc(size_t size)
 {
@@ -37,6 +39,231 @@ inline bool PLATFORM_free(void* memory)
 	return VirtualFree(memory, NULL, MEM_RELEASE) != 0;
 }
 
+inline void* PLATFORM_reserve(size_t& size, bool largePages)
+{
+	if (largePages)
+	{
+		// Without the privilege, see enableLargePages, the allocation
+		// would fail anyway.
+		SIZE_T largePageSize = GetLargePageMinimum();
+		if (!largePagesEnabled || largePageSize == 0)
+		{
+			return nullptr;
+		}
+		size = (size + largePageSize - 1) & ~(largePageSize - 1);
+		return VirtualAlloc(
+			NULL,
+			size,
+			MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+			PAGE_READWRITE);
+	}
+
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	size_t pageSize = systemInfo.dwPageSize;
+	size = (size + pageSize - 1) & ~(pageSize - 1);
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+inline bool PLATFORM_commit(void* memory, size_t size)
+{
+	return VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+inline bool PLATFORM_decommit(void* memory, size_t size)
+{
+	return VirtualFree(memory, size, MEM_DECOMMIT) != 0;
+}
+
+inline size_t PLATFORM_lastLevelCacheSize()
+{
+	DWORD bufferSize = 0;
+	GetLogicalProcessorInformation(nullptr, &bufferSize);
+	if (bufferSize == 0)
+	{
+		return 0;
+	}
+
+	auto *pInfo = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*) PLATFORM_alloc(bufferSize);
+	if (pInfo == nullptr)
+	{
+		return 0;
+	}
+
+	size_t cacheSize = 0;
+	if (GetLogicalProcessorInformation(pInfo, &bufferSize))
+	{
+		auto infoCount = bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
+		for (size_t i = 0; i < infoCount; ++i)
+		{
+			if (pInfo[i].Relationship == RelationCache
+				&& pInfo[i].Cache.Type != CacheInstruction
+				&& pInfo[i].Cache.Size > cacheSize)
+			{
+				cacheSize = pInfo[i].Cache.Size;
+			}
+		}
+	}
+
+	PLATFORM_free(pInfo);
+	return cacheSize;
+}
+
+inline u64 PLATFORM_ticks()
+{
+	LARGE_INTEGER ticks;
+	QueryPerformanceCounter(&ticks);
+	return (u64) ticks.QuadPart;
+}
+
+inline u64 PLATFORM_ticksPerSecond()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return (u64) frequency.QuadPart;
+}
+
+// Threads that PLATFORM_parallelFor hands work to. Each worker waits on
+// its own event, so every call wakes each worker exactly once, and no
+// worker can still be running one call when the next one begins.
+const u32 maxWorkerCount = 63;
+
+struct Win32WorkerPool
+{
+	u32 workerCount;
+	HANDLE wakeEvents[maxWorkerCount];
+	HANDLE doneEvent;
+
+	// the call currently being run
+	PlatformWorkFn *work;
+	void *data;
+	u32 count;
+	volatile LONG nextIndex;
+	volatile LONG busyWorkerCount;
+};
+
+static Win32WorkerPool workerPool = {};
+
+static void runParallelWork()
+{
+	for (;;)
+	{
+		LONG index = InterlockedIncrement(&workerPool.nextIndex) - 1;
+		if (index >= (LONG) workerPool.count)
+		{
+			break;
+		}
+		workerPool.work(workerPool.data, (u32) index);
+	}
+}
+
+static DWORD WINAPI workerThreadProc(LPVOID param)
+{
+	HANDLE wakeEvent = (HANDLE) param;
+	for (;;)
+	{
+		WaitForSingleObject(wakeEvent, INFINITE);
+		runParallelWork();
+		if (InterlockedDecrement(&workerPool.busyWorkerCount) == 0)
+		{
+			SetEvent(workerPool.doneEvent);
+		}
+	}
+}
+
+// Starts one worker thread per logical processor, besides the main
+// thread. If threads cannot be created, work runs on fewer of them.
+// Large pages require the "Lock pages in memory" privilege, which must
+// be granted to the user by an administrator, and then enabled in the
+// process's token. Returns whether it was enabled.
+static bool enableLargePages()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+
+	TOKEN_PRIVILEGES privileges = {};
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool enabled = LookupPrivilegeValueA(nullptr, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr)
+		// AdjustTokenPrivileges also succeeds when the user doesn't
+		// hold the privilege, but reports it as an error.
+		&& GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return enabled;
+}
+
+static void startWorkerThreads()
+{
+	workerPool.doneEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+	if (workerPool.doneEvent == NULL)
+	{
+		return;
+	}
+
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo(&systemInfo);
+	u32 workerCount = systemInfo.dwNumberOfProcessors - 1;
+	if (workerCount > maxWorkerCount)
+	{
+		workerCount = maxWorkerCount;
+	}
+
+	for (u32 i = 0; i < workerCount; ++i)
+	{
+		HANDLE wakeEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+		if (wakeEvent == NULL)
+		{
+			break;
+		}
+		HANDLE thread = CreateThread(NULL, 0, workerThreadProc, wakeEvent, 0, NULL);
+		if (thread == NULL)
+		{
+			CloseHandle(wakeEvent);
+			break;
+		}
+		CloseHandle(thread);
+		workerPool.wakeEvents[workerPool.workerCount] = wakeEvent;
+		++workerPool.workerCount;
+	}
+}
+
+inline u32 PLATFORM_threadCount()
+{
+	return workerPool.workerCount + 1;
+}
+
+void PLATFORM_parallelFor(PlatformWorkFn *work, void *data, u32 count)
+{
+	if (workerPool.workerCount == 0 || count <= 1)
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			work(data, i);
+		}
+		return;
+	}
+
+	workerPool.work = work;
+	workerPool.data = data;
+	workerPool.count = count;
+	workerPool.nextIndex = 0;
+	workerPool.busyWorkerCount = (LONG) workerPool.workerCount;
+
+	// SetEvent is a memory barrier, so the workers see the call
+	// written above.
+	for (u32 i = 0; i < workerPool.workerCount; ++i)
+	{
+		SetEvent(workerPool.wakeEvents[i]);
+	}
+
+	runParallelWork();
+	WaitForSingleObject(workerPool.doneEvent, INFINITE);
+}
+
 static ReadFileError getReadFileError()
 {
 	auto errorCode = GetLastError();
@@ -199,10 +426,44 @@ static LRESULT CALLBACK windowProc(
 				break;
 			case 'S':
 				app.selectShape = true;
+				break;
+			case 'M':
+				app.selectStartX = app.mouseX;
+				app.selectStartY = app.mouseY;
+				app.selectEndX = app.mouseX;
+				app.selectEndY = app.mouseY;
+				app.state = ApplicationState::SELECTING;
+				break;
+			case VK_DELETE:
+				app.removeSelectedShape = true;
+				break;
+			case VK_LEFT:
+				--app.nudgeSelectionX;
+				break;
+			case VK_RIGHT:
+				++app.nudgeSelectionX;
+				break;
+			// y grows upward, see WM_MOUSEMOVE
+			case VK_UP:
+				++app.nudgeSelectionY;
+				break;
+			case VK_DOWN:
+				--app.nudgeSelectionY;
+				break;
+			case 'G':
+				app.toggleLinearBlending = true;
+				break;
+			case 'A':
+				app.toggleAntialiasing = true;
+				break;
+			case 'I':
+				app.toggleShapeIds = true;
+				break;
 			}
 			break;
 		case ApplicationState::PANNING:
 		case ApplicationState::ZOOMING:
+		case ApplicationState::SELECTING:
 			break;
 		default:
 			unreachable();
@@ -229,6 +490,13 @@ static LRESULT CALLBACK windowProc(
 				app.state = ApplicationState::DEFAULT;
 			}
 			break;
+		case ApplicationState::SELECTING:
+			if (wParam == 'M')
+			{
+				app.selectShapesInRect = true;
+				app.state = ApplicationState::DEFAULT;
+			}
+			break;
 		default:
 			unreachable();
 			break;
@@ -287,6 +555,9 @@ static inline int run(HINSTANCE hInstance)
 		return 1;
 	}
 
+	startWorkerThreads();
+	largePagesEnabled = enableLargePages();
+
 	if (!init(app, FilePath{R"(C:\Windows\Fonts\Arial.ttf)"}))
 	{
 //TODO show error to user
@@ -308,10 +579,9 @@ static inline int run(HINSTANCE hInstance)
 
 		update(app);
 
-		if (app.drawCanvas)
+		if (app.drawCanvas || app.damage.rectCount > 0)
 		{
-			app.drawCanvas = false;
-			if (bitmap.pixels != nullptr)
+			if (bitmap.pixels != nullptr && app.drawCanvas)
 			{
 //TODO investigate if another bitmap blit function is more efficient:
 //
@@ -324,7 +594,28 @@ static inline int run(HINSTANCE hInstance)
 					&bitmap.bmi,
 					DIB_RGB_COLORS,
 					SRCCOPY);
+			} else if (bitmap.pixels != nullptr)
+			{
+				// Only copy the damaged regions. The window's y axis
+				// points down, while the bitmap is bottom-up, so the
+				// source rect is measured from the bottom of the bitmap.
+				for (u32 i = 0; i < app.damage.rectCount; ++i)
+				{
+					PixelRect rect = app.damage.rects[i];
+					int width = rect.xMax - rect.xMin;
+					int height = rect.yMax - rect.yMin;
+					StretchDIBits(
+						windowDc,
+						rect.xMin, (int) bitmap.height - rect.yMax, width, height,
+						rect.xMin, rect.yMin, width, height,
+						bitmap.pixels,
+						&bitmap.bmi,
+						DIB_RGB_COLORS,
+						SRCCOPY);
+				}
 			}
+			app.drawCanvas = false;
+			app.damage.rectCount = 0;
 		}
 	}
 